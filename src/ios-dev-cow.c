@@ -0,0 +1,473 @@
+/* ios-dev-cow.c - Copy-on-write overlay IO devices.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <xalloc.h>
+#include <string.h>
+
+#include "ios-dev.h"
+
+/* Copy-on-write devices are overlays on top of some other device,
+   the "base" device.  Reading them reads the base device, but writes
+   are kept in memory, in a "delta", and never reach the base device
+   unless they are explicitly committed.  Opening an overlay is cheap
+   regardless of the size of the base device, and it allows to try
+   changes in big images without copying them first.
+
+   Their handlers are of the form cow://HANDLER, where HANDLER is
+   the handler of the base device, like in cow://disk.img.  */
+
+#define IOS_DEV_COW_PAGE_SIZE 4096
+
+/* The delta is a set of pages, each holding a copy of a page of the
+   device which has been written.  BASE is the offset of the page in
+   the device, a multiple of IOS_DEV_COW_PAGE_SIZE.  The bytes of
+   DATA which are past the end of the device are zero.  */
+
+struct ios_dev_cow_page
+{
+  ios_dev_off base;
+  uint8_t data[IOS_DEV_COW_PAGE_SIZE];
+};
+
+/* State associated with a copy-on-write device.
+
+   BASE and BASE_IF are the base device and its interface.  BASE_SIZE
+   is the size of the base device, in bytes.
+
+   PAGES is an array of NUM_PAGES pages, sorted by offset, which make
+   the delta.  It has room for CAPACITY pages.
+
+   SIZE is the size of the device.  It is bigger than BASE_SIZE if
+   the device has been written past the end of the base device.
+
+   POS is the current position in the device, used by the
+   byte-oriented operations.  */
+
+struct ios_dev_cow
+{
+  void *base;
+  struct ios_dev_if *base_if;
+  ios_dev_off base_size;
+
+  struct ios_dev_cow_page **pages;
+  size_t num_pages;
+  size_t capacity;
+
+  ios_dev_off size;
+  ios_dev_off pos;
+};
+
+static int
+ios_dev_cow_handler_p (const char *handler)
+{
+  return (strlen (handler) > 6
+          && strncmp (handler, "cow://", 6) == 0);
+}
+
+static void *
+ios_dev_cow_open (const char *handler)
+{
+  struct ios_dev_cow *cio;
+  struct ios_dev_if *base_if;
+  void *base;
+
+  /* Skip the cow:// part in the handler, and open the base device.
+     The overlay needs to read and write it in bulk.  */
+  handler += 6;
+
+  base_if = ios_dev_lookup (handler);
+  if (base_if == NULL
+      || base_if->pread == NULL || base_if->pwrite == NULL)
+    return NULL;
+
+  base = base_if->open (handler);
+  if (base == NULL)
+    return NULL;
+
+  cio = xmalloc (sizeof (struct ios_dev_cow));
+  cio->base = base;
+  cio->base_if = base_if;
+  cio->pages = NULL;
+  cio->num_pages = 0;
+  cio->capacity = 0;
+  cio->pos = 0;
+
+  if (base_if->seek (base, 0, IOD_SEEK_END) == -1)
+    {
+      base_if->close (base);
+      free (cio);
+      return NULL;
+    }
+  cio->base_size = cio->size = base_if->tell (base);
+
+  return cio;
+}
+
+/* Discard the delta of the device CIO.  */
+
+static void
+ios_dev_cow_free_pages (struct ios_dev_cow *cio)
+{
+  size_t i;
+
+  for (i = 0; i < cio->num_pages; i++)
+    free (cio->pages[i]);
+  cio->num_pages = 0;
+}
+
+static int
+ios_dev_cow_close (void *iod)
+{
+  struct ios_dev_cow *cio = iod;
+  int ret = cio->base_if->close (cio->base);
+
+  ios_dev_cow_free_pages (cio);
+  free (cio->pages);
+  free (cio);
+  return ret;
+}
+
+/* Return the index in the delta of CIO of the first page whose offset
+   is bigger or equal than BASE.  */
+
+static size_t
+ios_dev_cow_search (struct ios_dev_cow *cio, ios_dev_off base)
+{
+  size_t lo = 0, hi = cio->num_pages;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (cio->pages[mid]->base < base)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+/* Return the page of the delta of CIO at offset BASE, or NULL if that
+   page hasn't been written.  */
+
+static struct ios_dev_cow_page *
+ios_dev_cow_lookup (struct ios_dev_cow *cio, ios_dev_off base)
+{
+  size_t i = ios_dev_cow_search (cio, base);
+
+  if (i < cio->num_pages && cio->pages[i]->base == base)
+    return cio->pages[i];
+  return NULL;
+}
+
+/* Read COUNT bytes at OFFSET from the base device of CIO, and put
+   them in BUF.  The bytes past the end of the base device are read
+   as zeroes.  Return 0 on success, -1 on error.  */
+
+static int
+ios_dev_cow_read_base (struct ios_dev_cow *cio, uint8_t *buf,
+                       size_t count, ios_dev_off offset)
+{
+  size_t avail = 0;
+
+  if (offset < cio->base_size)
+    {
+      ssize_t nbytes;
+
+      avail = cio->base_size - offset < count
+        ? cio->base_size - offset : count;
+      nbytes = cio->base_if->pread (cio->base, buf, avail, offset);
+      if (nbytes < 0)
+        return -1;
+      avail = nbytes;
+    }
+
+  memset (buf + avail, 0, count - avail);
+  return 0;
+}
+
+/* Return the page of the delta of CIO at offset BASE, copying it from
+   the base device if it hasn't been written yet.  Return NULL on
+   error.  */
+
+static struct ios_dev_cow_page *
+ios_dev_cow_get_page (struct ios_dev_cow *cio, ios_dev_off base)
+{
+  size_t i = ios_dev_cow_search (cio, base);
+  struct ios_dev_cow_page *page;
+
+  if (i < cio->num_pages && cio->pages[i]->base == base)
+    return cio->pages[i];
+
+  page = xmalloc (sizeof (struct ios_dev_cow_page));
+  page->base = base;
+  if (ios_dev_cow_read_base (cio, page->data, IOS_DEV_COW_PAGE_SIZE,
+                             base) == -1)
+    {
+      free (page);
+      return NULL;
+    }
+
+  if (cio->num_pages == cio->capacity)
+    {
+      cio->capacity = cio->capacity == 0 ? 16 : cio->capacity * 2;
+      cio->pages = xrealloc (cio->pages,
+                             cio->capacity * sizeof (*cio->pages));
+    }
+
+  memmove (cio->pages + i + 1, cio->pages + i,
+           (cio->num_pages - i) * sizeof (*cio->pages));
+  cio->pages[i] = page;
+  cio->num_pages++;
+  return page;
+}
+
+static ssize_t
+ios_dev_cow_pread (void *iod, void *buf, size_t count, ios_dev_off offset)
+{
+  struct ios_dev_cow *cio = iod;
+  uint8_t *bytes = buf;
+  size_t done = 0;
+
+  if (offset >= cio->size)
+    return 0;
+  if (count > cio->size - offset)
+    count = cio->size - offset;
+
+  /* Read page by page, from the delta if the page has been written or
+     from the base device otherwise.  */
+  while (done < count)
+    {
+      ios_dev_off pos = offset + done;
+      ios_dev_off base = pos & ~((ios_dev_off) IOS_DEV_COW_PAGE_SIZE - 1);
+      size_t chunk = base + IOS_DEV_COW_PAGE_SIZE - pos;
+      struct ios_dev_cow_page *page = ios_dev_cow_lookup (cio, base);
+
+      if (chunk > count - done)
+        chunk = count - done;
+
+      if (page)
+        memcpy (bytes + done, page->data + (pos - base), chunk);
+      else if (ios_dev_cow_read_base (cio, bytes + done, chunk, pos) == -1)
+        return -1;
+
+      done += chunk;
+    }
+
+  return count;
+}
+
+static ssize_t
+ios_dev_cow_pwrite (void *iod, const void *buf, size_t count,
+                    ios_dev_off offset)
+{
+  struct ios_dev_cow *cio = iod;
+  const uint8_t *bytes = buf;
+  size_t done = 0;
+
+  while (done < count)
+    {
+      ios_dev_off pos = offset + done;
+      ios_dev_off base = pos & ~((ios_dev_off) IOS_DEV_COW_PAGE_SIZE - 1);
+      size_t chunk = base + IOS_DEV_COW_PAGE_SIZE - pos;
+      struct ios_dev_cow_page *page = ios_dev_cow_get_page (cio, base);
+
+      if (page == NULL)
+        return -1;
+      if (chunk > count - done)
+        chunk = count - done;
+
+      memcpy (page->data + (pos - base), bytes + done, chunk);
+      done += chunk;
+    }
+
+  if (offset + count > cio->size)
+    cio->size = offset + count;
+
+  return count;
+}
+
+static int
+ios_dev_cow_getc (void *iod)
+{
+  struct ios_dev_cow *cio = iod;
+  uint8_t c;
+
+  if (ios_dev_cow_pread (cio, &c, 1, cio->pos) != 1)
+    return IOD_EOF;
+  cio->pos++;
+  return c;
+}
+
+static int
+ios_dev_cow_putc (void *iod, int c)
+{
+  struct ios_dev_cow *cio = iod;
+  uint8_t byte = c;
+
+  if (ios_dev_cow_pwrite (cio, &byte, 1, cio->pos) != 1)
+    return IOD_EOF;
+  cio->pos++;
+  return c;
+}
+
+static ios_dev_off
+ios_dev_cow_tell (void *iod)
+{
+  struct ios_dev_cow *cio = iod;
+  return cio->pos;
+}
+
+static int
+ios_dev_cow_seek (void *iod, ios_dev_off offset, int whence)
+{
+  struct ios_dev_cow *cio = iod;
+
+  switch (whence)
+    {
+    case IOD_SEEK_SET: cio->pos = offset; break;
+    case IOD_SEEK_CUR: cio->pos += offset; break;
+    case IOD_SEEK_END: cio->pos = cio->size + offset; break;
+    default:
+      assert (0);
+    }
+
+  return 0;
+}
+
+static void
+ios_dev_cow_advise (void *iod, ios_dev_off offset, size_t count)
+{
+  struct ios_dev_cow *cio = iod;
+
+  if (cio->base_if->advise)
+    cio->base_if->advise (cio->base, offset, count);
+}
+
+static int
+ios_dev_cow_delta (void *iod, ios_dev_off offset,
+                   ios_dev_off *start, size_t *count)
+{
+  struct ios_dev_cow *cio = iod;
+  ios_dev_off base = offset & ~((ios_dev_off) IOS_DEV_COW_PAGE_SIZE - 1);
+  size_t i = ios_dev_cow_search (cio, base);
+  ios_dev_off end;
+
+  if (i == cio->num_pages)
+    return 0;
+
+  /* Extend the range over the pages that follow it.  */
+  *start = cio->pages[i]->base > offset ? cio->pages[i]->base : offset;
+  end = cio->pages[i]->base + IOS_DEV_COW_PAGE_SIZE;
+  for (i++; i < cio->num_pages && cio->pages[i]->base == end; i++)
+    end += IOS_DEV_COW_PAGE_SIZE;
+
+  if (end > cio->size)
+    end = cio->size;
+  if (end <= *start)
+    return 0;
+
+  *count = end - *start;
+  return 1;
+}
+
+static int
+ios_dev_cow_commit (void *iod)
+{
+  struct ios_dev_cow *cio = iod;
+  uint8_t *old_data = NULL;
+  size_t *old_sizes = NULL;
+  size_t i, j;
+  int ret = 0;
+
+  if (cio->num_pages == 0)
+    return 0;
+
+  /* Save the contents of the base device that are going to be
+     overwritten, so they can be restored if some write fails.  That
+     way, either all the delta is written or nothing is.  */
+  old_data = xmalloc (cio->num_pages * IOS_DEV_COW_PAGE_SIZE);
+  old_sizes = xmalloc (cio->num_pages * sizeof (size_t));
+  for (i = 0; i < cio->num_pages; i++)
+    {
+      ios_dev_off base = cio->pages[i]->base;
+      ssize_t nbytes = 0;
+
+      if (base < cio->base_size)
+        nbytes = cio->base_if->pread (cio->base,
+                                      old_data + i * IOS_DEV_COW_PAGE_SIZE,
+                                      IOS_DEV_COW_PAGE_SIZE, base);
+      if (nbytes < 0)
+        {
+          ret = -1;
+          goto done;
+        }
+      old_sizes[i] = nbytes;
+    }
+
+  for (i = 0; i < cio->num_pages; i++)
+    {
+      struct ios_dev_cow_page *page = cio->pages[i];
+      size_t count = cio->size - page->base < IOS_DEV_COW_PAGE_SIZE
+        ? cio->size - page->base : IOS_DEV_COW_PAGE_SIZE;
+
+      if (cio->base_if->pwrite (cio->base, page->data, count,
+                                page->base) != (ssize_t) count)
+        break;
+    }
+
+  if (i < cio->num_pages)
+    {
+      for (j = 0; j <= i; j++)
+        cio->base_if->pwrite (cio->base,
+                              old_data + j * IOS_DEV_COW_PAGE_SIZE,
+                              old_sizes[j], cio->pages[j]->base);
+      ret = -1;
+      goto done;
+    }
+
+  /* The delta is now part of the base device.  */
+  ios_dev_cow_free_pages (cio);
+  cio->base_size = cio->size;
+
+ done:
+  free (old_data);
+  free (old_sizes);
+  return ret;
+}
+
+struct ios_dev_if ios_dev_cow =
+  {
+   .handler_p = ios_dev_cow_handler_p,
+   .open = ios_dev_cow_open,
+   .close = ios_dev_cow_close,
+   .tell = ios_dev_cow_tell,
+   .seek = ios_dev_cow_seek,
+   .get_c = ios_dev_cow_getc,
+   .put_c = ios_dev_cow_putc,
+   .pread = ios_dev_cow_pread,
+   .pwrite = ios_dev_cow_pwrite,
+   .advise = ios_dev_cow_advise,
+   .delta = ios_dev_cow_delta,
+   .commit = ios_dev_cow_commit,
+  };
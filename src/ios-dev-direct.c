@@ -0,0 +1,405 @@
+/* ios-dev-direct.c - Direct IO devices.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* We want 64-bit file offsets in all systems.  */
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <assert.h>
+#include <xalloc.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+# include <linux/fs.h>
+#endif
+
+#include "ios-dev.h"
+
+/* Direct IO devices access files, and specially block devices such as
+   disks, bypassing the buffers of the operating system, so that
+   reading the metadata of a live disk doesn't pollute the page cache
+   and the data isn't buffered twice, since the IOS layer has its own
+   cache.  Their handlers are of the form direct://PATH, like in
+   direct:///dev/sda.  Plain paths are also opened as direct IO
+   devices if enabled with ios_set_direct_io.
+
+   Direct IO requires the offsets, sizes and addresses of the transfers
+   to be aligned to the logical block size of the storage.  Unaligned
+   transfers are done through an aligned bounce buffer, reading the
+   partially covered blocks before writing them.  If the file system
+   doesn't support direct IO, the file is accessed normally.  */
+
+#ifndef O_DIRECT
+# define O_DIRECT 0
+#endif
+
+/* Alignment used for regular files, whose logical block size is not
+   known.  It is valid for all the common storage devices.  */
+
+#define IOS_DEV_DIRECT_ALIGN 4096
+
+/* Size of the bounce buffer.  */
+
+#define IOS_DEV_DIRECT_BUF_SIZE (64 * 1024)
+
+/* State associated with a direct IO device.
+
+   FD is a descriptor for the file, whose name is FILENAME.  BLOCK_P
+   is 1 if the file is a block device, and 0 if it is a regular
+   file.
+
+   ALIGN is the required alignment of the transfers, and BUF is a
+   bounce buffer of IOS_DEV_DIRECT_BUF_SIZE bytes aligned to ALIGN.
+
+   POS is the current position in the device, used by the
+   byte-oriented operations.  */
+
+struct ios_dev_direct
+{
+  int fd;
+  char *filename;
+  int block_p;
+  size_t align;
+  uint8_t *buf;
+  ios_dev_off pos;
+};
+
+/* Return the size of the device DIO, or -1 on error.  */
+
+static ios_dev_off
+ios_dev_direct_size (struct ios_dev_direct *dio)
+{
+  struct stat st;
+
+#ifdef BLKGETSIZE64
+  if (dio->block_p)
+    {
+      uint64_t size;
+
+      if (ioctl (dio->fd, BLKGETSIZE64, &size) == -1)
+        return -1;
+      return size;
+    }
+#endif
+
+  if (fstat (dio->fd, &st) == -1)
+    return -1;
+  return st.st_size;
+}
+
+static int
+ios_dev_direct_handler_p (const char *handler)
+{
+  if (strlen (handler) > 9
+      && strncmp (handler, "direct://", 9) == 0)
+    return 1;
+
+  /* Plain paths, which would otherwise be handled by the file
+     devices.  */
+  return (ios_dev_direct_io_p ()
+          && (strstr (handler, "://") == NULL
+              || strncmp (handler, "file://", 7) == 0));
+}
+
+static void *
+ios_dev_direct_open (const char *handler)
+{
+  struct ios_dev_direct *dio;
+  struct stat st;
+  void *buf;
+  int fd;
+
+  /* Skip the direct:// or file:// part in the handler, if needed.  */
+  if (strncmp (handler, "direct://", 9) == 0)
+    handler += 9;
+  else if (strncmp (handler, "file://", 7) == 0)
+    handler += 7;
+
+  fd = open (handler, O_RDWR | O_DIRECT);
+  if (fd == -1 && (errno == EACCES || errno == EROFS || errno == EPERM))
+    fd = open (handler, O_RDONLY | O_DIRECT);
+  if (fd == -1 && errno == EINVAL)
+    {
+      /* The file system doesn't support direct IO.  */
+      fd = open (handler, O_RDWR);
+      if (fd == -1)
+        fd = open (handler, O_RDONLY);
+    }
+  if (fd == -1 || fstat (fd, &st) == -1)
+    {
+      perror (handler);
+      if (fd != -1)
+        close (fd);
+      return NULL;
+    }
+
+  dio = xmalloc (sizeof (struct ios_dev_direct));
+  dio->fd = fd;
+  dio->filename = xstrdup (handler);
+  dio->block_p = S_ISBLK (st.st_mode);
+  dio->align = IOS_DEV_DIRECT_ALIGN;
+  dio->pos = 0;
+
+#ifdef BLKSSZGET
+  if (dio->block_p)
+    {
+      int sector_size;
+
+      if (ioctl (fd, BLKSSZGET, &sector_size) == 0
+          && sector_size > 0
+          && IOS_DEV_DIRECT_BUF_SIZE % sector_size == 0)
+        dio->align = sector_size;
+    }
+#endif
+
+  if (posix_memalign (&buf, dio->align, IOS_DEV_DIRECT_BUF_SIZE) != 0)
+    xalloc_die ();
+  dio->buf = buf;
+
+  return dio;
+}
+
+static int
+ios_dev_direct_close (void *iod)
+{
+  struct ios_dev_direct *dio = iod;
+  int ret = (close (dio->fd) == 0);
+
+  free (dio->buf);
+  free (dio->filename);
+  free (dio);
+  return ret;
+}
+
+/* Read the COUNT bytes at OFFSET in the device DIO, which are aligned
+   as required by direct IO, into BUF.  Return the number of bytes
+   read, which is less than COUNT only at the end of the device, or -1
+   on error.  */
+
+static ssize_t
+ios_dev_direct_read_aligned (struct ios_dev_direct *dio, void *buf,
+                             size_t count, ios_dev_off offset)
+{
+  size_t done = 0;
+
+  while (done < count)
+    {
+      ssize_t nbytes = pread (dio->fd, (uint8_t *) buf + done,
+                              count - done, offset + done);
+
+      if (nbytes == -1 && errno == EINTR)
+        continue;
+      if (nbytes == -1)
+        return done > 0 ? (ssize_t) done : -1;
+      if (nbytes == 0)
+        break;
+      done += nbytes;
+      /* Only whole blocks can be read until the end of the device.  */
+      if (done % dio->align != 0)
+        break;
+    }
+
+  return done;
+}
+
+static ssize_t
+ios_dev_direct_pread (void *iod, void *buf, size_t count, ios_dev_off offset)
+{
+  struct ios_dev_direct *dio = iod;
+  size_t align = dio->align;
+  size_t done = 0;
+
+  /* Aligned transfers to aligned buffers don't need the bounce
+     buffer.  */
+  if (offset % align == 0 && count % align == 0
+      && (uintptr_t) buf % align == 0)
+    return ios_dev_direct_read_aligned (dio, buf, count, offset);
+
+  while (done < count)
+    {
+      ios_dev_off pos = offset + done;
+      ios_dev_off base = pos - pos % align;
+      size_t skip = pos - base;
+      size_t chunk = count - done;
+      ssize_t nbytes;
+
+      if (chunk > IOS_DEV_DIRECT_BUF_SIZE - skip)
+        chunk = IOS_DEV_DIRECT_BUF_SIZE - skip;
+
+      nbytes = ios_dev_direct_read_aligned (dio, dio->buf,
+                                            (skip + chunk + align - 1)
+                                            / align * align,
+                                            base);
+      if (nbytes == -1)
+        return done > 0 ? (ssize_t) done : -1;
+      if ((size_t) nbytes <= skip)
+        break;
+
+      if (chunk > nbytes - skip)
+        {
+          /* The end of the device was reached.  */
+          memcpy ((uint8_t *) buf + done, dio->buf + skip, nbytes - skip);
+          done += nbytes - skip;
+          break;
+        }
+
+      memcpy ((uint8_t *) buf + done, dio->buf + skip, chunk);
+      done += chunk;
+    }
+
+  return done;
+}
+
+static ssize_t
+ios_dev_direct_pwrite (void *iod, const void *buf, size_t count,
+                       ios_dev_off offset)
+{
+  struct ios_dev_direct *dio = iod;
+  size_t align = dio->align;
+  ios_dev_off size = -1;
+  size_t done = 0;
+
+  if (!dio->block_p)
+    {
+      size = ios_dev_direct_size (dio);
+      if (size == (ios_dev_off) -1)
+        return -1;
+    }
+
+  while (done < count)
+    {
+      ios_dev_off pos = offset + done;
+      ios_dev_off base = pos - pos % align;
+      size_t skip = pos - base;
+      size_t chunk = count - done;
+      size_t len;
+      ssize_t nbytes;
+
+      if (chunk > IOS_DEV_DIRECT_BUF_SIZE - skip)
+        chunk = IOS_DEV_DIRECT_BUF_SIZE - skip;
+      len = (skip + chunk + align - 1) / align * align;
+
+      /* Preserve the contents of the blocks that are only partially
+         written.  The bytes past the end of the device are
+         zeroes.  */
+      if (skip != 0 || chunk != len)
+        {
+          nbytes = ios_dev_direct_read_aligned (dio, dio->buf, len, base);
+          if (nbytes == -1)
+            return -1;
+          memset (dio->buf + nbytes, 0, len - nbytes);
+        }
+
+      memcpy (dio->buf + skip, (const uint8_t *) buf + done, chunk);
+      while ((nbytes = pwrite (dio->fd, dio->buf, len, base)) == -1
+             && errno == EINTR)
+        ;
+      if (nbytes != (ssize_t) len)
+        return -1;
+      done += chunk;
+    }
+
+  /* Whole blocks were written, so regular files may have grown past
+     the written bytes.  */
+  if (!dio->block_p && count > 0)
+    {
+      ios_dev_off written_end = offset + count;
+      ios_dev_off end = (written_end + align - 1) / align * align;
+
+      if (end > size
+          && ftruncate (dio->fd,
+                        written_end > size ? written_end : size) == -1)
+        return -1;
+    }
+
+  return done;
+}
+
+static int
+ios_dev_direct_getc (void *iod)
+{
+  struct ios_dev_direct *dio = iod;
+  uint8_t c;
+
+  if (ios_dev_direct_pread (dio, &c, 1, dio->pos) != 1)
+    return IOD_EOF;
+  dio->pos++;
+  return c;
+}
+
+static int
+ios_dev_direct_putc (void *iod, int c)
+{
+  struct ios_dev_direct *dio = iod;
+  uint8_t byte = c;
+
+  if (ios_dev_direct_pwrite (dio, &byte, 1, dio->pos) != 1)
+    return IOD_EOF;
+  dio->pos++;
+  return c;
+}
+
+static ios_dev_off
+ios_dev_direct_tell (void *iod)
+{
+  struct ios_dev_direct *dio = iod;
+  return dio->pos;
+}
+
+static int
+ios_dev_direct_seek (void *iod, ios_dev_off offset, int whence)
+{
+  struct ios_dev_direct *dio = iod;
+  ios_dev_off size;
+
+  switch (whence)
+    {
+    case IOD_SEEK_SET: dio->pos = offset; break;
+    case IOD_SEEK_CUR: dio->pos += offset; break;
+    case IOD_SEEK_END:
+      size = ios_dev_direct_size (dio);
+      if (size == (ios_dev_off) -1)
+        return -1;
+      dio->pos = size + offset;
+      break;
+    default:
+      assert (0);
+    }
+
+  return 0;
+}
+
+struct ios_dev_if ios_dev_direct =
+  {
+   .handler_p = ios_dev_direct_handler_p,
+   .open = ios_dev_direct_open,
+   .close = ios_dev_direct_close,
+   .tell = ios_dev_direct_tell,
+   .seek = ios_dev_direct_seek,
+   .get_c = ios_dev_direct_getc,
+   .put_c = ios_dev_direct_putc,
+   .pread = ios_dev_direct_pread,
+   .pwrite = ios_dev_direct_pwrite,
+  };
@@ -28,6 +28,8 @@
 #include <assert.h>
 #include <xalloc.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "ios-dev.h"
 
@@ -136,6 +138,113 @@ ios_dev_file_seek (void *iod, ios_dev_off offset, int whence)
   return fseeko (fio->file, offset, fwhence);
 }
 
+static ssize_t
+ios_dev_file_pread (void *iod, void *buf, size_t count, ios_dev_off offset)
+{
+  struct ios_dev_file *fio = iod;
+  size_t ret;
+
+  if (fseeko (fio->file, offset, SEEK_SET) == -1)
+    return -1;
+
+  ret = fread (buf, 1, count, fio->file);
+  if (ret < count && ferror (fio->file))
+    {
+      clearerr (fio->file);
+      return -1;
+    }
+
+  return ret;
+}
+
+static ssize_t
+ios_dev_file_pwrite (void *iod, const void *buf, size_t count,
+                     ios_dev_off offset)
+{
+  struct ios_dev_file *fio = iod;
+  size_t ret;
+
+  if (fseeko (fio->file, offset, SEEK_SET) == -1)
+    return -1;
+
+  ret = fwrite (buf, 1, count, fio->file);
+  if (ret < count)
+    {
+      clearerr (fio->file);
+      return -1;
+    }
+
+  return ret;
+}
+
+static void
+ios_dev_file_advise (void *iod, ios_dev_off offset, size_t count)
+{
+#ifdef POSIX_FADV_WILLNEED
+  struct ios_dev_file *fio = iod;
+
+  /* This starts the read in the kernel and returns immediately.  */
+  posix_fadvise (fileno (fio->file), offset, count, POSIX_FADV_WILLNEED);
+#endif
+}
+
+#if defined SEEK_DATA && defined SEEK_HOLE
+
+/* Sparse files are supported in the systems where lseek can find the
+   holes, like in GNU/Linux.  */
+
+static int
+ios_dev_file_hole (void *iod, ios_dev_off offset, ios_dev_off *end)
+{
+  struct ios_dev_file *fio = iod;
+  int fd = fileno (fio->file);
+  off_t pos, data, hole;
+  struct stat st;
+  int ret;
+
+  /* The bytes still in the buffer of the stream are not in the file
+     yet, and would be taken as holes.  */
+  if (fflush (fio->file) != 0)
+    return -1;
+
+  pos = lseek (fd, 0, SEEK_CUR);
+  if (pos == -1)
+    return -1;
+
+  data = lseek (fd, offset, SEEK_DATA);
+  if (data == (off_t) offset)
+    {
+      hole = lseek (fd, offset, SEEK_HOLE);
+      if (hole == -1)
+        ret = -1;
+      else
+        {
+          *end = hole;
+          ret = 0;
+        }
+    }
+  else if (data != -1)
+    {
+      *end = data;
+      ret = 1;
+    }
+  else if (errno == ENXIO && fstat (fd, &st) == 0
+           && offset < (ios_dev_off) st.st_size)
+    {
+      /* There is no data after OFFSET, but the file doesn't end
+         there: it ends in a hole.  */
+      *end = st.st_size;
+      ret = 1;
+    }
+  else
+    ret = -1;
+
+  lseek (fd, pos, SEEK_SET);
+  return ret;
+}
+
+#endif /* SEEK_DATA && SEEK_HOLE */
+
 struct ios_dev_if ios_dev_file =
   {
    .handler_p = ios_dev_file_handler_p,
@@ -145,4 +254,10 @@ struct ios_dev_if ios_dev_file =
    .seek = ios_dev_file_seek,
    .get_c = ios_dev_file_getc,
    .put_c = ios_dev_file_putc,
+   .pread = ios_dev_file_pread,
+   .pwrite = ios_dev_file_pwrite,
+   .advise = ios_dev_file_advise,
+#if defined SEEK_DATA && defined SEEK_HOLE
+   .hole = ios_dev_file_hole,
+#endif
   };
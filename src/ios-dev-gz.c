@@ -0,0 +1,657 @@
+/* ios-dev-gz.c - Compressed file IO devices.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#if HAVE_ZLIB
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/* We want 64-bit file offsets in all systems.  */
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <assert.h>
+#include <xalloc.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "ios-dev.h"
+
+/* Compressed file devices present the decompressed contents of a
+   gzip file as a read-only device.  Their handlers are of the form
+   gz://PATH, like in gz://vmcore.gz.
+
+   Deflate streams can only be decompressed from the beginning.  In
+   order to support random access, the state of the decompressor is
+   saved at "checkpoints" located every IOS_DEV_GZ_SPAN bytes of
+   decompressed data, the first time the data is decompressed.
+   Reading the device then restarts decompression at the nearest
+   checkpoint preceding the requested offset, so at most
+   IOS_DEV_GZ_SPAN bytes have to be decompressed in excess.
+
+   If so requested, the index of checkpoints is saved in the file
+   PATH.pkidx when the device is closed, and used later when opening
+   the same file again.  */
+
+#define IOS_DEV_GZ_SPAN (1024 * 1024)
+#define IOS_DEV_GZ_WINSIZE 32768
+#define IOS_DEV_GZ_CHUNK 16384
+
+/* A checkpoint.
+
+   OUT is the offset in the decompressed data, and IN the offset in
+   the compressed file of the first complete byte of input following
+   the checkpoint.
+
+   BITS is the number of bits of the byte preceding IN that are
+   still to be decompressed, or 0 if the checkpoint is at a byte
+   boundary.
+
+   WINDOW contains the IOS_DEV_GZ_WINSIZE bytes of decompressed data
+   preceding the checkpoint, which are needed to restart the
+   decompression.  */
+
+struct ios_dev_gz_point
+{
+  ios_dev_off out;
+  ios_dev_off in;
+  int bits;
+  uint8_t window[IOS_DEV_GZ_WINSIZE];
+};
+
+/* State associated with a compressed file device.
+
+   FD is a descriptor for the compressed file, whose name is FILENAME.
+   ST contains its status at the time it was opened.
+
+   POINTS is an array of NUM_POINTS checkpoints, sorted by offset, with
+   room for CAPACITY checkpoints.  SAVE_INDEX is 1 if the index has
+   to be saved when the device is closed.
+
+   COMPLETE is 1 if the whole file has been decompressed once.  In
+   that case SIZE is the size of the decompressed data.
+
+   STRM is the decompressor, which has produced OUT_POS bytes of
+   decompressed data, and reads the compressed file at IN_POS.  STRM
+   is only valid if STRM_VALID is 1.  IN_BUF holds the input of the
+   decompressor, and WINDOW is a circular buffer holding its most
+   recent output.  RAW is 1 if STRM is decompressing a raw deflate
+   stream, after being restarted at a checkpoint.
+
+   POS is the current position in the device, used by the
+   byte-oriented operations.  */
+
+struct ios_dev_gz
+{
+  int fd;
+  char *filename;
+  struct stat st;
+
+  struct ios_dev_gz_point *points;
+  size_t num_points;
+  size_t capacity;
+  int save_index;
+
+  int complete;
+  ios_dev_off size;
+
+  z_stream strm;
+  int strm_valid;
+  int raw;
+  ios_dev_off out_pos;
+  ios_dev_off in_pos;
+  uint8_t in_buf[IOS_DEV_GZ_CHUNK];
+  uint8_t window[IOS_DEV_GZ_WINSIZE];
+
+  ios_dev_off pos;
+};
+
+/* Saved indexes start with the magic bytes IOS_DEV_GZ_INDEX_MAGIC,
+   followed by the size and modification time of the compressed file,
+   the size of the decompressed data and the number of checkpoints,
+   all of them encoded as 64-bit big-endian numbers.  Then come the
+   checkpoints, each one encoded as OUT and IN in 64-bit big-endian
+   numbers, BITS in a byte and WINDOW.  */
+
+#define IOS_DEV_GZ_INDEX_MAGIC "POKEGZX1"
+#define IOS_DEV_GZ_INDEX_SUFFIX ".pkidx"
+
+static void
+ios_dev_gz_put (uint8_t *bytes, uint64_t value)
+{
+  int i;
+
+  for (i = 7; i >= 0; i--, value >>= 8)
+    bytes[i] = value & 0xff;
+}
+
+static uint64_t
+ios_dev_gz_get (const uint8_t *bytes)
+{
+  uint64_t value = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    value = (value << 8) | bytes[i];
+  return value;
+}
+
+static char *
+ios_dev_gz_index_name (struct ios_dev_gz *gio)
+{
+  char *name = xmalloc (strlen (gio->filename)
+                        + strlen (IOS_DEV_GZ_INDEX_SUFFIX) + 1);
+
+  strcpy (name, gio->filename);
+  strcat (name, IOS_DEV_GZ_INDEX_SUFFIX);
+  return name;
+}
+
+/* Load the index saved for the device GIO, if there is a valid one.
+   Return 1 if the index was loaded, 0 otherwise.  */
+
+static int
+ios_dev_gz_load_index (struct ios_dev_gz *gio)
+{
+  char *name = ios_dev_gz_index_name (gio);
+  FILE *f = fopen (name, "rb");
+  uint8_t header[40];
+  uint64_t num_points, i;
+
+  free (name);
+  if (f == NULL)
+    return 0;
+
+  /* The index is not valid if the compressed file has changed since
+     it was saved.  */
+  if (fread (header, 1, sizeof (header), f) != sizeof (header)
+      || memcmp (header, IOS_DEV_GZ_INDEX_MAGIC, 8) != 0
+      || ios_dev_gz_get (header + 8) != (uint64_t) gio->st.st_size
+      || ios_dev_gz_get (header + 16) != (uint64_t) gio->st.st_mtime)
+    goto error;
+
+  /* There is at most a checkpoint every IOS_DEV_GZ_SPAN bytes.  */
+  num_points = ios_dev_gz_get (header + 32);
+  if (num_points > ios_dev_gz_get (header + 24) / IOS_DEV_GZ_SPAN)
+    goto error;
+
+  gio->capacity = num_points ? num_points : 1;
+  gio->points = xmalloc (gio->capacity * sizeof (struct ios_dev_gz_point));
+
+  for (i = 0; i < num_points; i++)
+    {
+      struct ios_dev_gz_point *point = &gio->points[i];
+      uint8_t bytes[17];
+
+      if (fread (bytes, 1, sizeof (bytes), f) != sizeof (bytes)
+          || fread (point->window, 1, IOS_DEV_GZ_WINSIZE, f)
+             != IOS_DEV_GZ_WINSIZE)
+        goto error;
+
+      point->out = ios_dev_gz_get (bytes);
+      point->in = ios_dev_gz_get (bytes + 8);
+      point->bits = bytes[16];
+      if (point->bits > 7
+          || (i > 0 && point->out <= gio->points[i - 1].out))
+        goto error;
+    }
+
+  gio->num_points = num_points;
+  gio->size = ios_dev_gz_get (header + 24);
+  gio->complete = 1;
+  fclose (f);
+  return 1;
+
+ error:
+  free (gio->points);
+  gio->points = NULL;
+  gio->capacity = 0;
+  fclose (f);
+  return 0;
+}
+
+/* Save the index of the device GIO.  */
+
+static void
+ios_dev_gz_save_index (struct ios_dev_gz *gio)
+{
+  char *name = ios_dev_gz_index_name (gio);
+  FILE *f = fopen (name, "wb");
+  uint8_t header[40];
+  size_t i;
+  int ok;
+
+  if (f == NULL)
+    {
+      free (name);
+      return;
+    }
+
+  memcpy (header, IOS_DEV_GZ_INDEX_MAGIC, 8);
+  ios_dev_gz_put (header + 8, gio->st.st_size);
+  ios_dev_gz_put (header + 16, gio->st.st_mtime);
+  ios_dev_gz_put (header + 24, gio->size);
+  ios_dev_gz_put (header + 32, gio->num_points);
+  ok = (fwrite (header, 1, sizeof (header), f) == sizeof (header));
+
+  for (i = 0; ok && i < gio->num_points; i++)
+    {
+      struct ios_dev_gz_point *point = &gio->points[i];
+      uint8_t bytes[17];
+
+      ios_dev_gz_put (bytes, point->out);
+      ios_dev_gz_put (bytes + 8, point->in);
+      bytes[16] = point->bits;
+      ok = (fwrite (bytes, 1, sizeof (bytes), f) == sizeof (bytes)
+            && fwrite (point->window, 1, IOS_DEV_GZ_WINSIZE, f)
+               == IOS_DEV_GZ_WINSIZE);
+    }
+
+  /* Don't leave a broken index behind.  */
+  if (fclose (f) != 0 || !ok)
+    unlink (name);
+  free (name);
+}
+
+static int
+ios_dev_gz_handler_p (const char *handler)
+{
+  return (strlen (handler) > 5
+          && strncmp (handler, "gz://", 5) == 0);
+}
+
+static void *
+ios_dev_gz_open (const char *handler)
+{
+  struct ios_dev_gz *gio;
+  struct stat st;
+  int fd;
+
+  /* Skip the gz:// part in the handler.  */
+  handler += 5;
+
+  fd = open (handler, O_RDONLY);
+  if (fd == -1 || fstat (fd, &st) == -1)
+    {
+      perror (handler);
+      if (fd != -1)
+        close (fd);
+      return NULL;
+    }
+
+  gio = xmalloc (sizeof (struct ios_dev_gz));
+  gio->fd = fd;
+  gio->filename = xstrdup (handler);
+  gio->st = st;
+  gio->points = NULL;
+  gio->num_points = 0;
+  gio->capacity = 0;
+  gio->complete = 0;
+  gio->size = 0;
+  gio->strm_valid = 0;
+  gio->pos = 0;
+
+  gio->strm.zalloc = Z_NULL;
+  gio->strm.zfree = Z_NULL;
+  gio->strm.opaque = Z_NULL;
+  gio->strm.next_in = Z_NULL;
+  gio->strm.avail_in = 0;
+  if (inflateInit2 (&gio->strm, 15 + 32) != Z_OK)
+    {
+      close (fd);
+      free (gio->filename);
+      free (gio);
+      return NULL;
+    }
+
+  gio->save_index
+    = ios_dev_save_indexes_p () && !ios_dev_gz_load_index (gio);
+
+  return gio;
+}
+
+static int
+ios_dev_gz_close (void *iod)
+{
+  struct ios_dev_gz *gio = iod;
+  int ret = (close (gio->fd) == 0);
+
+  /* Only complete indexes are saved.  */
+  if (gio->save_index && gio->complete)
+    ios_dev_gz_save_index (gio);
+
+  inflateEnd (&gio->strm);
+  free (gio->points);
+  free (gio->filename);
+  free (gio);
+  return ret;
+}
+
+/* Restart the decompressor of GIO at the checkpoint POINT, or at the
+   beginning of the file if POINT is NULL.  Return 0 on success, -1 on
+   error.  */
+
+static int
+ios_dev_gz_restart (struct ios_dev_gz *gio, struct ios_dev_gz_point *point)
+{
+  gio->strm_valid = 0;
+  gio->strm.avail_in = 0;
+  gio->strm.avail_out = 0;
+
+  if (point == NULL)
+    {
+      if (inflateReset2 (&gio->strm, 15 + 32) != Z_OK)
+        return -1;
+      gio->out_pos = 0;
+      gio->in_pos = 0;
+      gio->raw = 0;
+    }
+  else
+    {
+      /* Checkpoints are in the middle of a deflate stream, which is
+         decompressed raw.  */
+      if (inflateReset2 (&gio->strm, -15) != Z_OK)
+        return -1;
+
+      gio->in_pos = point->in;
+      if (point->bits)
+        {
+          uint8_t c;
+
+          if (pread (gio->fd, &c, 1, point->in - 1) != 1
+              || inflatePrime (&gio->strm, point->bits,
+                               c >> (8 - point->bits)) != Z_OK)
+            return -1;
+        }
+
+      if (inflateSetDictionary (&gio->strm, point->window,
+                                IOS_DEV_GZ_WINSIZE) != Z_OK)
+        return -1;
+
+      gio->out_pos = point->out;
+      gio->raw = 1;
+      memcpy (gio->window, point->window, IOS_DEV_GZ_WINSIZE);
+    }
+
+  gio->strm_valid = 1;
+  return 0;
+}
+
+/* Add a checkpoint at the current position of the decompressor of
+   GIO.  */
+
+static void
+ios_dev_gz_add_point (struct ios_dev_gz *gio)
+{
+  struct ios_dev_gz_point *point;
+  size_t left = gio->strm.avail_out;
+
+  if (gio->num_points == gio->capacity)
+    {
+      gio->capacity = gio->capacity == 0 ? 8 : gio->capacity * 2;
+      gio->points = xrealloc (gio->points,
+                              gio->capacity
+                              * sizeof (struct ios_dev_gz_point));
+    }
+
+  point = &gio->points[gio->num_points++];
+  point->out = gio->out_pos;
+  point->in = gio->in_pos - gio->strm.avail_in;
+  point->bits = gio->strm.data_type & 7;
+
+  /* The window is a circular buffer, and the oldest bytes are the
+     ones that are going to be overwritten next.  */
+  memcpy (point->window, gio->window + IOS_DEV_GZ_WINSIZE - left, left);
+  memcpy (point->window + left, gio->window, IOS_DEV_GZ_WINSIZE - left);
+}
+
+/* Decompress the file of GIO until END bytes of decompressed data
+   have been produced, or the end of the data is reached.  The bytes
+   produced in the range [START, END) are copied into BUF, if it is
+   not NULL.  Return 0 on success, -1 on error.  */
+
+static int
+ios_dev_gz_inflate (struct ios_dev_gz *gio, uint8_t *buf,
+                    ios_dev_off start, ios_dev_off end)
+{
+  while (gio->out_pos < end)
+    {
+      uint8_t *out;
+      size_t have;
+      int ret;
+
+      if (gio->strm.avail_in == 0)
+        {
+          ssize_t nbytes = pread (gio->fd, gio->in_buf,
+                                  IOS_DEV_GZ_CHUNK, gio->in_pos);
+
+          if (nbytes < 0)
+            return -1;
+          if (nbytes == 0)
+            /* The file is truncated.  Provide what is there.  */
+            break;
+
+          gio->in_pos += nbytes;
+          gio->strm.next_in = gio->in_buf;
+          gio->strm.avail_in = nbytes;
+        }
+
+      if (gio->strm.avail_out == 0)
+        {
+          gio->strm.next_out = gio->window;
+          gio->strm.avail_out = IOS_DEV_GZ_WINSIZE;
+        }
+
+      out = gio->strm.next_out;
+      ret = inflate (&gio->strm, Z_BLOCK);
+      if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+        {
+          gio->strm_valid = 0;
+          return -1;
+        }
+
+      /* Copy the new output overlapping [START, END).  */
+      have = gio->strm.next_out - out;
+      if (buf && gio->out_pos + have > start)
+        {
+          ios_dev_off from = gio->out_pos > start ? gio->out_pos : start;
+          ios_dev_off to = gio->out_pos + have < end
+            ? gio->out_pos + have : end;
+
+          memcpy (buf + (from - start), out + (from - gio->out_pos),
+                  to - from);
+        }
+      gio->out_pos += have;
+
+      if (ret == Z_STREAM_END)
+        {
+          uint8_t c;
+
+          /* Raw deflate streams are not followed by the gzip trailer,
+             holding the CRC and the size of the member, so skip
+             it.  */
+          if (gio->raw)
+            {
+              size_t skip = gio->strm.avail_in < 8 ? gio->strm.avail_in : 8;
+
+              gio->strm.next_in += skip;
+              gio->strm.avail_in -= skip;
+              gio->in_pos += 8 - skip;
+              gio->raw = 0;
+            }
+
+          /* The file may contain several gzip members, one after the
+             other.  Anything else ends the data.  */
+          if (gio->strm.avail_in > 0)
+            c = *gio->strm.next_in;
+          else if (pread (gio->fd, &c, 1, gio->in_pos) != 1)
+            break;
+
+          if (c != 0x1f || inflateReset2 (&gio->strm, 15 + 16) != Z_OK)
+            break;
+          continue;
+        }
+
+      /* Add a checkpoint at the end of the deflate blocks located
+         past the last checkpoint.  */
+      if ((gio->strm.data_type & 128) && !(gio->strm.data_type & 64)
+          && !gio->complete
+          && gio->out_pos >= (gio->num_points == 0
+                              ? IOS_DEV_GZ_SPAN
+                              : gio->points[gio->num_points - 1].out
+                                + IOS_DEV_GZ_SPAN))
+        ios_dev_gz_add_point (gio);
+    }
+
+  if (gio->out_pos < end)
+    {
+      /* The end of the data has been reached.  */
+      gio->complete = 1;
+      gio->size = gio->out_pos;
+    }
+
+  return 0;
+}
+
+static ssize_t
+ios_dev_gz_pread (void *iod, void *buf, size_t count, ios_dev_off offset)
+{
+  struct ios_dev_gz *gio = iod;
+  struct ios_dev_gz_point *point = NULL;
+  size_t lo = 0, hi = gio->num_points;
+
+  if (gio->complete)
+    {
+      if (offset >= gio->size)
+        return 0;
+      if (count > gio->size - offset)
+        count = gio->size - offset;
+    }
+
+  /* Find the last checkpoint preceding OFFSET.  */
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (gio->points[mid].out <= offset)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo > 0)
+    point = &gio->points[lo - 1];
+
+  /* Restart the decompressor, unless it is already positioned between
+     that checkpoint and OFFSET, like when reading sequentially.  */
+  if (!gio->strm_valid
+      || gio->out_pos > offset
+      || (point && point->out > gio->out_pos))
+    {
+      if (ios_dev_gz_restart (gio, point) == -1)
+        return -1;
+    }
+
+  if (ios_dev_gz_inflate (gio, buf, offset, offset + count) == -1)
+    return -1;
+
+  if (gio->out_pos <= offset)
+    return 0;
+  return (gio->out_pos - offset < count ? gio->out_pos - offset : count);
+}
+
+static ssize_t
+ios_dev_gz_pwrite (void *iod, const void *buf, size_t count,
+                   ios_dev_off offset)
+{
+  /* Compressed files are read-only.  */
+  return -1;
+}
+
+static int
+ios_dev_gz_getc (void *iod)
+{
+  struct ios_dev_gz *gio = iod;
+  uint8_t c;
+
+  if (ios_dev_gz_pread (gio, &c, 1, gio->pos) != 1)
+    return IOD_EOF;
+  gio->pos++;
+  return c;
+}
+
+static int
+ios_dev_gz_putc (void *iod, int c)
+{
+  return IOD_EOF;
+}
+
+static ios_dev_off
+ios_dev_gz_tell (void *iod)
+{
+  struct ios_dev_gz *gio = iod;
+  return gio->pos;
+}
+
+static int
+ios_dev_gz_seek (void *iod, ios_dev_off offset, int whence)
+{
+  struct ios_dev_gz *gio = iod;
+
+  switch (whence)
+    {
+    case IOD_SEEK_SET: gio->pos = offset; break;
+    case IOD_SEEK_CUR: gio->pos += offset; break;
+    case IOD_SEEK_END:
+      /* The size of the data is only known once it has been
+         decompressed.  */
+      if (!gio->complete
+          && ((!gio->strm_valid
+               && ios_dev_gz_restart (gio,
+                                      gio->num_points
+                                      ? &gio->points[gio->num_points - 1]
+                                      : NULL) == -1)
+              || ios_dev_gz_inflate (gio, NULL, 0,
+                                     (ios_dev_off) -1) == -1))
+        return -1;
+      gio->pos = gio->size + offset;
+      break;
+    default:
+      assert (0);
+    }
+
+  return 0;
+}
+
+struct ios_dev_if ios_dev_gz =
+  {
+   .handler_p = ios_dev_gz_handler_p,
+   .open = ios_dev_gz_open,
+   .close = ios_dev_gz_close,
+   .tell = ios_dev_gz_tell,
+   .seek = ios_dev_gz_seek,
+   .get_c = ios_dev_gz_getc,
+   .put_c = ios_dev_gz_putc,
+   .pread = ios_dev_gz_pread,
+   .pwrite = ios_dev_gz_pwrite,
+  };
+
+#endif /* HAVE_ZLIB */
@@ -0,0 +1,219 @@
+/* ios-dev-mem.c - Memory IO devices.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <xalloc.h>
+#include <string.h>
+
+#include "ios-dev.h"
+
+/* Memory devices are growable buffers in the heap, which are not
+   backed by any file.  They are useful to compose binary data from
+   scratch.  Their handlers are of the form *NAME*, like in
+   *scratch*.  */
+
+#define IOS_DEV_MEM_INITIAL_SIZE 4096
+
+/* Memory devices can't grow past IOS_DEV_MEM_MAX_SIZE bytes.  Writes
+   past that size fail.  */
+
+#define IOS_DEV_MEM_MAX_SIZE ((size_t) 1 << 30)
+
+/* State associated with a memory device.
+
+   DATA is a buffer of CAPACITY bytes, the first SIZE of which are
+   the contents of the device.
+
+   POS is the current position in the device, used by the
+   byte-oriented operations.  */
+
+struct ios_dev_mem
+{
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  ios_dev_off pos;
+};
+
+static int
+ios_dev_mem_handler_p (const char *handler)
+{
+  size_t len = strlen (handler);
+
+  return (len > 2 && handler[0] == '*' && handler[len - 1] == '*');
+}
+
+static void *
+ios_dev_mem_open (const char *handler)
+{
+  struct ios_dev_mem *mio = xmalloc (sizeof (struct ios_dev_mem));
+
+  mio->data = NULL;
+  mio->size = 0;
+  mio->capacity = 0;
+  mio->pos = 0;
+
+  return mio;
+}
+
+static int
+ios_dev_mem_close (void *iod)
+{
+  struct ios_dev_mem *mio = iod;
+
+  free (mio->data);
+  free (mio);
+  return 1;
+}
+
+/* Make sure the device has room for SIZE bytes, growing the buffer if
+   needed.  The new contents of the device, if any, are zeroed.
+   Return 0 on success, or -1 if SIZE exceeds the maximum size of
+   memory devices or the buffer can't be grown.  */
+
+static int
+ios_dev_mem_grow (struct ios_dev_mem *mio, ios_dev_off size)
+{
+  if (size <= mio->size)
+    return 0;
+
+  if (size > IOS_DEV_MEM_MAX_SIZE)
+    return -1;
+
+  if (size > mio->capacity)
+    {
+      size_t capacity
+        = mio->capacity == 0 ? IOS_DEV_MEM_INITIAL_SIZE : mio->capacity;
+      uint8_t *data;
+
+      /* The capacity stays a power of two, so it can't exceed the
+         maximum size.  */
+      while (capacity < size)
+        capacity *= 2;
+
+      data = realloc (mio->data, capacity);
+      if (data == NULL)
+        return -1;
+      mio->data = data;
+      mio->capacity = capacity;
+    }
+
+  memset (mio->data + mio->size, 0, size - mio->size);
+  mio->size = size;
+  return 0;
+}
+
+static int
+ios_dev_mem_getc (void *iod)
+{
+  struct ios_dev_mem *mio = iod;
+
+  if (mio->pos >= mio->size)
+    return IOD_EOF;
+  return mio->data[mio->pos++];
+}
+
+static int
+ios_dev_mem_putc (void *iod, int c)
+{
+  struct ios_dev_mem *mio = iod;
+
+  if (mio->pos >= IOS_DEV_MEM_MAX_SIZE
+      || ios_dev_mem_grow (mio, mio->pos + 1) == -1)
+    return IOD_EOF;
+  mio->data[mio->pos++] = c;
+  return c;
+}
+
+static ios_dev_off
+ios_dev_mem_tell (void *iod)
+{
+  struct ios_dev_mem *mio = iod;
+  return mio->pos;
+}
+
+static int
+ios_dev_mem_seek (void *iod, ios_dev_off offset, int whence)
+{
+  struct ios_dev_mem *mio = iod;
+
+  switch (whence)
+    {
+    case IOD_SEEK_SET: mio->pos = offset; break;
+    case IOD_SEEK_CUR: mio->pos += offset; break;
+    case IOD_SEEK_END: mio->pos = mio->size + offset; break;
+    default:
+      assert (0);
+    }
+
+  return 0;
+}
+
+static ssize_t
+ios_dev_mem_pread (void *iod, void *buf, size_t count, ios_dev_off offset)
+{
+  struct ios_dev_mem *mio = iod;
+
+  if (offset >= mio->size)
+    return 0;
+  if (count > mio->size - offset)
+    count = mio->size - offset;
+
+  memcpy (buf, mio->data + offset, count);
+  return count;
+}
+
+static ssize_t
+ios_dev_mem_pwrite (void *iod, const void *buf, size_t count,
+                    ios_dev_off offset)
+{
+  struct ios_dev_mem *mio = iod;
+
+  if (offset > IOS_DEV_MEM_MAX_SIZE
+      || count > IOS_DEV_MEM_MAX_SIZE - offset
+      || ios_dev_mem_grow (mio, offset + count) == -1)
+    return -1;
+  memcpy (mio->data + offset, buf, count);
+  return count;
+}
+
+static void *
+ios_dev_mem_mem (void *iod, ios_dev_off *size)
+{
+  struct ios_dev_mem *mio = iod;
+
+  *size = mio->size;
+  return mio->data;
+}
+
+struct ios_dev_if ios_dev_mem =
+  {
+   .handler_p = ios_dev_mem_handler_p,
+   .open = ios_dev_mem_open,
+   .close = ios_dev_mem_close,
+   .tell = ios_dev_mem_tell,
+   .seek = ios_dev_mem_seek,
+   .get_c = ios_dev_mem_getc,
+   .put_c = ios_dev_mem_putc,
+   .pread = ios_dev_mem_pread,
+   .pwrite = ios_dev_mem_pwrite,
+   .mem = ios_dev_mem_mem,
+  };
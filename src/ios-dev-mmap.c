@@ -0,0 +1,236 @@
+/* ios-dev-mmap.c - Memory-mapped file IO devices.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* We want 64-bit file offsets in all systems.  */
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <assert.h>
+#include <xalloc.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ios-dev.h"
+
+/* State associated with a memory-mapped file device.
+
+   DATA points to the mapping of the file, which is SIZE bytes long.
+   If the file is empty, DATA is NULL.
+
+   WRITABLE is 1 if the mapping is shared and writable, i.e. if writes
+   to the device are written back to the file.  0 otherwise.
+
+   POS is the current position in the device, used by the
+   byte-oriented operations.  */
+
+struct ios_dev_mmap
+{
+  int fd;
+  char *filename;
+  uint8_t *data;
+  ios_dev_off size;
+  int writable;
+  ios_dev_off pos;
+};
+
+static int
+ios_dev_mmap_handler_p (const char *handler)
+{
+  return (strlen (handler) >= 7
+          && strncmp (handler, "mmap://", 7) == 0);
+}
+
+static void *
+ios_dev_mmap_open (const char *handler)
+{
+  struct ios_dev_mmap *mio;
+  struct stat st;
+  int fd, writable;
+
+  /* Skip the mmap:// part in the handler.  */
+  handler += 7;
+
+  /* Open the requested file.  The open mode is read-write if
+     possible.  Otherwise read-only.  */
+
+  writable = (access (handler, R_OK | W_OK) == 0);
+  fd = open (handler, writable ? O_RDWR : O_RDONLY);
+  if (fd == -1 || fstat (fd, &st) == -1)
+    {
+      perror (handler);
+      if (fd != -1)
+        close (fd);
+      return NULL;
+    }
+
+  mio = xmalloc (sizeof (struct ios_dev_mmap));
+  mio->fd = fd;
+  mio->filename = xstrdup (handler);
+  mio->size = st.st_size;
+  mio->writable = writable;
+  mio->pos = 0;
+  mio->data = NULL;
+
+  /* Note that it is not possible to map an empty file.  */
+  if (mio->size > 0)
+    {
+      void *data = mmap (NULL, mio->size,
+                         writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                         writable ? MAP_SHARED : MAP_PRIVATE,
+                         fd, 0);
+      if (data == MAP_FAILED)
+        {
+          perror (handler);
+          close (fd);
+          free (mio->filename);
+          free (mio);
+          return NULL;
+        }
+
+      mio->data = data;
+    }
+
+  return mio;
+}
+
+static int
+ios_dev_mmap_close (void *iod)
+{
+  struct ios_dev_mmap *mio = iod;
+
+  if (mio->data)
+    {
+      if (mio->writable
+          && msync (mio->data, mio->size, MS_SYNC) == -1)
+        perror (mio->filename);
+      munmap (mio->data, mio->size);
+    }
+
+  if (close (mio->fd) == -1)
+    perror (mio->filename);
+  free (mio->filename);
+  free (mio);
+
+  return 1;
+}
+
+static int
+ios_dev_mmap_getc (void *iod)
+{
+  struct ios_dev_mmap *mio = iod;
+
+  if (mio->pos >= mio->size)
+    return IOD_EOF;
+  return mio->data[mio->pos++];
+}
+
+static int
+ios_dev_mmap_putc (void *iod, int c)
+{
+  struct ios_dev_mmap *mio = iod;
+
+  /* The mapping can't grow.  */
+  if (!mio->writable || mio->pos >= mio->size)
+    return IOD_EOF;
+
+  mio->data[mio->pos++] = c;
+  return c;
+}
+
+static ios_dev_off
+ios_dev_mmap_tell (void *iod)
+{
+  struct ios_dev_mmap *mio = iod;
+  return mio->pos;
+}
+
+static int
+ios_dev_mmap_seek (void *iod, ios_dev_off offset, int whence)
+{
+  struct ios_dev_mmap *mio = iod;
+
+  switch (whence)
+    {
+    case IOD_SEEK_SET: mio->pos = offset; break;
+    case IOD_SEEK_CUR: mio->pos += offset; break;
+    case IOD_SEEK_END: mio->pos = mio->size + offset; break;
+    default:
+      assert (0);
+    }
+
+  return 0;
+}
+
+static ssize_t
+ios_dev_mmap_pread (void *iod, void *buf, size_t count, ios_dev_off offset)
+{
+  struct ios_dev_mmap *mio = iod;
+
+  if (offset >= mio->size)
+    return 0;
+  if (count > mio->size - offset)
+    count = mio->size - offset;
+
+  memcpy (buf, mio->data + offset, count);
+  return count;
+}
+
+static ssize_t
+ios_dev_mmap_pwrite (void *iod, const void *buf, size_t count,
+                     ios_dev_off offset)
+{
+  struct ios_dev_mmap *mio = iod;
+
+  /* The mapping can't grow.  */
+  if (!mio->writable
+      || offset > mio->size
+      || count > mio->size - offset)
+    return -1;
+
+  memcpy (mio->data + offset, buf, count);
+  return count;
+}
+
+static void *
+ios_dev_mmap_mem (void *iod, ios_dev_off *size)
+{
+  struct ios_dev_mmap *mio = iod;
+
+  *size = mio->size;
+  return mio->data;
+}
+
+struct ios_dev_if ios_dev_mmap =
+  {
+   .handler_p = ios_dev_mmap_handler_p,
+   .open = ios_dev_mmap_open,
+   .close = ios_dev_mmap_close,
+   .tell = ios_dev_mmap_tell,
+   .seek = ios_dev_mmap_seek,
+   .get_c = ios_dev_mmap_getc,
+   .put_c = ios_dev_mmap_putc,
+   .pread = ios_dev_mmap_pread,
+   .pwrite = ios_dev_mmap_pwrite,
+   .mem = ios_dev_mmap_mem,
+  };
@@ -0,0 +1,287 @@
+/* ios-dev-proc.c - Process memory IO devices.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* We want 64-bit file offsets in all systems.  */
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <assert.h>
+#include <xalloc.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+#include "ios-dev.h"
+
+/* Process devices give access to the memory of a running process,
+   whose offsets are the virtual addresses in the process.  Their
+   handlers are of the form pid://PID, like in pid://1234.
+
+   The memory is read with process_vm_readv, if available, and
+   written through the /proc/PID/mem file.  Addresses that are not
+   mapped in the process behave like the end of the device.  */
+
+/* Size of the pages of the process.  Reads are split at page
+   boundaries, so unmapped pages don't prevent reading the mapped
+   pages preceding them.  */
+
+#define IOS_DEV_PROC_PAGE_SIZE 4096
+
+/* Maximum number of ranges read with a single call to
+   process_vm_readv.  */
+
+#ifdef IOV_MAX
+# define IOS_DEV_PROC_MAX_IOV (IOV_MAX < 1024 ? IOV_MAX : 1024)
+#else
+# define IOS_DEV_PROC_MAX_IOV 16
+#endif
+
+/* State associated with a process device.
+
+   PID is the process whose memory is accessed.
+
+   FD is a descriptor for /proc/PID/mem, opened read-write if
+   possible and read-only otherwise.
+
+   POS is the current position in the device, used by the
+   byte-oriented operations.  */
+
+struct ios_dev_proc
+{
+  pid_t pid;
+  int fd;
+  ios_dev_off pos;
+};
+
+static int
+ios_dev_proc_handler_p (const char *handler)
+{
+  const char *p;
+
+  if (strncmp (handler, "pid://", 6) != 0 || handler[6] == '\0')
+    return 0;
+
+  for (p = handler + 6; *p != '\0'; p++)
+    if (!isdigit ((unsigned char) *p))
+      return 0;
+
+  return 1;
+}
+
+static void *
+ios_dev_proc_open (const char *handler)
+{
+  struct ios_dev_proc *pio;
+  char filename[64];
+  long pid;
+  int fd;
+
+  /* Skip the pid:// part in the handler.  */
+  pid = strtol (handler + 6, NULL, 10);
+  if (pid <= 0)
+    return NULL;
+
+  snprintf (filename, sizeof (filename), "/proc/%ld/mem", pid);
+  fd = open (filename, O_RDWR);
+  if (fd == -1)
+    fd = open (filename, O_RDONLY);
+  if (fd == -1)
+    {
+      perror (filename);
+      return NULL;
+    }
+
+  pio = xmalloc (sizeof (struct ios_dev_proc));
+  pio->pid = pid;
+  pio->fd = fd;
+  pio->pos = 0;
+
+  return pio;
+}
+
+static int
+ios_dev_proc_close (void *iod)
+{
+  struct ios_dev_proc *pio = iod;
+  int ret = (close (pio->fd) == 0);
+
+  free (pio);
+  return ret;
+}
+
+static ssize_t
+ios_dev_proc_pread (void *iod, void *buf, size_t count, ios_dev_off offset)
+{
+  struct ios_dev_proc *pio = iod;
+  uint8_t *bytes = buf;
+  size_t done = 0;
+
+#if HAVE_PROCESS_VM_READV
+  /* Read the range in batches of pages.  The call stops at the first
+     page that can't be read, and returns the number of bytes read
+     before it.  */
+  while (done < count)
+    {
+      struct iovec local, remote[IOS_DEV_PROC_MAX_IOV];
+      ios_dev_off pos = offset + done;
+      size_t batch = 0;
+      int n;
+      ssize_t nbytes;
+
+      for (n = 0; n < IOS_DEV_PROC_MAX_IOV && done + batch < count; n++)
+        {
+          size_t chunk = IOS_DEV_PROC_PAGE_SIZE
+            - (pos + batch) % IOS_DEV_PROC_PAGE_SIZE;
+
+          if (chunk > count - done - batch)
+            chunk = count - done - batch;
+
+          remote[n].iov_base = (void *) (uintptr_t) (pos + batch);
+          remote[n].iov_len = chunk;
+          batch += chunk;
+        }
+
+      local.iov_base = bytes + done;
+      local.iov_len = batch;
+
+      nbytes = process_vm_readv (pio->pid, &local, 1, remote, n, 0);
+      if (nbytes == -1)
+        {
+          /* process_vm_readv may be missing in the kernel, or be
+             forbidden, like in some containers, while /proc/PID/mem
+             can still be read.  */
+          if (done == 0 && (errno == ENOSYS || errno == EPERM))
+            break;
+          return done;
+        }
+
+      done += nbytes;
+      if ((size_t) nbytes < batch)
+        return done;
+    }
+
+  if (done == count)
+    return done;
+#endif
+
+  /* Read through /proc/PID/mem, which fails on unmapped pages.  */
+  while (done < count)
+    {
+      ios_dev_off pos = offset + done;
+      size_t chunk = IOS_DEV_PROC_PAGE_SIZE - pos % IOS_DEV_PROC_PAGE_SIZE;
+      ssize_t nbytes;
+
+      if (chunk > count - done)
+        chunk = count - done;
+
+      nbytes = pread (pio->fd, bytes + done, chunk, pos);
+      if (nbytes <= 0)
+        break;
+      done += nbytes;
+    }
+
+  return done;
+}
+
+static ssize_t
+ios_dev_proc_pwrite (void *iod, const void *buf, size_t count,
+                     ios_dev_off offset)
+{
+  struct ios_dev_proc *pio = iod;
+  ssize_t nbytes = pwrite (pio->fd, buf, count, offset);
+
+  return (nbytes == (ssize_t) count ? nbytes : -1);
+}
+
+static int
+ios_dev_proc_getc (void *iod)
+{
+  struct ios_dev_proc *pio = iod;
+  uint8_t c;
+
+  if (ios_dev_proc_pread (pio, &c, 1, pio->pos) != 1)
+    return IOD_EOF;
+  pio->pos++;
+  return c;
+}
+
+static int
+ios_dev_proc_putc (void *iod, int c)
+{
+  struct ios_dev_proc *pio = iod;
+  uint8_t byte = c;
+
+  if (ios_dev_proc_pwrite (pio, &byte, 1, pio->pos) != 1)
+    return IOD_EOF;
+  pio->pos++;
+  return c;
+}
+
+static ios_dev_off
+ios_dev_proc_tell (void *iod)
+{
+  struct ios_dev_proc *pio = iod;
+  return pio->pos;
+}
+
+static int
+ios_dev_proc_seek (void *iod, ios_dev_off offset, int whence)
+{
+  struct ios_dev_proc *pio = iod;
+
+  /* The address space of a process doesn't really have an end.  */
+  switch (whence)
+    {
+    case IOD_SEEK_SET: pio->pos = offset; break;
+    case IOD_SEEK_CUR: pio->pos += offset; break;
+    case IOD_SEEK_END: return -1;
+    default:
+      assert (0);
+    }
+
+  return 0;
+}
+
+/* The process keeps changing its memory while it runs.  */
+
+static int
+ios_dev_proc_volatile_p (void *iod)
+{
+  return 1;
+}
+
+struct ios_dev_if ios_dev_proc =
+  {
+   .handler_p = ios_dev_proc_handler_p,
+   .open = ios_dev_proc_open,
+   .close = ios_dev_proc_close,
+   .tell = ios_dev_proc_tell,
+   .seek = ios_dev_proc_seek,
+   .get_c = ios_dev_proc_getc,
+   .put_c = ios_dev_proc_putc,
+   .pread = ios_dev_proc_pread,
+   .pwrite = ios_dev_proc_pwrite,
+   .volatile_p = ios_dev_proc_volatile_p,
+  };
@@ -0,0 +1,520 @@
+/* ios-dev-uring.c - io_uring file IO devices.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#if HAVE_IO_URING
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/* We want 64-bit file offsets in all systems.  */
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <assert.h>
+#include <xalloc.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "ios-dev.h"
+
+/* io_uring file devices access files like the file devices, but
+   the reads are submitted to the kernel through an io_uring, many of
+   them at once when the IOS layer fills several cache pages, and
+   their completions are reaped together.  This keeps fast storage
+   busy when big amounts of data are read.  Their handlers are of
+   the form uring://PATH, like in uring:///dev/nvme0n1.
+
+   If the io_uring can't be set up, or a request submitted to it
+   fails or is completed partially, the reads are done with
+   pread.  */
+
+/* Maximum number of requests in flight.  */
+
+#define IOS_DEV_URING_ENTRIES 64
+
+/* State associated with an io_uring file device.
+
+   FD is the descriptor of the file, opened read-write if possible and
+   read-only otherwise.
+
+   RING_FD is the descriptor of the io_uring, or -1 if there is no
+   io_uring.  The submission and completion queues of the io_uring
+   are mapped in SQ_PTR and CQ_PTR, which are SQ_LEN and CQ_LEN bytes
+   long and may be the same mapping, and the NUM_ENTRIES submission
+   entries are mapped in SQES.  The remaining fields point to the
+   fields of the queues.
+
+   POS is the current position in the device, used by the
+   byte-oriented operations.  */
+
+struct ios_dev_uring
+{
+  int fd;
+
+  int ring_fd;
+  void *sq_ptr;
+  void *cq_ptr;
+  size_t sq_len;
+  size_t cq_len;
+  unsigned num_entries;
+  struct io_uring_sqe *sqes;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  ios_dev_off pos;
+};
+
+/* Set up the io_uring of UIO.  Return 0 on success, -1 on error.  */
+
+static int
+ios_dev_uring_setup (struct ios_dev_uring *uio)
+{
+  struct io_uring_params params;
+  int ring_fd;
+
+  memset (&params, 0, sizeof (params));
+  ring_fd = syscall (__NR_io_uring_setup, IOS_DEV_URING_ENTRIES, &params);
+  if (ring_fd == -1)
+    return -1;
+
+  uio->sq_len = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  uio->cq_len = (params.cq_off.cqes
+                 + params.cq_entries * sizeof (struct io_uring_cqe));
+
+  /* Recent kernels map both queues at once.  */
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      if (uio->cq_len > uio->sq_len)
+        uio->sq_len = uio->cq_len;
+      uio->cq_len = 0;
+    }
+
+  uio->sq_ptr = mmap (NULL, uio->sq_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd,
+                      IORING_OFF_SQ_RING);
+  if (uio->sq_ptr == MAP_FAILED)
+    goto error;
+
+  if (uio->cq_len == 0)
+    uio->cq_ptr = uio->sq_ptr;
+  else
+    {
+      uio->cq_ptr = mmap (NULL, uio->cq_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring_fd,
+                          IORING_OFF_CQ_RING);
+      if (uio->cq_ptr == MAP_FAILED)
+        {
+          munmap (uio->sq_ptr, uio->sq_len);
+          goto error;
+        }
+    }
+
+  uio->num_entries = params.sq_entries;
+  uio->sqes = mmap (NULL, params.sq_entries * sizeof (struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd, IORING_OFF_SQES);
+  if (uio->sqes == MAP_FAILED)
+    {
+      munmap (uio->sq_ptr, uio->sq_len);
+      if (uio->cq_len != 0)
+        munmap (uio->cq_ptr, uio->cq_len);
+      goto error;
+    }
+
+  uio->sq_tail = (unsigned *) ((char *) uio->sq_ptr + params.sq_off.tail);
+  uio->sq_mask = (unsigned *) ((char *) uio->sq_ptr
+                               + params.sq_off.ring_mask);
+  uio->sq_array = (unsigned *) ((char *) uio->sq_ptr + params.sq_off.array);
+  uio->cq_head = (unsigned *) ((char *) uio->cq_ptr + params.cq_off.head);
+  uio->cq_tail = (unsigned *) ((char *) uio->cq_ptr + params.cq_off.tail);
+  uio->cq_mask = (unsigned *) ((char *) uio->cq_ptr
+                               + params.cq_off.ring_mask);
+  uio->cqes = (struct io_uring_cqe *) ((char *) uio->cq_ptr
+                                       + params.cq_off.cqes);
+  uio->ring_fd = ring_fd;
+  return 0;
+
+ error:
+  close (ring_fd);
+  return -1;
+}
+
+/* Tear down the io_uring of UIO, if there is one.  */
+
+static void
+ios_dev_uring_teardown (struct ios_dev_uring *uio)
+{
+  if (uio->ring_fd == -1)
+    return;
+
+  munmap (uio->sqes, uio->num_entries * sizeof (struct io_uring_sqe));
+  if (uio->cq_len != 0)
+    munmap (uio->cq_ptr, uio->cq_len);
+  munmap (uio->sq_ptr, uio->sq_len);
+  close (uio->ring_fd);
+  uio->ring_fd = -1;
+}
+
+/* Wait for the completion of the NUM_PENDING requests submitted to
+   the io_uring of UIO that haven't been reaped yet, discarding their
+   results.  io_uring_enter may keep failing, so the completion queue
+   is polled if it does.  The requests are reads of a file, which
+   always complete.  */
+
+static void
+ios_dev_uring_drain (struct ios_dev_uring *uio, unsigned num_pending)
+{
+  while (num_pending > 0)
+    {
+      unsigned head = *uio->cq_head;
+      unsigned cq_tail = __atomic_load_n (uio->cq_tail, __ATOMIC_ACQUIRE);
+
+      num_pending -= (cq_tail - head < num_pending
+                      ? cq_tail - head : num_pending);
+      __atomic_store_n (uio->cq_head, cq_tail, __ATOMIC_RELEASE);
+
+      if (num_pending > 0
+          && syscall (__NR_io_uring_enter, uio->ring_fd, 0, num_pending,
+                      IORING_ENTER_GETEVENTS, NULL, 0) == -1
+          && errno != EINTR)
+        sched_yield ();
+    }
+}
+
+/* Submit the NUM_REQS requests in REQS, which can't be more than the
+   number of entries of the io_uring of UIO, and wait for their
+   completion.  Return 0 on success, -1 if the io_uring failed.  In
+   that case the requests already submitted have completed, so the
+   kernel doesn't write to their buffers anymore.  */
+
+static int
+ios_dev_uring_submit (struct ios_dev_uring *uio,
+                      struct ios_dev_read_req *reqs, unsigned num_reqs)
+{
+  unsigned tail = *uio->sq_tail;
+  unsigned submitted = 0, reaped = 0;
+  unsigned i;
+
+  for (i = 0; i < num_reqs; i++)
+    {
+      unsigned index = (tail + i) & *uio->sq_mask;
+      struct io_uring_sqe *sqe = &uio->sqes[index];
+
+      memset (sqe, 0, sizeof (struct io_uring_sqe));
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = uio->fd;
+      sqe->addr = (uintptr_t) reqs[i].buf;
+      sqe->len = reqs[i].count;
+      sqe->off = reqs[i].offset;
+      sqe->user_data = i;
+      uio->sq_array[index] = index;
+      reqs[i].nbytes = -1;
+    }
+
+  /* The kernel must see the entries before the new tail.  */
+  __atomic_store_n (uio->sq_tail, tail + num_reqs, __ATOMIC_RELEASE);
+
+  while (reaped < num_reqs)
+    {
+      unsigned head, cq_tail;
+      int ret = syscall (__NR_io_uring_enter, uio->ring_fd,
+                         num_reqs - submitted, num_reqs - reaped,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+
+      if (ret == -1)
+        {
+          if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            continue;
+          ios_dev_uring_drain (uio, submitted - reaped);
+          return -1;
+        }
+      submitted += ret;
+
+      head = *uio->cq_head;
+      cq_tail = __atomic_load_n (uio->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != cq_tail; head++, reaped++)
+        {
+          struct io_uring_cqe *cqe = &uio->cqes[head & *uio->cq_mask];
+
+          reqs[cqe->user_data].nbytes = cqe->res < 0 ? -1 : cqe->res;
+        }
+      __atomic_store_n (uio->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  return 0;
+}
+
+static void
+ios_dev_uring_pread_batch (void *iod, struct ios_dev_read_req *reqs,
+                           size_t num_reqs)
+{
+  struct ios_dev_uring *uio = iod;
+  size_t done = 0, i;
+
+  while (uio->ring_fd != -1 && done < num_reqs)
+    {
+      unsigned n = (num_reqs - done < uio->num_entries
+                    ? num_reqs - done : uio->num_entries);
+
+      if (ios_dev_uring_submit (uio, reqs + done, n) == -1)
+        {
+          /* Requests that were not submitted may be left in the
+             io_uring, so don't use it anymore.  */
+          ios_dev_uring_teardown (uio);
+          break;
+        }
+      done += n;
+    }
+
+  /* Complete the requests that couldn't be submitted, and the ones
+     that read less than requested.  */
+  for (i = 0; i < num_reqs; i++)
+    {
+      struct ios_dev_read_req *req = &reqs[i];
+      size_t have = (i < done && req->nbytes > 0) ? req->nbytes : 0;
+
+      while (have < req->count)
+        {
+          ssize_t nbytes = pread (uio->fd, (char *) req->buf + have,
+                                  req->count - have, req->offset + have);
+
+          if (nbytes == -1 && errno == EINTR)
+            continue;
+          if (nbytes <= 0)
+            {
+              if (nbytes == -1 && have == 0)
+                {
+                  req->nbytes = -1;
+                  goto next;
+                }
+              break;
+            }
+          have += nbytes;
+        }
+
+      req->nbytes = have;
+    next:
+      ;
+    }
+}
+
+static int
+ios_dev_uring_handler_p (const char *handler)
+{
+  return (strlen (handler) > 8
+          && strncmp (handler, "uring://", 8) == 0);
+}
+
+static void *
+ios_dev_uring_open (const char *handler)
+{
+  struct ios_dev_uring *uio;
+  int fd;
+
+  /* Skip the uring:// part in the handler.  */
+  handler += 8;
+
+  fd = open (handler, O_RDWR);
+  if (fd == -1)
+    fd = open (handler, O_RDONLY);
+  if (fd == -1)
+    {
+      perror (handler);
+      return NULL;
+    }
+
+  uio = xmalloc (sizeof (struct ios_dev_uring));
+  uio->fd = fd;
+  uio->ring_fd = -1;
+  uio->pos = 0;
+
+  /* The device works without the io_uring, only slower.  */
+  ios_dev_uring_setup (uio);
+
+  return uio;
+}
+
+static int
+ios_dev_uring_close (void *iod)
+{
+  struct ios_dev_uring *uio = iod;
+  int ret;
+
+  ios_dev_uring_teardown (uio);
+  ret = (close (uio->fd) == 0);
+  free (uio);
+  return ret;
+}
+
+static ssize_t
+ios_dev_uring_pread (void *iod, void *buf, size_t count, ios_dev_off offset)
+{
+  struct ios_dev_read_req req;
+
+  req.buf = buf;
+  req.count = count;
+  req.offset = offset;
+  ios_dev_uring_pread_batch (iod, &req, 1);
+  return req.nbytes;
+}
+
+static ssize_t
+ios_dev_uring_pwrite (void *iod, const void *buf, size_t count,
+                      ios_dev_off offset)
+{
+  struct ios_dev_uring *uio = iod;
+  size_t done = 0;
+
+  while (done < count)
+    {
+      ssize_t nbytes = pwrite (uio->fd, (const char *) buf + done,
+                               count - done, offset + done);
+
+      if (nbytes == -1 && errno == EINTR)
+        continue;
+      if (nbytes <= 0)
+        return -1;
+      done += nbytes;
+    }
+
+  return done;
+}
+
+static int
+ios_dev_uring_getc (void *iod)
+{
+  struct ios_dev_uring *uio = iod;
+  uint8_t c;
+
+  if (ios_dev_uring_pread (uio, &c, 1, uio->pos) != 1)
+    return IOD_EOF;
+  uio->pos++;
+  return c;
+}
+
+static int
+ios_dev_uring_putc (void *iod, int c)
+{
+  struct ios_dev_uring *uio = iod;
+  uint8_t byte = c;
+
+  if (ios_dev_uring_pwrite (uio, &byte, 1, uio->pos) != 1)
+    return IOD_EOF;
+  uio->pos++;
+  return c;
+}
+
+static ios_dev_off
+ios_dev_uring_tell (void *iod)
+{
+  struct ios_dev_uring *uio = iod;
+  return uio->pos;
+}
+
+static int
+ios_dev_uring_seek (void *iod, ios_dev_off offset, int whence)
+{
+  struct ios_dev_uring *uio = iod;
+  struct stat st;
+
+  switch (whence)
+    {
+    case IOD_SEEK_SET: uio->pos = offset; break;
+    case IOD_SEEK_CUR: uio->pos += offset; break;
+    case IOD_SEEK_END:
+      if (fstat (uio->fd, &st) == -1)
+        return -1;
+      uio->pos = st.st_size + offset;
+      break;
+    default:
+      assert (0);
+    }
+
+  return 0;
+}
+
+#if defined SEEK_DATA && defined SEEK_HOLE
+
+/* Holes are found like in the file devices.  See ios-dev-file.c.  */
+
+static int
+ios_dev_uring_hole (void *iod, ios_dev_off offset, ios_dev_off *end)
+{
+  struct ios_dev_uring *uio = iod;
+  off_t data, hole;
+  struct stat st;
+
+  data = lseek (uio->fd, offset, SEEK_DATA);
+  if (data == (off_t) offset)
+    {
+      hole = lseek (uio->fd, offset, SEEK_HOLE);
+      if (hole == -1)
+        return -1;
+      *end = hole;
+      return 0;
+    }
+  else if (data != -1)
+    {
+      *end = data;
+      return 1;
+    }
+  else if (errno == ENXIO && fstat (uio->fd, &st) == 0
+           && offset < (ios_dev_off) st.st_size)
+    {
+      /* There is no data after OFFSET, but the file doesn't end
+         there: it ends in a hole.  */
+      *end = st.st_size;
+      return 1;
+    }
+
+  return -1;
+}
+
+#endif /* SEEK_DATA && SEEK_HOLE */
+
+struct ios_dev_if ios_dev_uring =
+  {
+   .handler_p = ios_dev_uring_handler_p,
+   .open = ios_dev_uring_open,
+   .close = ios_dev_uring_close,
+   .tell = ios_dev_uring_tell,
+   .seek = ios_dev_uring_seek,
+   .get_c = ios_dev_uring_getc,
+   .put_c = ios_dev_uring_putc,
+   .pread = ios_dev_uring_pread,
+   .pwrite = ios_dev_uring_pwrite,
+   .pread_batch = ios_dev_uring_pread_batch,
+#if defined SEEK_DATA && defined SEEK_HOLE
+   .hole = ios_dev_uring_hole,
+#endif
+  };
+
+#endif /* HAVE_IO_URING */
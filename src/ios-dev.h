@@ -36,6 +36,19 @@ typedef uint64_t ios_dev_off;
 #define IOD_SEEK_CUR 1
 #define IOD_SEEK_END 2
 
+/* A request to read COUNT bytes from a device, starting at the
+   absolute byte offset OFFSET, and put them in BUF.  NBYTES is set to
+   the number of bytes read, or to -1 on error, once the request is
+   completed.  */
+
+struct ios_dev_read_req
+{
+  void *buf;
+  size_t count;
+  ios_dev_off offset;
+  ssize_t nbytes;
+};
+
 /* Each IO backend should implement a device interface, by filling an
    instance of the struct defined below.  */
 
@@ -81,4 +94,115 @@ struct ios_dev_if
      the character written as an int, or IOD_EOF on error.  */
 
   int (*put_c) (void *dev, int c);
+
+  /* Read COUNT bytes from the given device, starting at the absolute
+     byte offset OFFSET, and put them in BUF.  Return the number of
+     bytes read, which is less than COUNT only if the end of the
+     device is reached, or -1 on error.
+
+     This is an optional operation: if a device doesn't provide it,
+     then the IOS layer uses SEEK and GET_C instead.  */
+
+  ssize_t (*pread) (void *dev, void *buf, size_t count,
+                    ios_dev_off offset);
+
+  /* Write COUNT bytes from BUF to the given device, starting at the
+     absolute byte offset OFFSET.  Return the number of bytes written,
+     or -1 on error.
+
+     This is an optional operation: if a device doesn't provide it,
+     then the IOS layer uses SEEK and PUT_C instead.  */
+
+  ssize_t (*pwrite) (void *dev, const void *buf, size_t count,
+                     ios_dev_off offset);
+
+  /* Return a pointer to the contents of the given device, if they are
+     directly addressable in memory, and put its size in bytes in
+     SIZE.  The returned pointer may be NULL if the device is empty.
+     The pointer and the size are only valid until the next write to
+     the device.
+
+     This is an optional operation: devices providing it are not
+     cached by the IOS layer, which reads from the returned memory
+     instead.  */
+
+  void *(*mem) (void *dev, ios_dev_off *size);
+
+  /* Perform the NUM_REQS read requests in REQS, which the device can
+     complete in any order, and return once all of them are completed.
+     This allows devices to issue the requests at once, instead of
+     waiting for each one before issuing the next.
+
+     This is an optional operation: devices providing it are asked to
+     fill the cache of the IOS layer with many pages at a time.  */
+
+  void (*pread_batch) (void *dev, struct ios_dev_read_req *reqs,
+                       size_t num_reqs);
+
+  /* Tell the given device that the COUNT bytes starting at the
+     absolute byte offset OFFSET are likely to be read soon, so it can
+     start fetching them in the background.  This is just a hint:
+     devices are free to ignore it.
+
+     This is an optional operation.  */
+
+  void (*advise) (void *dev, ios_dev_off offset, size_t count);
+
+  /* Some devices keep the bytes written to them apart from the
+     underlying storage, until they are committed.  Find the first
+     range of such bytes ending after the absolute byte offset OFFSET,
+     and put its offset in START and its size in COUNT.  Return 1 if
+     such a range exists, 0 otherwise.
+
+     This is an optional operation.  */
+
+  int (*delta) (void *dev, ios_dev_off offset,
+                ios_dev_off *start, size_t *count);
+
+  /* Write all the bytes kept apart by the given device to the
+     underlying storage.  Either all the bytes are written or none.
+     Return 0 on successful completion, and -1 on error.
+
+     This is an optional operation.  */
+
+  int (*commit) (void *dev);
+
+  /* Some devices, like sparse files, have holes: ranges of bytes
+     which are not stored and read as zeroes.  Determine whether the
+     absolute byte offset OFFSET is in a hole, and put in END the end
+     of the range starting at OFFSET whose bytes are either all in
+     holes or all stored.  Return 1 if OFFSET is in a hole, 0 if it is
+     not, and -1 on error or if OFFSET is past the end of the device.
+
+     This is an optional operation: devices not providing it don't
+     have holes.  */
+
+  int (*hole) (void *dev, ios_dev_off offset, ios_dev_off *end);
+
+  /* Return 1 if the contents of the given device may change without
+     being written through it, like the memory of a running process,
+     0 otherwise.  The IOS layer neither caches such devices nor keeps
+     track of the values mapped from them, so they are read again
+     every time they are accessed.
+
+     This is an optional operation: devices not providing it only
+     change when written.  */
+
+  int (*volatile_p) (void *dev);
 };
+
+/* Return the device interface recognizing the provided HANDLER, or
+   NULL if no backend recognizes it.  This is useful for devices
+   operating on top of other devices.  */
+
+struct ios_dev_if *ios_dev_lookup (const char *handler);
+
+/* Return 1 if the devices building indexes of their contents should
+   save them when closed, 0 otherwise.  */
+
+int ios_dev_save_indexes_p (void);
+
+/* Return 1 if the files given plain paths should be opened with
+   direct IO, 0 otherwise.  */
+
+int ios_dev_direct_io_p (void);
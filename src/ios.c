@@ -21,8 +21,12 @@
 #include <gettext.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <ctype.h>
+#include <byteswap.h>
 #define _(str) gettext (str)
 #include <streq.h>
 
@@ -31,661 +35,2961 @@
 
 #define STREQ(a, b) (strcmp (a, b) == 0)
 
-#define IOS_GET_C_ERR_CHCK(c, io)	\
-{					\
-  (c) = io->dev_if->get_c ((io)->dev); 	\
-  if ((c) == IOD_EOF)			\
-    return IOS_EIOFF;			\
-}
+/* Every IO space features a cache of fixed-size pages, which holds
+   copies of the bytes contained in the underlying IO device.  All the
+   integer and string reads performed in the space are served from
+   the cache, unless explicitly asked otherwise with
+   IOS_F_BYPASS_CACHE.
 
-#define IOS_READ_INTO_CHARRAY_1BYTE(charray)		\
-{							\
-  IOS_GET_C_ERR_CHCK((charray)[0], io);			\
-}
+   Writes are buffered in the cache as well, and written back to the
+   IO device when the space is flushed or closed, when a dirty page is
+   evicted, or when too many pages are dirty.  Writes performed with
+   IOS_F_BYPASS_CACHE go straight to the IO device.
 
-#define IOS_READ_INTO_CHARRAY_2BYTES(charray)		\
-{							\
-  IOS_READ_INTO_CHARRAY_1BYTE(charray);			\
-  IOS_GET_C_ERR_CHCK((charray)[1], io);			\
-}
+   BASE is the offset in the IO device of the first byte stored in
+   the page.  It is always a multiple of the page size.
 
-#define IOS_READ_INTO_CHARRAY_3BYTES(charray)		\
-{							\
-  IOS_READ_INTO_CHARRAY_2BYTES(charray);		\
-  IOS_GET_C_ERR_CHCK((charray)[2], io);			\
-}
+   SIZE is the number of valid bytes in DATA.  This is less than the
+   page size when the page covers the end of the IO device.
 
-#define IOS_READ_INTO_CHARRAY_4BYTES(charray)		\
-{							\
-  IOS_READ_INTO_CHARRAY_3BYTES(charray);		\
-  IOS_GET_C_ERR_CHCK((charray)[3], io);			\
-}
+   DIRTY_FROM and DIRTY_TO delimit the range [DIRTY_FROM, DIRTY_TO) of
+   bytes in DATA that have been written in the cache but not yet in
+   the IO device.  DIRTY_TO is zero if the page is clean.
 
-#define IOS_READ_INTO_CHARRAY_5BYTES(charray)		\
-{							\
-  IOS_READ_INTO_CHARRAY_4BYTES(charray);		\
-  IOS_GET_C_ERR_CHCK((charray)[4], io);			\
-}
+   PREV and NEXT link the page in the LRU list of the cache.
 
-#define IOS_READ_INTO_CHARRAY_6BYTES(charray)		\
-{							\
-  IOS_READ_INTO_CHARRAY_5BYTES(charray);		\
-  IOS_GET_C_ERR_CHCK((charray)[5], io);			\
-}
+   CHAIN links the page in its bucket of the cache hash table.  */
 
-#define IOS_READ_INTO_CHARRAY_7BYTES(charray)		\
-{							\
-  IOS_READ_INTO_CHARRAY_6BYTES(charray);		\
-  IOS_GET_C_ERR_CHCK((charray)[6], io);			\
-}
+struct ios_cache_page
+{
+  ios_dev_off base;
+  size_t size;
+  uint8_t *data;
+  size_t dirty_from;
+  size_t dirty_to;
+
+  struct ios_cache_page *prev;
+  struct ios_cache_page *next;
+  struct ios_cache_page *chain;
+};
 
-#define IOS_READ_INTO_CHARRAY_8BYTES(charray)		\
-{							\
-  IOS_READ_INTO_CHARRAY_7BYTES(charray);		\
-  IOS_GET_C_ERR_CHCK((charray)[7], io);			\
-}
+/* The cache itself.
 
-#define IOS_READ_INTO_CHARRAY_9BYTES(charray)		\
-{							\
-  IOS_READ_INTO_CHARRAY_8BYTES(charray);		\
-  IOS_GET_C_ERR_CHCK((charray)[8], io);			\
-}
+   PAGE_SIZE is the size of the pages, in bytes.  It is always a power
+   of two.
+
+   NUM_PAGES is the maximum number of pages that can be held in the
+   cache at the same time.  NUM_USED is the number of pages actually
+   in use.
+
+   NUM_DIRTY is the number of dirty pages.  When more than half of the
+   pages of the cache are dirty, they are all written back.
+
+   BUCKETS is a hash table of NUM_BUCKETS entries, indexed by page
+   number.
+
+   MRU and LRU are the ends of a doubly-linked list containing all the
+   pages in use, from the most recently used page to the least
+   recently used one.  The later is the one evicted when a new page is
+   needed and the cache is full.  */
+
+#define IOS_CACHE_PAGE_SIZE 4096
+#define IOS_CACHE_NUM_PAGES 256
+
+struct ios_cache
+{
+  size_t page_size;
+  size_t num_pages;
+  size_t num_used;
+  size_t num_dirty;
+
+  size_t num_buckets;
+  struct ios_cache_page **buckets;
+
+  struct ios_cache_page *mru;
+  struct ios_cache_page *lru;
+};
+
+/* When the pages of the cache are missed in ascending order, the IO
+   space is being read sequentially, as it happens when mapping an
+   array.  The IO device is then told in advance about the next pages
+   to be read, so it can fetch them while the previous ones are being
+   processed.  IOS_READAHEAD_PAGES is the default size of this
+   readahead window, in pages.  */
+
+#define IOS_READAHEAD_PAGES 32
+
+/* Transactions are implemented with an undo log, which records the
+   original contents of every range of the IO device written while a
+   transaction is in progress.
+
+   The log is a stack of entries, the most recent one first.  OFFSET
+   and COUNT delimit the range of the IO device that was written, and
+   DATA contains its original contents.  Entries whose DATA is NULL
+   mark the beginning of a transaction, so transactions can be
+   nested.  */
+
+struct ios_tx_entry
+{
+  ios_dev_off offset;
+  size_t count;
+  uint8_t *data;
+
+  struct ios_tx_entry *next;
+};
+
+/* Every IO space also keeps a journal of the writes performed in it,
+   so they can be undone and redone.
+
+   OFFSET and COUNT delimit the range of the IO device that was
+   written.  OLD_DATA contains the contents of the range before the
+   write, and NEW_DATA its contents after the write.  Bytes that were
+   past the end of the device are saved as zeroes in OLD_DATA.
+
+   OLD_DATA and NEW_DATA point into the buffers OLD_BUF and NEW_BUF,
+   of CAPACITY bytes each.  The spare room around the data allows
+   coalescing many adjacent writes in an entry without copying it
+   every time.
+
+   GROUP identifies the writes performed between two calls to
+   ios_journal_seal.  The entries of a group are undone and redone
+   together, and adjacent writes of the same group are coalesced in
+   a single entry.
+
+   PREV and NEXT link the entries from the oldest to the most recent
+   one.  */
+
+#define IOS_JOURNAL_MAX_SIZE (16 * 1024 * 1024)
+
+struct ios_journal_entry
+{
+  ios_dev_off offset;
+  size_t count;
+  uint8_t *old_data;
+  uint8_t *new_data;
+  uint8_t *old_buf;
+  uint8_t *new_buf;
+  size_t capacity;
+  unsigned long group;
+
+  struct ios_journal_entry *prev;
+  struct ios_journal_entry *next;
+};
+
+/* The update index of an IO space keeps the ranges of the IO device
+   covered by the values mapped from the space that are still up to
+   date.  See the Update API in ios.h.
+
+   The index is a treap of entries ordered by START, which allows
+   finding the entries overlapping some range in logarithmic time.
+
+   ID is the identifier of the mapped value.  START and END delimit
+   the range [START, END) of the IO device covered by the value.  END
+   is the largest possible offset if the value depends on all the
+   bytes following START.
+
+   ENDIAN and NENC are the endianness and negative encoding the value
+   was mapped with.
+
+   MAX_END is the largest END in the subtree rooted at the entry, and
+   PRIORITY is the random priority of the entry in the treap.  LEFT
+   and RIGHT are the children of the entry.
+
+   CHAIN links the entry in its bucket of the table of identifiers.
+
+   OLDER and NEWER link the entries in the order in which they were
+   registered.  When the index holds IOS_UPDATE_MAX_ENTRIES entries,
+   the oldest one is removed to make room for a new one.  */
+
+#define IOS_UPDATE_MAX_ENTRIES 16384
+
+struct ios_update_entry
+{
+  uint64_t id;
+  ios_dev_off start;
+  ios_dev_off end;
+  enum ios_endian endian;
+  enum ios_nenc nenc;
+  ios_dev_off max_end;
+  uint32_t priority;
+  struct ios_update_entry *left;
+  struct ios_update_entry *right;
+
+  struct ios_update_entry *chain;
+  struct ios_update_entry *older;
+  struct ios_update_entry *newer;
+};
 
 /* The following struct implements an instance of an IO space.
 
+   ID is the identifier of the space.  See ios_get_id.
+
    HANDLER is a copy of the handler string used to open the space.
 
    DEV is the device operated by the IO space.
    DEV_IF is the interface to use when operating the device.
 
-   NEXT is a pointer to the next open IO space, or NULL.
+   If the space is a slice of another IO space, PARENT is that other
+   space and DEV and DEV_IF are NULL.  The space is then a window of
+   SLICE_SIZE bytes starting at the device offset SLICE_START of the
+   parent.  All the accesses to the slice are performed in the
+   parent, so they share its cache, its transactions and its
+   journal.  SLICES is the list of the slices of the space, linked by
+   NEXT_SLICE.
+
+   CACHE is the page cache of the space.  See above.  Slices have
+   no cache of their own, and their CACHE is left empty.
+
+   RA_PAGES is the size of the readahead window of the space, in
+   pages.  Zero disables readahead.  RA_NEXT is the device offset of
+   the page following the last missed one, and RA_END is the end of
+   the range of the device announced to be read.  See above.
+
+   TX_LOG is the undo log of the transactions in progress in the
+   space, and TX_DEPTH is the number of such transactions.  See
+   above.
+
+   JOURNAL_FIRST and JOURNAL_LAST are the oldest and the most recent
+   entries in the journal of the space.  JOURNAL_CUR is the most
+   recent entry that is applied, or NULL if all the entries have been
+   undone.  The entries following it can be redone.
+
+   JOURNAL_SIZE is the memory used by the entries of the journal, in
+   bytes.  When it exceeds JOURNAL_MAX_SIZE the oldest entries are
+   discarded.
+
+   EXT_START and EXT_END delimit the range of the device whose bytes
+   were last found to be all in holes, if EXT_HOLE is 1, or all
+   stored, if EXT_HOLE is 0.  This saves asking the device again for
+   every page read in the same range.  See ios_dev_hole.
+
+   UPDATE_ROOT is the root of the update index of the space, and
+   UPDATE_BUCKETS is its table of identifiers, which is allocated the
+   first time a value is registered.  UPDATE_OLDEST and UPDATE_NEWEST
+   are the ends of the list of entries in the index, and UPDATE_NUM is
+   their number.  Slices have no index: the values mapped from them
+   are registered in the index of their parent.  See above.
+
+   PREV and NEXT link the space in the list of open IO spaces, and
+   CHAIN links it in its bucket of the table of handlers.  See
+   below.
 
    XXX: add status, saved or not saved.
  */
 
 struct ios
 {
+  int id;
   char *handler;
   void *dev;
   struct ios_dev_if *dev_if;
+  struct ios *parent;
+  ios_dev_off slice_start;
+  ios_dev_off slice_size;
+  struct ios *slices;
+  struct ios *next_slice;
   int mode;
-
+  struct ios_cache cache;
+  size_t ra_pages;
+  ios_dev_off ra_next;
+  ios_dev_off ra_end;
+  struct ios_tx_entry *tx_log;
+  int tx_depth;
+  struct ios_journal_entry *journal_first;
+  struct ios_journal_entry *journal_last;
+  struct ios_journal_entry *journal_cur;
+  size_t journal_size;
+  size_t journal_max_size;
+  ios_dev_off ext_start;
+  ios_dev_off ext_end;
+  int ext_hole;
+  struct ios_update_entry *update_root;
+  struct ios_update_entry **update_buckets;
+  struct ios_update_entry *update_oldest;
+  struct ios_update_entry *update_newest;
+  size_t update_num;
+
+  struct ios *prev;
   struct ios *next;
+  struct ios *chain;
 };
 
-/* List of IO spaces, and pointer to the current one.  */
+/* List of IO spaces, in the order in which they were opened, and
+   pointer to the current one.  IO_LIST is the oldest space, and
+   IO_LIST_LAST the most recent one.  */
 
 static struct ios *io_list;
+static struct ios *io_list_last;
 static struct ios *cur_io;
 
+/* Identifier to assign to the next IO space to be opened.  The
+   identifiers are never reused, so they designate the same space for
+   as long as it stays open.  */
+
+static int ios_next_id;
+
+/* Function to call before closing an IO space, or NULL.  See
+   ios_set_close_hook.  */
+
+static ios_close_fn ios_close_hook;
+
+/* The open IO spaces are indexed by identifier and by handler, so
+   they can be found without traversing the list above.
+
+   IO_TABLE is a table of IO_TABLE_SIZE entries, indexed by
+   identifier.  The entries of closed spaces are NULL.
+
+   IO_BUCKETS is a hash table of IO_NUM_BUCKETS entries, indexed by
+   handler.  It is grown when the number of open spaces, IO_NUM_OPEN,
+   exceeds the number of buckets.  */
+
+#define IOS_NUM_BUCKETS 64
+
+static struct ios **io_table;
+static size_t io_table_size;
+
+static struct ios **io_buckets;
+static size_t io_num_buckets;
+static size_t io_num_open;
+
+/* Geometry of the caches of new IO spaces.  */
+
+static size_t ios_cache_page_size = IOS_CACHE_PAGE_SIZE;
+static size_t ios_cache_num_pages = IOS_CACHE_NUM_PAGES;
+
+/* Size of the readahead window of new IO spaces.  */
+
+static size_t ios_readahead_pages = IOS_READAHEAD_PAGES;
+
+/* Maximum size of the journals of new IO spaces.  */
+
+static size_t ios_journal_max_size = IOS_JOURNAL_MAX_SIZE;
+
+/* Group of the journal entries created from now on.  */
+
+static unsigned long ios_journal_group;
+
+/* Flags used internally, in addition to the IOS_F_* flags defined in
+   ios.h.  */
+
+#define IOS_F_NO_JOURNAL 0x100 /* Don't record the write in the
+                                  journal.  */
+#define IOS_F_NO_TX      0x200 /* Don't record the write in the log of
+                                  the current transaction.  */
+
 /* The available backends are implemented in their own files, and
    provide the following interfaces.  */
 
+extern struct ios_dev_if ios_dev_mem; /* ios-dev-mem.c */
+extern struct ios_dev_if ios_dev_mmap; /* ios-dev-mmap.c */
+extern struct ios_dev_if ios_dev_cow; /* ios-dev-cow.c */
+extern struct ios_dev_if ios_dev_proc; /* ios-dev-proc.c */
+#if HAVE_ZLIB
+extern struct ios_dev_if ios_dev_gz; /* ios-dev-gz.c */
+#endif
+#if HAVE_IO_URING
+extern struct ios_dev_if ios_dev_uring; /* ios-dev-uring.c */
+#endif
+extern struct ios_dev_if ios_dev_direct; /* ios-dev-direct.c */
 extern struct ios_dev_if ios_dev_file; /* ios-dev-file.c */
 
+/* Note that the file backend accepts any handler, so it should be the
+   last one in this table.  The direct IO backend accepts plain paths
+   if direct IO is enabled, so it should precede it.  */
+
 static struct ios_dev_if *ios_dev_ifs[] =
   {
+   &ios_dev_mem,
+   &ios_dev_mmap,
+   &ios_dev_cow,
+   &ios_dev_proc,
+#if HAVE_ZLIB
+   &ios_dev_gz,
+#endif
+#if HAVE_IO_URING
+   &ios_dev_uring,
+#endif
+   &ios_dev_direct,
    &ios_dev_file,
    NULL,
   };
 
-void
-ios_init (void)
+/* Cache management.  */
+
+/* Return 1 if a cache of NUM_PAGES pages of PAGE_SIZE bytes is valid,
+   0 otherwise.  */
+
+static int
+ios_cache_geometry_p (size_t page_size, size_t num_pages)
 {
-  /* Nothing to do here... yet.  */
+  /* The page size should be a power of two.  */
+  return (page_size != 0 && (page_size & (page_size - 1)) == 0
+          && num_pages != 0 && num_pages <= IOS_CACHE_MAX_PAGES
+          && page_size <= IOS_CACHE_MAX_SIZE / num_pages);
+}
+
+static void
+ios_cache_init (struct ios_cache *cache,
+                size_t page_size, size_t num_pages)
+{
+  cache->page_size = page_size;
+  cache->num_pages = num_pages;
+  cache->num_used = 0;
+  cache->num_dirty = 0;
+  cache->num_buckets = num_pages * 2;
+  cache->buckets = xcalloc (cache->num_buckets,
+                            sizeof (struct ios_cache_page *));
+  cache->mru = NULL;
+  cache->lru = NULL;
+}
+
+static inline size_t
+ios_cache_bucket (struct ios_cache *cache, ios_dev_off base)
+{
+  return (base / cache->page_size) % cache->num_buckets;
+}
+
+static void
+ios_cache_unlink_lru (struct ios_cache *cache,
+                      struct ios_cache_page *page)
+{
+  if (page->prev)
+    page->prev->next = page->next;
+  else
+    cache->mru = page->next;
+
+  if (page->next)
+    page->next->prev = page->prev;
+  else
+    cache->lru = page->prev;
+}
+
+static void
+ios_cache_link_mru (struct ios_cache *cache,
+                    struct ios_cache_page *page)
+{
+  page->prev = NULL;
+  page->next = cache->mru;
+  if (cache->mru)
+    cache->mru->prev = page;
+  cache->mru = page;
+  if (cache->lru == NULL)
+    cache->lru = page;
+}
+
+static void
+ios_cache_unlink_bucket (struct ios_cache *cache,
+                         struct ios_cache_page *page)
+{
+  struct ios_cache_page **p;
+
+  for (p = &cache->buckets[ios_cache_bucket (cache, page->base)];
+       *p != page;
+       p = &(*p)->chain)
+    ;
+  *p = page->chain;
+}
+
+/* Drop all the pages of the given cache, discarding any pending
+   write.  */
+
+static void
+ios_cache_clear (struct ios_cache *cache)
+{
+  struct ios_cache_page *page, *next;
+
+  for (page = cache->mru; page; page = next)
+    {
+      next = page->next;
+      free (page->data);
+      free (page);
+    }
+
+  memset (cache->buckets, 0,
+          cache->num_buckets * sizeof (struct ios_cache_page *));
+  cache->mru = NULL;
+  cache->lru = NULL;
+  cache->num_used = 0;
+  cache->num_dirty = 0;
+}
+
+static void
+ios_cache_free (struct ios_cache *cache)
+{
+  ios_cache_clear (cache);
+  free (cache->buckets);
+  cache->buckets = NULL;
+}
+
+/* Read COUNT bytes at the offset OFFSET of the IO device operated by
+   IO, and put them in BUF.  The bulk read operation of the device is
+   used if it is available.  Otherwise SEEK and GET_C are used.
+   Return the number of bytes read, which is less than COUNT only if
+   the end of the device is reached, or -1 on error.  */
+
+static ssize_t
+ios_dev_read (ios io, void *buf, size_t count, ios_dev_off offset)
+{
+  uint8_t *bytes = buf;
+  size_t i;
+
+  if (io->dev_if->pread)
+    return io->dev_if->pread (io->dev, buf, count, offset);
+
+  if (io->dev_if->seek (io->dev, offset, IOD_SEEK_SET) == -1)
+    return -1;
+
+  for (i = 0; i < count; i++)
+    {
+      int c = io->dev_if->get_c (io->dev);
+
+      if (c == IOD_EOF)
+        break;
+      bytes[i] = c;
+    }
+
+  return i;
+}
+
+/* Write COUNT bytes from BUF at the offset OFFSET of the IO device
+   operated by IO.  The bulk write operation of the device is used if
+   it is available.  Otherwise SEEK and PUT_C are used.  Return the
+   number of bytes written, or -1 on error.  */
+
+static ssize_t
+ios_dev_write (ios io, const void *buf, size_t count, ios_dev_off offset)
+{
+  const uint8_t *bytes = buf;
+  size_t i;
+
+  /* Writing in a hole fills it.  */
+  if (offset < io->ext_end && offset + count > io->ext_start)
+    io->ext_start = io->ext_end = 0;
+
+  if (io->dev_if->pwrite)
+    return io->dev_if->pwrite (io->dev, buf, count, offset);
+
+  if (io->dev_if->seek (io->dev, offset, IOD_SEEK_SET) == -1)
+    return -1;
+
+  for (i = 0; i < count; i++)
+    if (io->dev_if->put_c (io->dev, bytes[i]) == IOD_EOF)
+      return -1;
+
+  return i;
+}
+
+/* Return 1 if the contents of the IO device of IO may change on their
+   own, 0 otherwise.  */
+
+static inline int
+ios_dev_volatile_p (ios io)
+{
+  return io->dev_if->volatile_p && io->dev_if->volatile_p (io->dev);
+}
+
+/* Determine whether the device offset OFFSET in IO is in a hole, and
+   put in END the end of the range starting at OFFSET whose bytes are
+   all in holes or all stored.  Return 1 if OFFSET is in a hole, 0 if
+   it is not, and -1 on error or if OFFSET is past the end of the
+   device.  Devices without holes are stored until the largest
+   possible offset.  */
+
+static int
+ios_dev_hole (ios io, ios_dev_off offset, ios_dev_off *end)
+{
+  int ret;
+
+  if (io->dev_if->hole == NULL)
+    {
+      *end = (ios_dev_off) -1;
+      return 0;
+    }
+
+  if (offset >= io->ext_start && offset < io->ext_end)
+    {
+      *end = io->ext_end;
+      return io->ext_hole;
+    }
+
+  ret = io->dev_if->hole (io->dev, offset, end);
+  if (ret != -1)
+    {
+      io->ext_start = offset;
+      io->ext_end = *end;
+      io->ext_hole = ret;
+    }
+
+  return ret;
+}
+
+/* Write back the dirty bytes of the NUM_PAGES pages in PAGES to the
+   IO device of IO.  The dirty ranges of the pages must be contiguous
+   in the device, so they are written with a single operation.  Return
+   IOS_OK on success, IOS_ERROR otherwise.  In case of error the pages
+   are kept dirty.  */
+
+static int
+ios_cache_writeback (ios io, struct ios_cache_page **pages,
+                     size_t num_pages)
+{
+  struct ios_cache_page *first = pages[0];
+  struct ios_cache_page *last = pages[num_pages - 1];
+  ios_dev_off offset = first->base + first->dirty_from;
+  size_t count = last->base + last->dirty_to - offset;
+  uint8_t *buf;
+  ssize_t nbytes;
+  size_t i;
+
+  if (num_pages == 1)
+    nbytes = ios_dev_write (io, first->data + first->dirty_from,
+                            count, offset);
+  else
+    {
+      uint8_t *p;
+
+      p = buf = xmalloc (count);
+      for (i = 0; i < num_pages; i++)
+        {
+          memcpy (p, pages[i]->data + pages[i]->dirty_from,
+                  pages[i]->dirty_to - pages[i]->dirty_from);
+          p += pages[i]->dirty_to - pages[i]->dirty_from;
+        }
+
+      nbytes = ios_dev_write (io, buf, count, offset);
+      free (buf);
+    }
+
+  if (nbytes != (ssize_t) count)
+    return IOS_ERROR;
+
+  for (i = 0; i < num_pages; i++)
+    {
+      pages[i]->dirty_from = pages[i]->dirty_to = 0;
+      io->cache.num_dirty--;
+    }
+
+  return IOS_OK;
+}
+
+/* Return the page of CACHE whose base is BASE, or NULL if the page is
+   not in the cache.  */
+
+static struct ios_cache_page *
+ios_cache_lookup (struct ios_cache *cache, ios_dev_off base)
+{
+  struct ios_cache_page *page;
+
+  for (page = cache->buckets[ios_cache_bucket (cache, base)];
+       page;
+       page = page->chain)
+    if (page->base == base)
+      break;
+
+  return page;
+}
+
+/* Remove PAGE from the cache of IO and free it.  If the page is
+   dirty it is written back first.  Return IOS_OK on success, or
+   IOS_ERROR if the page couldn't be written back, in which case it is
+   kept in the cache.  */
+
+static int
+ios_cache_drop (ios io, struct ios_cache_page *page)
+{
+  struct ios_cache *cache = &io->cache;
+
+  if (page->dirty_to != 0
+      && ios_cache_writeback (io, &page, 1) != IOS_OK)
+    return IOS_ERROR;
+
+  ios_cache_unlink_lru (cache, page);
+  ios_cache_unlink_bucket (cache, page);
+  free (page->data);
+  free (page);
+  cache->num_used--;
+  return IOS_OK;
+}
+
+/* Drop the pages of the cache of IO that overlap with the device
+   range [OFFSET, OFFSET + COUNT).  Return IOS_OK on success, or
+   IOS_ERROR if some dirty page couldn't be written back and had to be
+   kept.  */
+
+static int
+ios_cache_invalidate (ios io, ios_dev_off offset, size_t count)
+{
+  struct ios_cache *cache = &io->cache;
+  struct ios_cache_page *page, *next;
+  int ret = IOS_OK;
+
+  for (page = cache->mru; page; page = next)
+    {
+      next = page->next;
+      if (page->base < offset + count
+          && offset < page->base + cache->page_size
+          && ios_cache_drop (io, page) != IOS_OK)
+        ret = IOS_ERROR;
+    }
+
+  return ret;
+}
+
+/* Copy the COUNT bytes in BUF, which have been written at the device
+   offset OFFSET, into the pages of the cache of IO that overlap with
+   the written range.  Pages that would get a gap between their valid
+   contents and the new bytes are dropped instead.  Return IOS_OK on
+   success, or IOS_ERROR if some dirty page couldn't be written back
+   before being dropped.  Such pages are kept, since their contents
+   don't overlap with the written range.  */
+
+static int
+ios_cache_update (ios io, ios_dev_off offset, const void *buf,
+                  size_t count)
+{
+  struct ios_cache *cache = &io->cache;
+  ios_dev_off end = offset + count;
+  ios_dev_off base;
+  int ret = IOS_OK;
+
+  for (base = offset & ~((ios_dev_off) cache->page_size - 1);
+       base < end;
+       base += cache->page_size)
+    {
+      struct ios_cache_page *page = ios_cache_lookup (cache, base);
+      ios_dev_off from, to;
+
+      if (page == NULL)
+        continue;
+
+      from = offset > base ? offset : base;
+      to = end < base + cache->page_size ? end : base + cache->page_size;
+
+      if (from > base + page->size)
+        {
+          if (ios_cache_drop (io, page) != IOS_OK)
+            ret = IOS_ERROR;
+        }
+      else
+        {
+          memcpy (page->data + (from - base),
+                  (const uint8_t *) buf + (from - offset),
+                  to - from);
+          if (to - base > page->size)
+            page->size = to - base;
+        }
+    }
+
+  return ret;
+}
+
+/* Fill PAGE with the contents of the IO device of IO, starting at the
+   page base.  Pages entirely in a hole of the device are filled with
+   zeroes, without reading them.  Return IOS_OK if at least one byte
+   could be read, IOS_EIOFF otherwise.  */
+
+static int
+ios_cache_fill (ios io, struct ios_cache_page *page)
+{
+  size_t page_size = io->cache.page_size;
+  ios_dev_off end;
+  ssize_t nbytes;
+
+  if (ios_dev_hole (io, page->base, &end) == 1
+      && end - page->base >= page_size)
+    {
+      memset (page->data, 0, page_size);
+      nbytes = page_size;
+    }
+  else
+    nbytes = ios_dev_read (io, page->data, page_size, page->base);
+
+  if (nbytes <= 0)
+    return IOS_EIOFF;
+
+  page->size = nbytes;
+  page->dirty_from = page->dirty_to = 0;
+  return IOS_OK;
+}
+
+/* Get a page for the cache of IO, evicting the least recently used
+   one if the cache is full.  The page is not linked in the cache.
+   Return NULL if the evicted page couldn't be written back.  */
+
+static struct ios_cache_page *
+ios_cache_new_page (ios io)
+{
+  struct ios_cache *cache = &io->cache;
+  struct ios_cache_page *page;
+
+  if (cache->num_used < cache->num_pages)
+    {
+      page = xmalloc (sizeof (struct ios_cache_page));
+      page->data = xmalloc (cache->page_size);
+      cache->num_used++;
+    }
+  else
+    {
+      page = cache->lru;
+      if (page->dirty_to != 0
+          && ios_cache_writeback (io, &page, 1) != IOS_OK)
+        return NULL;
+      ios_cache_unlink_lru (cache, page);
+      ios_cache_unlink_bucket (cache, page);
+    }
+
+  return page;
+}
+
+/* Link the filled PAGE in the cache of IO, as the most recently used
+   page.  */
+
+static void
+ios_cache_link (ios io, struct ios_cache_page *page)
+{
+  struct ios_cache *cache = &io->cache;
+  size_t bucket = ios_cache_bucket (cache, page->base);
+
+  page->chain = cache->buckets[bucket];
+  cache->buckets[bucket] = page;
+  ios_cache_link_mru (cache, page);
+}
+
+/* Free PAGE, which was got with ios_cache_new_page but couldn't be
+   filled.  */
+
+static void
+ios_cache_free_page (ios io, struct ios_cache_page *page)
+{
+  free (page->data);
+  free (page);
+  io->cache.num_used--;
+}
+
+/* Read the pages of IO overlapping with the device range [OFFSET,
+   OFFSET + COUNT) that are not in the cache, all at once, using the
+   batched read operation of the device.  The most recently used page
+   is never evicted to make room for them, and the pages that don't
+   fit in the cache are not read.  Pages entirely in a hole of the
+   device are filled with zeroes instead, like in ios_cache_fill.
+   Devices without batched reads are just told that the range will be
+   read soon.  */
+
+static void
+ios_cache_prefetch (ios io, ios_dev_off offset, ios_dev_off count)
+{
+  struct ios_cache *cache = &io->cache;
+  struct ios_dev_read_req *reqs;
+  struct ios_cache_page **pages;
+  size_t num_reqs = 0, max_reqs, i;
+  ios_dev_off base;
+
+  if (count == 0)
+    return;
+
+  if (io->dev_if->pread_batch == NULL)
+    {
+      if (io->dev_if->advise)
+        io->dev_if->advise (io->dev, offset,
+                            count < SIZE_MAX ? count : SIZE_MAX);
+      return;
+    }
+
+  max_reqs = cache->num_pages - 1;
+  if (max_reqs == 0)
+    return;
+  if (count / cache->page_size + 1 < max_reqs)
+    max_reqs = count / cache->page_size + 1;
+
+  reqs = xmalloc (max_reqs * sizeof (struct ios_dev_read_req));
+  pages = xmalloc (max_reqs * sizeof (struct ios_cache_page *));
+
+  for (base = offset & ~((ios_dev_off) cache->page_size - 1);
+       base < offset + count && num_reqs < max_reqs;
+       base += cache->page_size)
+    {
+      struct ios_cache_page *page;
+      ios_dev_off end;
+
+      if (ios_cache_lookup (cache, base))
+        continue;
+
+      page = ios_cache_new_page (io);
+      if (page == NULL)
+        break;
+
+      page->base = base;
+      if (ios_dev_hole (io, base, &end) == 1
+          && end - base >= cache->page_size)
+        {
+          /* The page is linked as the most recently used one, so it
+             is not evicted by the pages allocated after it, and it
+             counts as one of the pages that can be allocated.  */
+          memset (page->data, 0, cache->page_size);
+          page->size = cache->page_size;
+          page->dirty_from = page->dirty_to = 0;
+          ios_cache_link (io, page);
+          max_reqs--;
+          continue;
+        }
+
+      pages[num_reqs] = page;
+      reqs[num_reqs].buf = page->data;
+      reqs[num_reqs].count = cache->page_size;
+      reqs[num_reqs].offset = base;
+      num_reqs++;
+    }
+
+  if (num_reqs > 0)
+    io->dev_if->pread_batch (io->dev, reqs, num_reqs);
+
+  for (i = 0; i < num_reqs; i++)
+    {
+      struct ios_cache_page *page = pages[i];
+
+      if (reqs[i].nbytes <= 0)
+        ios_cache_free_page (io, page);
+      else
+        {
+          page->size = reqs[i].nbytes;
+          page->dirty_from = page->dirty_to = 0;
+          ios_cache_link (io, page);
+        }
+    }
+
+  free (reqs);
+  free (pages);
+}
+
+/* Note that the cache page of IO at device offset BASE has been
+   missed.  If the previous miss was on the preceding page, ask the
+   device to prefetch the pages following BASE.  The window is
+   extended once the reader has consumed half of it, so it always
+   stays ahead.
+
+   Devices supporting batched reads have the window read into the
+   cache at once, so the next miss is expected at its end.  */
+
+static void
+ios_readahead (ios io, ios_dev_off base)
+{
+  size_t page_size = io->cache.page_size;
+  ios_dev_off end = base + page_size * (ios_dev_off) (io->ra_pages + 1);
+  ios_dev_off from;
+  int sequential = (base == io->ra_next);
+
+  io->ra_next = base + page_size;
+  if (!sequential)
+    {
+      io->ra_end = 0;
+      return;
+    }
+
+  if (io->ra_pages == 0
+      || (io->dev_if->advise == NULL && io->dev_if->pread_batch == NULL)
+      || base + page_size * (io->ra_pages / 2) < io->ra_end)
+    return;
+
+  from = io->ra_end > io->ra_next ? io->ra_end : io->ra_next;
+  ios_cache_prefetch (io, from, end - from);
+  if (io->dev_if->pread_batch)
+    io->ra_next = end;
+  io->ra_end = end;
+}
+
+/* Put in PAGEP the cache page of IO holding the byte at device offset
+   OFFSET, reading it from the device if needed.  Return IOS_OK on
+   success, IOS_EIOFF if OFFSET can't be read, and IOS_ERROR if the
+   page evicted to make room for it couldn't be written back.  */
+
+static int
+ios_cache_get_page (ios io, ios_dev_off offset,
+                    struct ios_cache_page **pagep)
+{
+  struct ios_cache *cache = &io->cache;
+  ios_dev_off base = offset & ~((ios_dev_off) cache->page_size - 1);
+  struct ios_cache_page *page;
+
+  /* Most accesses hit the page that was used last.  */
+  page = cache->mru;
+  if (page && page->base == base)
+    goto found;
+
+  page = ios_cache_lookup (cache, base);
+  if (page)
+    {
+      ios_cache_unlink_lru (cache, page);
+      ios_cache_link_mru (cache, page);
+      goto found;
+    }
+
+  /* Cache miss.  */
+  page = ios_cache_new_page (io);
+  if (page == NULL)
+    return IOS_ERROR;
+
+  page->base = base;
+  if (ios_cache_fill (io, page) != IOS_OK)
+    {
+      ios_cache_free_page (io, page);
+      return IOS_EIOFF;
+    }
+  ios_cache_link (io, page);
+
+  /* Note that the readahead doesn't evict the page just read, which
+     is the most recently used one.  */
+  ios_readahead (io, base);
+
+ found:
+  if (offset - base >= page->size)
+    return IOS_EIOFF;
+  *pagep = page;
+  return IOS_OK;
+}
+
+/* Read COUNT bytes located at the device offset OFFSET in IO, and put
+   them in BUF.  The bytes are read from the cache, unless FLAGS
+   contains IOS_F_BYPASS_CACHE or the device is volatile.  Return
+   IOS_OK if all the bytes were read, IOS_ERROR if a dirty page of the
+   cache couldn't be written back to make room for them, IOS_EIOFF
+   otherwise.  */
+
+static int
+ios_read_raw (ios io, int flags, ios_dev_off offset,
+              void *buf, size_t count)
+{
+  uint8_t *bytes = buf;
+
+  if (io->parent)
+    {
+      if (offset >= io->slice_size || count > io->slice_size - offset)
+        return IOS_EIOFF;
+      return ios_read_raw (io->parent, flags, io->slice_start + offset,
+                           buf, count);
+    }
+
+  /* Devices whose contents are addressable in memory are not
+     cached.  */
+  if (io->dev_if->mem)
+    {
+      ios_dev_off size;
+      const uint8_t *data = io->dev_if->mem (io->dev, &size);
+
+      if (offset >= size || count > size - offset)
+        return IOS_EIOFF;
+      memcpy (buf, data + offset, count);
+      return IOS_OK;
+    }
+
+  /* Neither are devices whose contents change on their own, since the
+     cached copies would get out of date.  */
+  if ((flags & IOS_F_BYPASS_CACHE) || ios_dev_volatile_p (io))
+    {
+      /* The device must reflect the pending writes.  */
+      if (ios_flush (io) != IOS_OK)
+        return IOS_EIOFF;
+      return (ios_dev_read (io, buf, count, offset) == (ssize_t) count
+              ? IOS_OK : IOS_EIOFF);
+    }
+
+  while (count > 0)
+    {
+      struct ios_cache_page *page;
+      size_t avail, nbytes;
+      int ret = ios_cache_get_page (io, offset, &page);
+
+      if (ret != IOS_OK)
+        return ret;
+
+      avail = page->size - (offset - page->base);
+      nbytes = count < avail ? count : avail;
+      memcpy (bytes, page->data + (offset - page->base), nbytes);
+
+      bytes += nbytes;
+      offset += nbytes;
+      count -= nbytes;
+    }
+
+  return IOS_OK;
+}
+
+/* Write the COUNT bytes in BUF at the device offset OFFSET of the IO
+   device of IO, keeping the cache coherent.  Return IOS_OK if all the
+   bytes were written, IOS_ERROR if some dirty page of the cache
+   couldn't be written back, IOS_EIOFF otherwise.  */
+
+static int
+ios_write_through (ios io, ios_dev_off offset,
+                   const void *buf, size_t count)
+{
+  if (ios_dev_write (io, buf, count, offset) != (ssize_t) count)
+    {
+      /* We don't know what actually got written.  */
+      if (ios_cache_invalidate (io, offset, count) != IOS_OK)
+        return IOS_ERROR;
+      return IOS_EIOFF;
+    }
+
+  return ios_cache_update (io, offset, buf, count);
+}
+
+/* Read up to COUNT bytes located at the device offset OFFSET in IO,
+   and put them in BUF.  Return the number of bytes read, which is
+   less than COUNT if the range extends past the end of the
+   device.  */
+
+static size_t
+ios_read_avail (ios io, ios_dev_off offset, void *buf, size_t count)
+{
+  uint8_t *bytes = buf;
+  size_t nbytes;
+
+  if (ios_read_raw (io, 0, offset, buf, count) == IOS_OK)
+    return count;
+
+  for (nbytes = 0; nbytes < count; nbytes++)
+    if (ios_read_raw (io, 0, offset + nbytes, bytes + nbytes, 1) != IOS_OK)
+      break;
+
+  return nbytes;
+}
+
+/* Save in the undo log of IO that the COUNT bytes at the device
+   offset OFFSET contained OLD before they were written.  Only the
+   bytes that existed are saved, so COUNT is zero if the write started
+   past the end of the device.  */
+
+static void
+ios_tx_record (ios io, ios_dev_off offset, const uint8_t *old,
+               size_t count)
+{
+  struct ios_tx_entry *entry;
+
+  if (count == 0)
+    return;
+
+  entry = xmalloc (sizeof (struct ios_tx_entry));
+  entry->offset = offset;
+  entry->count = count;
+  entry->data = xmalloc (count);
+  memcpy (entry->data, old, count);
+
+  entry->next = io->tx_log;
+  io->tx_log = entry;
+}
+
+/* Journal management.  */
+
+static inline size_t
+ios_journal_entry_size (struct ios_journal_entry *entry)
+{
+  return sizeof (struct ios_journal_entry) + 2 * entry->capacity;
+}
+
+static void
+ios_journal_free_entry (ios io, struct ios_journal_entry *entry)
+{
+  io->journal_size -= ios_journal_entry_size (entry);
+  free (entry->old_buf);
+  free (entry->new_buf);
+  free (entry);
+}
+
+/* Save in BUF the current contents of the COUNT bytes at the device
+   offset OFFSET in IO.  Bytes past the end of the device are saved as
+   zeroes.  Return the number of bytes that exist.  */
+
+static size_t
+ios_journal_save (ios io, ios_dev_off offset, uint8_t *buf, size_t count)
+{
+  size_t nbytes = ios_read_avail (io, offset, buf, count);
+
+  memset (buf + nbytes, 0, count - nbytes);
+  return nbytes;
+}
+
+/* Extend the range of the journal entry ENTRY of IO by BEFORE bytes
+   before its start and AFTER bytes after its end.  The contents of
+   the new bytes are undefined.  The buffers of the entry are
+   reallocated only if they have no room for the new bytes, and then
+   their capacity is at least doubled, and the spare room is split
+   between both sides of the data.  */
+
+static void
+ios_journal_grow (ios io, struct ios_journal_entry *entry,
+                  size_t before, size_t after)
+{
+  size_t head = entry->old_data - entry->old_buf;
+
+  if (before > head || after > entry->capacity - head - entry->count)
+    {
+      size_t count = entry->count + before + after;
+      size_t capacity = 2 * entry->capacity;
+      uint8_t *old_buf, *new_buf;
+
+      if (capacity < count)
+        capacity = count;
+      head = (capacity - count) / 2 + before;
+
+      old_buf = xmalloc (capacity);
+      new_buf = xmalloc (capacity);
+      memcpy (old_buf + head, entry->old_data, entry->count);
+      memcpy (new_buf + head, entry->new_data, entry->count);
+      free (entry->old_buf);
+      free (entry->new_buf);
+
+      io->journal_size += 2 * (capacity - entry->capacity);
+      entry->old_buf = old_buf;
+      entry->new_buf = new_buf;
+      entry->capacity = capacity;
+    }
+
+  entry->old_data = entry->old_buf + head - before;
+  entry->new_data = entry->new_buf + head - before;
+  entry->offset -= before;
+  entry->count += before + after;
+}
+
+/* Discard the entries of the journal of IO that can be redone.  */
+
+static void
+ios_journal_drop_redo (ios io)
+{
+  struct ios_journal_entry *entry, *next;
+
+  entry = io->journal_cur ? io->journal_cur->next : io->journal_first;
+  for (; entry; entry = next)
+    {
+      next = entry->next;
+      ios_journal_free_entry (io, entry);
+    }
+
+  if (io->journal_cur)
+    io->journal_cur->next = NULL;
+  else
+    io->journal_first = NULL;
+  io->journal_last = io->journal_cur;
+}
+
+/* Discard the oldest entries of the journal of IO until it doesn't
+   exceed its maximum size.  There must be no entries to redo.  */
+
+static void
+ios_journal_trim (ios io)
+{
+  while (io->journal_first && io->journal_size > io->journal_max_size)
+    {
+      struct ios_journal_entry *entry = io->journal_first;
+
+      io->journal_first = entry->next;
+      if (entry->next)
+        entry->next->prev = NULL;
+      else
+        io->journal_last = io->journal_cur = NULL;
+      ios_journal_free_entry (io, entry);
+    }
+}
+
+/* Record in the journal of IO that the COUNT bytes in BUF have been
+   written at the device offset OFFSET, where the bytes in OLD were,
+   as saved by ios_journal_save.  */
+
+static void
+ios_journal_record (ios io, ios_dev_off offset, const uint8_t *old,
+                    const void *buf, size_t count)
+{
+  struct ios_journal_entry *last;
+
+  if (io->journal_max_size == 0)
+    return;
+
+  /* A new write makes the undone entries unreachable.  */
+  ios_journal_drop_redo (io);
+  last = io->journal_last;
+
+  if (last && last->group == ios_journal_group
+      && offset <= last->offset + last->count
+      && last->offset <= offset + count)
+    {
+      /* Coalesce the write with the last entry, whose saved old
+         contents take precedence over the current ones, so only the
+         old contents of the bytes it doesn't cover yet are saved.  */
+      ios_dev_off start = last->offset;
+      ios_dev_off end = last->offset + last->count;
+      size_t before = offset < start ? start - offset : 0;
+      size_t after = offset + count > end ? offset + count - end : 0;
+
+      ios_journal_grow (io, last, before, after);
+      memcpy (last->old_data, old, before);
+      memcpy (last->old_data + (end - last->offset),
+              old + (end - offset), after);
+      memcpy (last->new_data + (offset - last->offset), buf, count);
+    }
+  else
+    {
+      struct ios_journal_entry *entry
+        = xmalloc (sizeof (struct ios_journal_entry));
+
+      entry->offset = offset;
+      entry->count = count;
+      entry->old_data = entry->old_buf = xmalloc (count);
+      entry->new_data = entry->new_buf = xmalloc (count);
+      entry->capacity = count;
+      entry->group = ios_journal_group;
+
+      memcpy (entry->old_data, old, count);
+      memcpy (entry->new_data, buf, count);
+
+      entry->next = NULL;
+      entry->prev = last;
+      if (last)
+        last->next = entry;
+      else
+        io->journal_first = entry;
+      io->journal_last = io->journal_cur = entry;
+      io->journal_size += ios_journal_entry_size (entry);
+    }
+
+  ios_journal_trim (io);
+}
+
+/* Identifier of the next value registered in an update index.
+   Identifiers are never reused, so an entry can't be mistaken for an
+   entry that was removed.  */
+
+static uint64_t ios_update_next_id = 1;
+
+/* Return a pseudo-random priority for an entry of an update index.  */
+
+static uint32_t
+ios_update_priority (void)
+{
+  static uint32_t state = 2463534242U;
+
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+/* Return 1 if the entry A goes before the entry B in an update index,
+   0 otherwise.  */
+
+static int
+ios_update_before (struct ios_update_entry *a, struct ios_update_entry *b)
+{
+  return a->start < b->start || (a->start == b->start && a->id < b->id);
+}
+
+/* Recompute the MAX_END of ENTRY from the ones of its children.  */
+
+static void
+ios_update_fix (struct ios_update_entry *entry)
+{
+  entry->max_end = entry->end;
+  if (entry->left && entry->left->max_end > entry->max_end)
+    entry->max_end = entry->left->max_end;
+  if (entry->right && entry->right->max_end > entry->max_end)
+    entry->max_end = entry->right->max_end;
+}
+
+/* Insert ENTRY in the treap rooted at ROOT, and return the new
+   root.  */
+
+static struct ios_update_entry *
+ios_update_insert (struct ios_update_entry *root,
+                   struct ios_update_entry *entry)
+{
+  struct ios_update_entry *child;
+
+  if (root == NULL)
+    return entry;
+
+  if (ios_update_before (entry, root))
+    {
+      root->left = ios_update_insert (root->left, entry);
+      if (root->left->priority > root->priority)
+        {
+          child = root->left;
+          root->left = child->right;
+          child->right = root;
+          ios_update_fix (root);
+          root = child;
+        }
+    }
+  else
+    {
+      root->right = ios_update_insert (root->right, entry);
+      if (root->right->priority > root->priority)
+        {
+          child = root->right;
+          root->right = child->left;
+          child->left = root;
+          ios_update_fix (root);
+          root = child;
+        }
+    }
+
+  ios_update_fix (root);
+  return root;
+}
+
+/* Merge the treaps rooted at A and B, whose entries all go before the
+   ones of B, and return the new root.  */
+
+static struct ios_update_entry *
+ios_update_merge (struct ios_update_entry *a, struct ios_update_entry *b)
+{
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+
+  if (a->priority > b->priority)
+    {
+      a->right = ios_update_merge (a->right, b);
+      ios_update_fix (a);
+      return a;
+    }
+
+  b->left = ios_update_merge (a, b->left);
+  ios_update_fix (b);
+  return b;
+}
+
+/* Remove ENTRY from the treap rooted at ROOT, and return the new
+   root.  */
+
+static struct ios_update_entry *
+ios_update_remove (struct ios_update_entry *root,
+                   struct ios_update_entry *entry)
+{
+  if (root == entry)
+    return ios_update_merge (root->left, root->right);
+
+  if (ios_update_before (entry, root))
+    root->left = ios_update_remove (root->left, entry);
+  else
+    root->right = ios_update_remove (root->right, entry);
+
+  ios_update_fix (root);
+  return root;
+}
+
+/* Remove ENTRY from the update index of IO and free it.  The mapped
+   value it belongs to is stale from now on.  */
+
+static void
+ios_update_drop (ios io, struct ios_update_entry *entry)
+{
+  struct ios_update_entry **p;
+
+  io->update_root = ios_update_remove (io->update_root, entry);
+
+  for (p = &io->update_buckets[entry->id % IOS_UPDATE_MAX_ENTRIES];
+       *p != entry;
+       p = &(*p)->chain)
+    ;
+  *p = entry->chain;
+
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    io->update_oldest = entry->newer;
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    io->update_newest = entry->older;
+
+  io->update_num--;
+  free (entry);
+}
+
+/* Remove all the entries from the update index of IO.  */
+
+static void
+ios_update_clear (ios io)
+{
+  while (io->update_oldest)
+    ios_update_drop (io, io->update_oldest);
+}
+
+/* Mark as stale the values mapped from IO that cover some of the
+   COUNT bytes starting at the device offset OFFSET.  */
+
+static void
+ios_update_invalidate (ios io, ios_dev_off offset, size_t count)
+{
+  ios_dev_off end = offset + count;
+
+  for (;;)
+    {
+      struct ios_update_entry *entry = io->update_root;
+
+      /* Look for an entry overlapping the range.  If the left subtree
+         has some entry ending after OFFSET but none of them
+         overlaps, then no entry of the right subtree can overlap.  */
+      while (entry && !(entry->start < end && entry->end > offset))
+        entry = (entry->left && entry->left->max_end > offset
+                 ? entry->left : entry->right);
+
+      if (entry == NULL)
+        break;
+      ios_update_drop (io, entry);
+    }
+}
+
+/* Write the COUNT bytes in BUF at the device offset OFFSET in IO.
+   The bytes are buffered in the cache, unless FLAGS contains
+   IOS_F_BYPASS_CACHE or the device is volatile.  Return IOS_OK if
+   all the bytes were written, IOS_ERROR if a dirty page of the cache
+   couldn't be written back to make room for them, IOS_EIOFF
+   otherwise.  */
+
+static int
+ios_write_buffered (ios io, int flags, ios_dev_off offset,
+                    const void *buf, size_t count)
+{
+  struct ios_cache *cache = &io->cache;
+  const uint8_t *bytes = buf;
+
+  if (io->dev_if->mem || (flags & IOS_F_BYPASS_CACHE)
+      || ios_dev_volatile_p (io))
+    return ios_write_through (io, offset, buf, count);
+
+  while (count > 0)
+    {
+      struct ios_cache_page *page;
+      size_t from, nbytes;
+      int ret = ios_cache_get_page (io, offset, &page);
+
+      /* Bytes past the end of the device are not buffered, but
+         written directly.  That way, devices that can't grow report
+         the error right away.  */
+      if (ret == IOS_EIOFF)
+        return ios_write_through (io, offset, bytes, count);
+      if (ret != IOS_OK)
+        return ret;
+
+      from = offset - page->base;
+      nbytes = page->size - from;
+      if (count < nbytes)
+        nbytes = count;
+
+      memcpy (page->data + from, bytes, nbytes);
+
+      if (page->dirty_to == 0)
+        {
+          page->dirty_from = from;
+          page->dirty_to = from + nbytes;
+          cache->num_dirty++;
+        }
+      else
+        {
+          if (from < page->dirty_from)
+            page->dirty_from = from;
+          if (from + nbytes > page->dirty_to)
+            page->dirty_to = from + nbytes;
+        }
+
+      bytes += nbytes;
+      offset += nbytes;
+      count -= nbytes;
+    }
+
+  /* The writes performed during a transaction are flushed when it is
+     committed.  */
+  if (io->tx_depth == 0
+      && cache->num_dirty > cache->num_pages / 2
+      && ios_flush (io) != IOS_OK)
+    return IOS_EIOFF;
+
+  return IOS_OK;
+}
+
+/* Write the COUNT bytes in BUF at the device offset OFFSET in IO,
+   like ios_write_buffered, and return its result.  Once the write
+   succeeds, it is recorded in the journal of IO, unless FLAGS
+   contains IOS_F_NO_JOURNAL, and in the log of the current
+   transaction, unless FLAGS contains IOS_F_NO_TX.  */
+
+static int
+ios_write_raw (ios io, int flags, ios_dev_off offset,
+               const void *buf, size_t count)
+{
+  uint8_t *old = NULL;
+  size_t nold = 0;
+  int journal_p, tx_p, ret;
+
+  /* Slices can't grow.  */
+  if (io->parent)
+    {
+      if (offset > io->slice_size || count > io->slice_size - offset)
+        return IOS_EIOFF;
+      return ios_write_raw (io->parent, flags, io->slice_start + offset,
+                            buf, count);
+    }
+
+  if (count > 0 && !(flags & IOS_F_BYPASS_UPDATE))
+    ios_update_invalidate (io, offset, count);
+
+  /* The previous contents are saved before writing, but they are
+     recorded only if the write succeeds.  */
+  journal_p = (count > 0 && io->journal_max_size != 0
+               && !(flags & IOS_F_NO_JOURNAL));
+  tx_p = count > 0 && io->tx_depth > 0 && !(flags & IOS_F_NO_TX);
+  if (journal_p || tx_p)
+    {
+      old = xmalloc (count);
+      nold = ios_journal_save (io, offset, old, count);
+    }
+
+  ret = ios_write_buffered (io, flags, offset, buf, count);
+  if (ret == IOS_OK)
+    {
+      if (journal_p)
+        ios_journal_record (io, offset, old, buf, count);
+      if (tx_p)
+        ios_tx_record (io, offset, old, nold);
+    }
+
+  free (old);
+  return ret;
+}
+
+/* Compute the length of the NULL-terminated string located at the
+   device offset OFFSET in IO, not including the terminating NULL
+   byte, and put it in LEN.  The end of the device also terminates the
+   string.  The string is scanned in the cache, unless FLAGS contains
+   IOS_F_BYPASS_CACHE or the device is volatile.
+
+   If MAX_LEN is not zero, it is the maximum length of the string.
+   Return IOS_EIOBJ if the string is longer than that, IOS_EIOFF if
+   OFFSET is past the end of the device, IOS_ERROR if a dirty page of
+   the cache couldn't be written back, IOS_OK otherwise.  */
+
+static int
+ios_string_length (ios io, int flags, ios_dev_off offset,
+                   size_t max_len, size_t *len)
+{
+  const uint8_t *data, *nul;
+  size_t nbytes;
+
+  *len = 0;
+
+  if (io->parent)
+    {
+      ios_dev_off avail;
+      int ret;
+
+      if (offset >= io->slice_size)
+        return IOS_EIOFF;
+
+      avail = io->slice_size - offset;
+      if (max_len != 0 && max_len < avail)
+        return ios_string_length (io->parent, flags,
+                                  io->slice_start + offset, max_len, len);
+
+      /* The end of the slice terminates the string.  */
+      ret = ios_string_length (io->parent, flags,
+                               io->slice_start + offset, avail, len);
+      if (ret == IOS_EIOBJ)
+        {
+          *len = avail;
+          ret = IOS_OK;
+        }
+      return ret;
+    }
+
+  if (io->dev_if->mem)
+    {
+      ios_dev_off size;
+
+      data = io->dev_if->mem (io->dev, &size);
+      if (offset >= size)
+        return IOS_EIOFF;
+
+      nbytes = size - offset;
+      if (max_len != 0 && nbytes > max_len)
+        nbytes = max_len + 1;
+
+      nul = memchr (data + offset, '\0', nbytes);
+      *len = nul ? nul - (data + offset) : nbytes;
+    }
+  else if ((flags & IOS_F_BYPASS_CACHE) || ios_dev_volatile_p (io))
+    {
+      uint8_t buf[256];
+      ssize_t nread;
+
+      if (ios_flush (io) != IOS_OK)
+        return IOS_EIOFF;
+
+      do
+        {
+          nbytes = sizeof (buf);
+          if (max_len != 0 && nbytes > max_len + 1 - *len)
+            nbytes = max_len + 1 - *len;
+
+          nread = ios_dev_read (io, buf, nbytes, offset + *len);
+          if (nread <= 0)
+            {
+              if (*len == 0)
+                return IOS_EIOFF;
+              break;
+            }
+
+          nul = memchr (buf, '\0', nread);
+          *len += nul ? nul - buf : nread;
+        }
+      while (nul == NULL
+             && (size_t) nread == nbytes
+             && (max_len == 0 || *len <= max_len));
+    }
+  else
+    {
+      do
+        {
+          struct ios_cache_page *page;
+          size_t pos;
+          int ret = ios_cache_get_page (io, offset + *len, &page);
+
+          if (ret == IOS_ERROR)
+            return ret;
+          if (ret != IOS_OK)
+            {
+              if (*len == 0)
+                return IOS_EIOFF;
+              break;
+            }
+
+          pos = offset + *len - page->base;
+          nbytes = page->size - pos;
+          if (max_len != 0 && nbytes > max_len + 1 - *len)
+            nbytes = max_len + 1 - *len;
+
+          nul = memchr (page->data + pos, '\0', nbytes);
+          *len += nul ? nul - (page->data + pos) : nbytes;
+        }
+      while (nul == NULL && (max_len == 0 || *len <= max_len));
+    }
+
+  if (max_len != 0 && *len > max_len)
+    return IOS_EIOBJ;
+
+  return IOS_OK;
+}
+
+/* Return a hash of the handler HANDLER, to be used as an index in
+   the table of handlers.  */
+
+static size_t
+ios_hash_handler (const char *handler)
+{
+  size_t hash = 5381;
+
+  for (; *handler != '\0'; handler++)
+    hash = hash * 33 + (unsigned char) *handler;
+
+  return hash;
+}
+
+/* Add the IO space IO to the table of handlers.  */
+
+static void
+ios_link_handler (struct ios *io)
+{
+  size_t bucket = ios_hash_handler (io->handler) & (io_num_buckets - 1);
+
+  io->chain = io_buckets[bucket];
+  io_buckets[bucket] = io;
+}
+
+/* Add the newly opened IO space IO to the end of the list of open
+   spaces, and to the indexes.  */
+
+static void
+ios_link (struct ios *io)
+{
+  struct ios *tmp;
+
+  /* Grow the table of identifiers, if needed.  */
+  if ((size_t) io->id >= io_table_size)
+    {
+      size_t new_size = io_table_size ? io_table_size * 2 : 16;
+
+      io_table = xrealloc (io_table, new_size * sizeof (struct ios *));
+      memset (io_table + io_table_size, 0,
+              (new_size - io_table_size) * sizeof (struct ios *));
+      io_table_size = new_size;
+    }
+  io_table[io->id] = io;
+
+  /* Grow the table of handlers, if needed, rehashing the open
+     spaces.  */
+  if (io_num_open >= io_num_buckets)
+    {
+      free (io_buckets);
+      io_num_buckets = io_num_buckets ? io_num_buckets * 2 : IOS_NUM_BUCKETS;
+      io_buckets = xmalloc (io_num_buckets * sizeof (struct ios *));
+      memset (io_buckets, 0, io_num_buckets * sizeof (struct ios *));
+      for (tmp = io_list; tmp; tmp = tmp->next)
+        ios_link_handler (tmp);
+    }
+  ios_link_handler (io);
+  io_num_open++;
+
+  io->prev = io_list_last;
+  io->next = NULL;
+  if (io_list_last)
+    io_list_last->next = io;
+  else
+    io_list = io;
+  io_list_last = io;
+}
+
+/* Remove the IO space IO from the list of open spaces, and from the
+   indexes.  */
+
+static void
+ios_unlink (struct ios *io)
+{
+  struct ios **p;
+
+  io_table[io->id] = NULL;
+
+  for (p = &io_buckets[ios_hash_handler (io->handler)
+                       & (io_num_buckets - 1)];
+       *p != io;
+       p = &(*p)->chain)
+    ;
+  *p = io->chain;
+  io_num_open--;
+
+  if (io->prev)
+    io->prev->next = io->next;
+  else
+    io_list = io->next;
+  if (io->next)
+    io->next->prev = io->prev;
+  else
+    io_list_last = io->prev;
+}
+
+void
+ios_init (void)
+{
+  /* Nothing to do here... yet.  */
+}
+
+void
+ios_shutdown (void)
+{
+  /* Close and free all open IO spaces.  Nothing is going to use their
+     contents anymore.  */
+  ios_close_hook = NULL;
+  while (io_list)
+    ios_close (io_list);
+
+  free (io_table);
+  io_table = NULL;
+  io_table_size = 0;
+  free (io_buckets);
+  io_buckets = NULL;
+  io_num_buckets = 0;
+}
+
+struct ios_dev_if *
+ios_dev_lookup (const char *handler)
+{
+  struct ios_dev_if **dev_if;
+
+  for (dev_if = ios_dev_ifs; *dev_if; ++dev_if)
+    {
+      if ((*dev_if)->handler_p (handler))
+        break;
+    }
+
+  return *dev_if;
+}
+
+/* Parse the handler SPEC of a slice, which is of the form
+   START+SIZE/HANDLER, and set the slice fields of IO accordingly.
+   HANDLER is the handler of the parent space, which must be open.
+   Return IOS_ERROR if SPEC is not valid, IOS_OK otherwise.  */
+
+static int
+ios_parse_slice (ios io, const char *spec)
+{
+  char *end;
+
+  if (!isdigit ((unsigned char) *spec))
+    return IOS_ERROR;
+  io->slice_start = strtoull (spec, &end, 0);
+  if (*end != '+' || !isdigit ((unsigned char) end[1]))
+    return IOS_ERROR;
+  io->slice_size = strtoull (end + 1, &end, 0);
+  if (*end != '/')
+    return IOS_ERROR;
+
+  io->parent = ios_search (end + 1);
+  return io->parent ? IOS_OK : IOS_ERROR;
+}
+
+int
+ios_open (const char *handler)
+{
+  struct ios *io = NULL;
+
+  /* Allocate and initialize the new IO space.  */
+  io = xmalloc (sizeof (struct ios));
+  io->handler = xstrdup (handler);
+  io->parent = NULL;
+  io->slices = NULL;
+  io->dev = NULL;
+  io->dev_if = NULL;
+
+  if (strncmp (handler, "slice://", 8) == 0)
+    {
+      /* The space is a window of some other space.  There is no
+         device to open.  */
+      if (ios_parse_slice (io, handler + 8) != IOS_OK)
+        goto error;
+    }
+  else
+    {
+      /* Look for a device interface suitable to operate on the given
+         handler.  */
+      io->dev_if = ios_dev_lookup (handler);
+      if (io->dev_if == NULL)
+        goto error;
+
+      /* Open the device using the interface found above.  */
+      io->dev = io->dev_if->open (handler);
+      if (io->dev == NULL)
+        goto error;
+    }
+
+  if (io->parent)
+    memset (&io->cache, 0, sizeof (struct ios_cache));
+  else
+    ios_cache_init (&io->cache, ios_cache_page_size, ios_cache_num_pages);
+  io->ra_pages = ios_readahead_pages;
+  io->ra_next = io->ra_end = 0;
+  io->tx_log = NULL;
+  io->tx_depth = 0;
+  io->journal_first = io->journal_last = io->journal_cur = NULL;
+  io->journal_size = 0;
+  io->journal_max_size = ios_journal_max_size;
+  io->ext_start = io->ext_end = 0;
+  io->update_root = NULL;
+  io->update_buckets = NULL;
+  io->update_oldest = io->update_newest = NULL;
+  io->update_num = 0;
+  io->id = ios_next_id++;
+
+  /* Add the newly created space to the list and the indexes, and
+     update the current space.  */
+  ios_link (io);
+  if (io->parent)
+    {
+      io->next_slice = io->parent->slices;
+      io->parent->slices = io;
+    }
+
+  cur_io = io;
+
+  return 1;
+
+ error:
+  if (io)
+    free (io->handler);
+  free (io);
+
+  return 0;
+}
+
+void
+ios_close (ios io)
+{
+  /* XXX: if not saved, ask before closing.  */
+
+  /* Close the slices of the space first, since they access it.  */
+  while (io->slices)
+    ios_close (io->slices);
+
+  /* Undo any unfinished transaction.  */
+  while (io->tx_depth > 0)
+    ios_tx_rollback (io);
+
+  /* Let the users of the space read what they still need.  */
+  if (ios_close_hook)
+    ios_close_hook (io);
+
+  /* Flush and dispose the cache.
+     XXX: handle errors.  */
+  ios_flush (io);
+  if (io->parent == NULL)
+    ios_cache_free (&io->cache);
+
+  /* Dispose the journal and the update index.  */
+  io->journal_cur = NULL;
+  ios_journal_drop_redo (io);
+  ios_update_clear (io);
+  free (io->update_buckets);
+
+  /* Close the device operated by the IO space.
+     XXX: handle errors.  */
+  if (io->dev_if)
+    assert (io->dev_if->close (io->dev));
+
+  /* Unlink the IOS from the list, the indexes and the slices of its
+     parent.  */
+  ios_unlink (io);
+  if (io->parent)
+    {
+      struct ios **p;
+
+      for (p = &io->parent->slices; *p != io; p = &(*p)->next_slice)
+        ;
+      *p = io->next_slice;
+    }
+
+  /* Set the new current IO, which is the most recently opened
+     space.  */
+  if (cur_io == io)
+    cur_io = io_list_last;
+
+  free (io->handler);
+  free (io);
+}
+
+int
+ios_mode (ios io)
+{
+  return io->mode;
+}
+
+ios_off
+ios_tell (ios io)
+{
+  ios_dev_off dev_off;
+
+  /* Slices don't have a current position.  */
+  if (io->parent)
+    return 0;
+
+  dev_off = io->dev_if->tell (io->dev);
+  return dev_off * 8;
+}
+
+const char *
+ios_handler (ios io)
+{
+  return io->handler;
+}
+
+ios
+ios_cur (void)
+{
+  return cur_io;
+}
+
+void
+ios_set_cur (ios io)
+{
+  cur_io = io;
+}
+
+ios
+ios_search (const char *handler)
+{
+  ios io;
+
+  if (io_buckets == NULL)
+    return NULL;
+
+  for (io = io_buckets[ios_hash_handler (handler) & (io_num_buckets - 1)];
+       io;
+       io = io->chain)
+    if (STREQ (io->handler, handler))
+      break;
+
+  return io;
+}
+
+ios
+ios_get (int id)
+{
+  if (id < 0 || (size_t) id >= io_table_size)
+    return NULL;
+
+  return io_table[id];
+}
+
+void
+ios_set_close_hook (ios_close_fn fn)
+{
+  ios_close_hook = fn;
+}
+
+int
+ios_get_id (ios io)
+{
+  return io->id;
+}
+
+void
+ios_map (ios_map_fn cb, void *data)
+{
+  ios io, next;
+
+  for (io = io_list; io; io = next)
+    {
+      next = io->next;
+      (*cb) (io, data);
+    }
+}
+
+int
+ios_save (ios io, const char *filename)
+{
+  int fd;
+  int ret = IOS_OK;
+
+  if (ios_flush (io) != IOS_OK)
+    return IOS_ERROR;
+
+  fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1)
+    return IOS_ERROR;
+
+  if (io->parent)
+    {
+      size_t buf_size = 64 * 1024;
+      uint8_t *buf = xmalloc (buf_size);
+      ios_dev_off offset;
+
+      for (offset = 0; offset < io->slice_size; offset += buf_size)
+        {
+          size_t nbytes = io->slice_size - offset < buf_size
+            ? io->slice_size - offset : buf_size;
+
+          if (ios_read_raw (io, 0, offset, buf, nbytes) != IOS_OK
+              || write (fd, buf, nbytes) != (ssize_t) nbytes)
+            {
+              ret = IOS_ERROR;
+              break;
+            }
+        }
+
+      free (buf);
+    }
+  else if (io->dev_if->mem)
+    {
+      /* The contents of the device are in memory: write them at
+         once.  */
+      ios_dev_off size;
+      const uint8_t *data = io->dev_if->mem (io->dev, &size);
+
+      while (size > 0)
+        {
+          ssize_t nbytes = write (fd, data, size);
+
+          if (nbytes == -1)
+            {
+              ret = IOS_ERROR;
+              break;
+            }
+
+          data += nbytes;
+          size -= nbytes;
+        }
+    }
+  else
+    {
+      size_t buf_size = 64 * 1024;
+      uint8_t *buf = xmalloc (buf_size);
+      ios_dev_off offset = 0;
+      ssize_t nbytes;
+
+      while ((nbytes = ios_dev_read (io, buf, buf_size, offset)) > 0)
+        {
+          if (write (fd, buf, nbytes) != nbytes)
+            break;
+          offset += nbytes;
+        }
+
+      if (nbytes != 0)
+        ret = IOS_ERROR;
+      free (buf);
+    }
+
+  if (close (fd) == -1)
+    ret = IOS_ERROR;
+
+  return ret;
+}
+
+/* Deltas are stored in files starting with the IOS_DELTA_MAGIC
+   bytes, followed by a sequence of records.  Every record contains
+   the offset of a range of bytes and its size, both encoded as 64-bit
+   big-endian numbers, followed by the bytes themselves.  */
+
+#define IOS_DELTA_MAGIC "POKEDLT1"
+#define IOS_DELTA_MAGIC_SIZE 8
+#define IOS_DELTA_BUF_SIZE (64 * 1024)
+
+static void
+ios_delta_put (uint8_t *bytes, uint64_t value)
+{
+  int i;
+
+  for (i = 7; i >= 0; i--, value >>= 8)
+    bytes[i] = value & 0xff;
+}
+
+static uint64_t
+ios_delta_get (const uint8_t *bytes)
+{
+  uint64_t value = 0;
+  int i;
+
+  for (i = 0; i < 8; i++)
+    value = (value << 8) | bytes[i];
+  return value;
+}
+
+int
+ios_delta_export (ios io, const char *filename)
+{
+  ios_dev_off offset = 0, start;
+  size_t count;
+  uint8_t *buf;
+  FILE *f;
+  int ret = IOS_OK;
+
+  if (io->parent || io->dev_if->delta == NULL
+      || ios_flush (io) != IOS_OK)
+    return IOS_ERROR;
+
+  f = fopen (filename, "wb");
+  if (f == NULL)
+    return IOS_ERROR;
+
+  buf = xmalloc (IOS_DELTA_BUF_SIZE);
+  if (fwrite (IOS_DELTA_MAGIC, 1, IOS_DELTA_MAGIC_SIZE, f)
+      != IOS_DELTA_MAGIC_SIZE)
+    ret = IOS_ERROR;
+
+  while (ret == IOS_OK
+         && io->dev_if->delta (io->dev, offset, &start, &count))
+    {
+      ios_delta_put (buf, start);
+      ios_delta_put (buf + 8, count);
+      if (fwrite (buf, 1, 16, f) != 16)
+        ret = IOS_ERROR;
+
+      for (offset = start; ret == IOS_OK && count > 0;)
+        {
+          size_t chunk
+            = count < IOS_DELTA_BUF_SIZE ? count : IOS_DELTA_BUF_SIZE;
+
+          if (ios_dev_read (io, buf, chunk, offset) != (ssize_t) chunk
+              || fwrite (buf, 1, chunk, f) != chunk)
+            ret = IOS_ERROR;
+
+          offset += chunk;
+          count -= chunk;
+        }
+    }
+
+  free (buf);
+  if (fclose (f) != 0)
+    ret = IOS_ERROR;
+  return ret;
+}
+
+int
+ios_delta_import (ios io, const char *filename)
+{
+  uint8_t *buf;
+  size_t nbytes;
+  FILE *f;
+  int ret = IOS_OK;
+
+  f = fopen (filename, "rb");
+  if (f == NULL)
+    return IOS_ERROR;
+
+  buf = xmalloc (IOS_DELTA_BUF_SIZE);
+  if (fread (buf, 1, IOS_DELTA_MAGIC_SIZE, f) != IOS_DELTA_MAGIC_SIZE
+      || memcmp (buf, IOS_DELTA_MAGIC, IOS_DELTA_MAGIC_SIZE) != 0)
+    {
+      free (buf);
+      fclose (f);
+      return IOS_ERROR;
+    }
+
+  /* Write all the records in a transaction, so a truncated or
+     otherwise invalid file doesn't leave the space half patched.  */
+  ios_tx_begin (io);
+  while (ret == IOS_OK && (nbytes = fread (buf, 1, 16, f)) > 0)
+    {
+      ios_dev_off offset = ios_delta_get (buf);
+      uint64_t count = ios_delta_get (buf + 8);
+
+      if (nbytes != 16)
+        ret = IOS_ERROR;
+
+      while (ret == IOS_OK && count > 0)
+        {
+          size_t chunk
+            = count < IOS_DELTA_BUF_SIZE ? count : IOS_DELTA_BUF_SIZE;
+
+          if (fread (buf, 1, chunk, f) != chunk
+              || ios_write_raw (io, 0, offset, buf, chunk) != IOS_OK)
+            ret = IOS_ERROR;
+
+          offset += chunk;
+          count -= chunk;
+        }
+    }
+
+  if (ret == IOS_OK && !ferror (f))
+    ret = ios_tx_commit (io);
+  else
+    {
+      ios_tx_rollback (io);
+      ret = IOS_ERROR;
+    }
+
+  free (buf);
+  fclose (f);
+  return ret;
+}
+
+int
+ios_delta_apply (ios io)
+{
+  if (io->parent || io->dev_if->commit == NULL
+      || ios_flush (io) != IOS_OK
+      || io->dev_if->commit (io->dev) == -1)
+    return IOS_ERROR;
+
+  return IOS_OK;
+}
+
+static int
+ios_cache_page_cmp (const void *a, const void *b)
+{
+  const struct ios_cache_page *pa = *(struct ios_cache_page * const *) a;
+  const struct ios_cache_page *pb = *(struct ios_cache_page * const *) b;
+
+  return (pa->base > pb->base) - (pa->base < pb->base);
+}
+
+void
+ios_prefetch (ios io, ios_off offset, ios_off size)
+{
+  ios_dev_off start, end;
+
+  if (offset < 0 || size <= 0)
+    return;
+
+  /* Round the range of bits out to whole bytes.  */
+  start = offset / 8;
+  end = ((ios_dev_off) offset + size + 7) / 8;
+
+  if (io->parent)
+    {
+      if (start >= io->slice_size)
+        return;
+      if (end > io->slice_size)
+        end = io->slice_size;
+      ios_prefetch (io->parent, (io->slice_start + start) * 8,
+                    (end - start) * 8);
+      return;
+    }
+
+  if (io->dev_if->mem || ios_dev_volatile_p (io))
+    return;
+
+  ios_cache_prefetch (io, start, end - start);
+}
+
+int
+ios_next_data (ios io, ios_off offset, ios_off *data)
+{
+  ios_dev_off end;
+  int ret;
+
+  if (offset < 0)
+    return IOS_EIOFF;
+
+  if (io->parent)
+    {
+      ios_off slice_end = (ios_off) io->slice_size * 8;
+
+      if (offset >= slice_end)
+        return IOS_EIOFF;
+      ret = ios_next_data (io->parent, io->slice_start * 8 + offset, data);
+      if (ret != IOS_OK)
+        return ret;
+      *data -= io->slice_start * 8;
+      if (*data > slice_end)
+        *data = slice_end;
+      return IOS_OK;
+    }
+
+  if (io->dev_if->hole == NULL)
+    {
+      *data = offset;
+      return IOS_OK;
+    }
+
+  /* The dirty pages are not in the device yet.  */
+  if (ios_flush (io) != IOS_OK)
+    return IOS_ERROR;
+
+  ret = ios_dev_hole (io, offset / 8, &end);
+  if (ret == -1)
+    return IOS_EIOFF;
+
+  *data = ret == 1 ? (ios_off) end * 8 : offset;
+  return IOS_OK;
+}
+
+int
+ios_next_hole (ios io, ios_off offset, ios_off *hole)
+{
+  ios_dev_off end, hole_end;
+  int ret;
+
+  if (offset < 0)
+    return IOS_EIOFF;
+
+  if (io->parent)
+    {
+      if (offset >= io->slice_size * 8)
+        return IOS_EIOFF;
+      ret = ios_next_hole (io->parent, io->slice_start * 8 + offset, hole);
+      if (ret != IOS_OK)
+        return ret;
+      *hole -= io->slice_start * 8;
+      return *hole < (ios_off) io->slice_size * 8 ? IOS_OK : IOS_EIOFF;
+    }
+
+  if (io->dev_if->hole == NULL)
+    return IOS_EIOFF;
+
+  if (ios_flush (io) != IOS_OK)
+    return IOS_ERROR;
+
+  ret = ios_dev_hole (io, offset / 8, &end);
+  if (ret == 1)
+    {
+      *hole = offset;
+      return IOS_OK;
+    }
+
+  /* The data may extend until the end of the device.  */
+  if (ret == -1 || ios_dev_hole (io, end, &hole_end) != 1)
+    return IOS_EIOFF;
+
+  *hole = (ios_off) end * 8;
+  return IOS_OK;
+}
+
+int
+ios_flush (ios io)
+{
+  struct ios_cache *cache = &io->cache;
+  struct ios_cache_page **pages, *page;
+  size_t num_pages = 0;
+  size_t i, j;
+  int ret = IOS_OK;
+
+  if (io->parent)
+    return ios_flush (io->parent);
+
+  if (cache->num_dirty == 0)
+    return IOS_OK;
+
+  /* Sort the dirty pages by offset, so the runs of contiguous dirty
+     bytes spanning several pages can be written at once.  */
+  pages = xmalloc (cache->num_dirty * sizeof (struct ios_cache_page *));
+  for (page = cache->mru; page; page = page->next)
+    if (page->dirty_to != 0)
+      pages[num_pages++] = page;
+  qsort (pages, num_pages, sizeof (struct ios_cache_page *),
+         ios_cache_page_cmp);
+
+  for (i = 0; i < num_pages; i = j)
+    {
+      for (j = i + 1; j < num_pages; j++)
+        if (pages[j - 1]->dirty_to != cache->page_size
+            || pages[j]->dirty_from != 0
+            || pages[j]->base != pages[j - 1]->base + cache->page_size)
+          break;
+
+      if (ios_cache_writeback (io, pages + i, j - i) != IOS_OK)
+        ret = IOS_ERROR;
+    }
+
+  free (pages);
+  return ret;
+}
+
+uint64_t
+ios_update_register (ios io, ios_off offset, ios_off size,
+                     enum ios_endian endian, enum ios_nenc nenc)
+{
+  struct ios_update_entry *entry, **bucket;
+
+  if (offset < 0)
+    offset = 0;
+
+  /* The values mapped from a slice can't depend on bytes past its
+     end.  */
+  if (io->parent)
+    {
+      ios_off slice_end = (ios_off) io->slice_size * 8;
+
+      if (offset > slice_end)
+        offset = slice_end;
+      if (size < 0 || size > slice_end - offset)
+        size = slice_end - offset;
+      return ios_update_register (io->parent,
+                                  io->slice_start * 8 + offset, size,
+                                  endian, nenc);
+    }
+
+  /* There is no way to tell when the contents of volatile devices
+     change.  */
+  if (ios_dev_volatile_p (io))
+    return 0;
+
+  if (io->update_buckets == NULL)
+    io->update_buckets = xcalloc (IOS_UPDATE_MAX_ENTRIES,
+                                  sizeof (struct ios_update_entry *));
+  else if (io->update_num == IOS_UPDATE_MAX_ENTRIES)
+    ios_update_drop (io, io->update_oldest);
+
+  entry = xmalloc (sizeof (struct ios_update_entry));
+  entry->id = ios_update_next_id++;
+  entry->start = offset / 8;
+  entry->end = (size < 0
+                ? (ios_dev_off) -1
+                : ((ios_dev_off) offset + size + 7) / 8);
+  entry->endian = endian;
+  entry->nenc = nenc;
+  entry->priority = ios_update_priority ();
+  entry->left = entry->right = NULL;
+  ios_update_fix (entry);
+  io->update_root = ios_update_insert (io->update_root, entry);
+
+  bucket = &io->update_buckets[entry->id % IOS_UPDATE_MAX_ENTRIES];
+  entry->chain = *bucket;
+  *bucket = entry;
+
+  entry->older = io->update_newest;
+  entry->newer = NULL;
+  if (io->update_newest)
+    io->update_newest->newer = entry;
+  else
+    io->update_oldest = entry;
+  io->update_newest = entry;
+  io->update_num++;
+
+  return entry->id;
+}
+
+int
+ios_update_fresh_p (ios io, uint64_t id,
+                    enum ios_endian endian, enum ios_nenc nenc)
+{
+  struct ios_update_entry *entry;
+
+  if (io->parent)
+    return ios_update_fresh_p (io->parent, id, endian, nenc);
+
+  if (io->update_buckets == NULL)
+    return 0;
+
+  for (entry = io->update_buckets[id % IOS_UPDATE_MAX_ENTRIES];
+       entry;
+       entry = entry->chain)
+    if (entry->id == id)
+      return entry->endian == endian && entry->nenc == nenc;
+
+  return 0;
+}
+
+int
+ios_tx_begin (ios io)
+{
+  struct ios_tx_entry *mark;
+
+  if (io->parent)
+    return ios_tx_begin (io->parent);
+
+  mark = xmalloc (sizeof (struct ios_tx_entry));
+  mark->offset = 0;
+  mark->count = 0;
+  mark->data = NULL;
+  mark->next = io->tx_log;
+  io->tx_log = mark;
+  io->tx_depth++;
+
+  return IOS_OK;
+}
+
+int
+ios_tx_commit (ios io)
+{
+  struct ios_tx_entry **p, *entry, *next;
+
+  if (io->parent)
+    return ios_tx_commit (io->parent);
+
+  if (io->tx_depth == 0)
+    return IOS_ERROR;
+
+  /* Remove the mark of the innermost transaction.  Its entries now
+     belong to the enclosing transaction, if any.  */
+  for (p = &io->tx_log; (*p)->data != NULL; p = &(*p)->next)
+    ;
+  entry = *p;
+  *p = entry->next;
+  free (entry);
+
+  if (--io->tx_depth > 0)
+    return IOS_OK;
+
+  for (entry = io->tx_log; entry; entry = next)
+    {
+      next = entry->next;
+      free (entry->data);
+      free (entry);
+    }
+  io->tx_log = NULL;
+
+  return ios_flush (io);
+}
+
+int
+ios_tx_rollback (ios io)
+{
+  struct ios_tx_entry *entry;
+  int ret = IOS_OK;
+
+  if (io->parent)
+    return ios_tx_rollback (io->parent);
+
+  if (io->tx_depth == 0)
+    return IOS_ERROR;
+
+  /* Restore the saved contents, the most recent first.  The restoring
+     writes themselves are neither logged nor journaled, and they stay
+     in the cache until the outermost transaction ends, like the
+     writes they undo.  */
+  while ((entry = io->tx_log) != NULL)
+    {
+      io->tx_log = entry->next;
+
+      if (entry->data == NULL)
+        {
+          free (entry);
+          break;
+        }
+
+      if (ios_write_raw (io, IOS_F_NO_JOURNAL | IOS_F_NO_TX,
+                         entry->offset, entry->data,
+                         entry->count) != IOS_OK)
+        ret = IOS_ERROR;
+      free (entry->data);
+      free (entry);
+    }
+
+  if (--io->tx_depth == 0 && ios_flush (io) != IOS_OK)
+    ret = IOS_ERROR;
+
+  return ret;
+}
+
+int
+ios_tx_depth (ios io)
+{
+  if (io->parent)
+    return ios_tx_depth (io->parent);
+
+  return io->tx_depth;
 }
 
 void
-ios_shutdown (void)
+ios_journal_seal (void)
 {
-  /* Close and free all open IO spaces.  */
-  while (io_list)
-    ios_close (io_list);
+  ios_journal_group++;
 }
 
 int
-ios_open (const char *handler)
+ios_undo (ios io)
 {
-  struct ios *io = NULL;
-  struct ios_dev_if **dev_if = NULL;
-
-  /* Allocate and initialize the new IO space.  */
-  io = xmalloc (sizeof (struct ios));
-  io->next = NULL;
-  io->handler = xstrdup (handler);
-
-  /* Look for a device interface suitable to operate on the given
-     handler.  */
-  for (dev_if = ios_dev_ifs; *dev_if; ++dev_if)
-    {
-      if ((*dev_if)->handler_p (handler))
-        break;
-    }
-
-  if (*dev_if == NULL)
-    goto error;
-
-  io->dev_if = *dev_if;
-
-  /* Open the device using the interface found above.  */
-  io->dev = io->dev_if->open (handler);
-  if (io->dev == NULL)
-    goto error;
+  struct ios_journal_entry *entry = io->journal_cur;
+  unsigned long group;
+  int ret = IOS_OK;
 
-  /* Add the newly created space to the list, and update the current
-     space.  */
-  io->next = io_list;
-  io_list = io;
-
-  cur_io = io;
+  if (io->parent)
+    return ios_undo (io->parent);
 
-  return 1;
+  if (entry == NULL)
+    return IOS_EJOURNAL;
 
- error:
-  if (io)
-    free (io->handler);
-  free (io);
+  group = entry->group;
+  for (; entry && entry->group == group; entry = entry->prev)
+    if (ios_write_raw (io, IOS_F_NO_JOURNAL, entry->offset,
+                       entry->old_data, entry->count) != IOS_OK)
+      ret = IOS_ERROR;
 
-  return 0;
+  io->journal_cur = entry;
+  return ret;
 }
 
-void
-ios_close (ios io)
+int
+ios_redo (ios io)
 {
-  struct ios *tmp;
+  struct ios_journal_entry *entry;
+  unsigned long group;
+  int ret = IOS_OK;
 
-  /* XXX: if not saved, ask before closing.  */
+  if (io->parent)
+    return ios_redo (io->parent);
 
-  /* Close the device operated by the IO space.
-     XXX: handle errors.  */
-  assert (io->dev_if->close (io->dev));
+  entry = io->journal_cur ? io->journal_cur->next : io->journal_first;
+  if (entry == NULL)
+    return IOS_EJOURNAL;
 
-  /* Unlink the IOS from the list.  */
-  assert (io_list != NULL); /* The list must contain at least one IO
-                               space.  */
-  if (io_list == io)
-    io_list = io_list->next;
-  else
+  group = entry->group;
+  for (; entry && entry->group == group; entry = entry->next)
     {
-      for (tmp = io_list; tmp->next != io; tmp = tmp->next)
-        ;
-      tmp->next = io->next;
+      if (ios_write_raw (io, IOS_F_NO_JOURNAL, entry->offset,
+                         entry->new_data, entry->count) != IOS_OK)
+        ret = IOS_ERROR;
+      io->journal_cur = entry;
     }
-  free (io);
 
-  /* Set the new current IO.  */
-  cur_io = io_list;
+  return ret;
 }
 
 int
-ios_mode (ios io)
+ios_set_journal_size (ios io, size_t max_size)
 {
-  return io->mode;
-}
+  if (max_size > IOS_JOURNAL_SIZE_LIMIT)
+    return IOS_ERROR;
 
-ios_off
-ios_tell (ios io)
-{
-  ios_dev_off dev_off = io->dev_if->tell (io->dev);
-  return dev_off * 8;
+  io->journal_max_size = max_size;
+  ios_journal_drop_redo (io);
+  ios_journal_trim (io);
+  return IOS_OK;
 }
 
-const char *
-ios_handler (ios io)
+static void
+ios_set_journal_size_1 (ios io, void *data)
 {
-  return io->handler;
+  ios_set_journal_size (io, ios_journal_max_size);
 }
 
-ios
-ios_cur (void)
+int
+ios_set_journal_size_default (size_t max_size)
 {
-  return cur_io;
+  if (max_size > IOS_JOURNAL_SIZE_LIMIT)
+    return IOS_ERROR;
+
+  ios_journal_max_size = max_size;
+  ios_map (ios_set_journal_size_1, NULL);
+  return IOS_OK;
 }
 
-void
-ios_set_cur (ios io)
+size_t
+ios_journal_size_default (void)
 {
-  cur_io = io;
+  return ios_journal_max_size;
 }
 
-ios
-ios_search (const char *handler)
+int
+ios_set_cache (ios io, size_t page_size, size_t num_pages)
 {
-  ios io;
+  if (!ios_cache_geometry_p (page_size, num_pages))
+    return IOS_ERROR;
 
-  for (io = io_list; io; io = io->next)
-    if (STREQ (io->handler, handler))
-      break;
+  /* Slices are read and written through the cache of their
+     parent.  */
+  if (io->parent)
+    return IOS_OK;
 
-  return io;
+  if (ios_flush (io) != IOS_OK)
+    return IOS_ERROR;
+
+  ios_cache_free (&io->cache);
+  ios_cache_init (&io->cache, page_size, num_pages);
+  io->ra_next = io->ra_end = 0;
+
+  /* The contents of the space will be read again, and may have
+     changed since the values mapped from it were read.  */
+  ios_update_clear (io);
+  return IOS_OK;
 }
 
-ios
-ios_get (int n)
+int
+ios_set_cache_default (size_t page_size, size_t num_pages)
 {
-  ios io;
+  struct ios *io;
 
-  if (n < 0)
-    return NULL;
+  if (!ios_cache_geometry_p (page_size, num_pages))
+    return IOS_ERROR;
 
-  for (io = io_list; io && n > 0; n--, io = io->next)
-    ;
+  /* Flush all the caches first, so either all of them get the new
+     geometry or none.  */
+  for (io = io_list; io; io = io->next)
+    if (ios_flush (io) != IOS_OK)
+      return IOS_ERROR;
 
-  return io;
+  for (io = io_list; io; io = io->next)
+    if (ios_set_cache (io, page_size, num_pages) != IOS_OK)
+      return IOS_ERROR;
+
+  ios_cache_page_size = page_size;
+  ios_cache_num_pages = num_pages;
+  return IOS_OK;
 }
 
 void
-ios_map (ios_map_fn cb, void *data)
+ios_cache_default (size_t *page_size, size_t *num_pages)
 {
-  ios io;
+  *page_size = ios_cache_page_size;
+  *num_pages = ios_cache_num_pages;
+}
 
-  for (io = io_list; io; io = io->next)
-    (*cb) (io, data);
+int
+ios_set_readahead (ios io, size_t num_pages)
+{
+  if (num_pages > IOS_READAHEAD_MAX_PAGES)
+    return IOS_ERROR;
+
+  io->ra_pages = num_pages;
+  io->ra_end = 0;
+  return IOS_OK;
 }
 
-inline static void
-ios_mask_first_byte(uint64_t *byte, int significant_bits)
+static void
+ios_set_readahead_1 (ios io, void *data)
 {
-  switch (significant_bits)
-    {
-    case 1:
-      *byte &= (char) 0x01;
-      return;
-    case 2:
-      *byte &= (char) 0x03;
-      return;
-    case 3:
-      *byte &= (char) 0x07;
-      return;
-    case 4:
-      *byte &= (char) 0x0f;
-      return;
-    case 5:
-      *byte &= (char) 0x1f;
-      return;
-    case 6:
-      *byte &= (char) 0x3f;
-      return;
-    case 7:
-      *byte &= (char) 0x7f;
-      return;
-    case 8:
-      return;
-    default:
-      assert (0);
-      return;
-    }
+  ios_set_readahead (io, ios_readahead_pages);
 }
 
-inline static void
-ios_mask_last_byte(uint64_t *byte, int significant_bits)
+int
+ios_set_readahead_default (size_t num_pages)
 {
-  switch (significant_bits)
-    {
-    case 1:
-      *byte &= (char) 0x80;
-      return;
-    case 2:
-      *byte &= (char) 0xc0;
-      return;
-    case 3:
-      *byte &= (char) 0xe0;
-      return;
-    case 4:
-      *byte &= (char) 0xf0;
-      return;
-    case 5:
-      *byte &= (char) 0xf8;
-      return;
-    case 6:
-      *byte &= (char) 0xfc;
-      return;
-    case 7:
-      *byte &= (char) 0xfe;
-      return;
-    case 8:
-      return;
-    default:
-      assert (0);
-      return;
-    }
+  if (num_pages > IOS_READAHEAD_MAX_PAGES)
+    return IOS_ERROR;
+
+  ios_readahead_pages = num_pages;
+  ios_map (ios_set_readahead_1, NULL);
+  return IOS_OK;
 }
 
-static inline int
-ios_read_int_common (ios io, ios_off offset, int flags,
-		     int bits,
-		     enum ios_endian endian,
-		     uint64_t *value)
+size_t
+ios_readahead_default (void)
 {
-  /* 64 bits might span at most 9 bytes.  */
-  uint64_t c[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+  return ios_readahead_pages;
+}
 
-  /* Number of signifcant bits in the first byte.  */
-  int firstbyte_bits = 8 - (offset % 8);
+/* Devices building indexes of their contents save them if this is
+   1.  */
 
-  /* (Total number of bytes that need to be read) - 1.  */
-  int bytes_minus1 = (bits - firstbyte_bits + 7) / 8;
+static int ios_save_indexes_p = 0;
 
-  /* Number of significant bits in the last byte.  */
-  int lastbyte_bits = (bits + (offset % 8)) % 8;
-  lastbyte_bits = lastbyte_bits == 0 ? 8 : lastbyte_bits;
+void
+ios_set_save_indexes (int save_p)
+{
+  ios_save_indexes_p = save_p;
+}
 
-  /* Read the first byte and mask the unused bits.  */
-  IOS_GET_C_ERR_CHCK(c[0], io);
-  ios_mask_first_byte(&c[0], firstbyte_bits);
+int
+ios_save_indexes (void)
+{
+  return ios_save_indexes_p;
+}
 
-  switch (bytes_minus1)
-  {
-  case 0:
-    *value = c[0] >> (8 - lastbyte_bits);
-    return IOS_OK;
+int
+ios_dev_save_indexes_p (void)
+{
+  return ios_save_indexes_p;
+}
 
-  case 1:
-    IOS_READ_INTO_CHARRAY_1BYTE(c+1);
-    ios_mask_last_byte(&c[1], lastbyte_bits);
-    if (endian == IOS_ENDIAN_LSB)
-      {
-	if (bits <= 8)
-	  /* We need to shift to align the least significant bit.  */
-	  *value = (c[0] << lastbyte_bits) | (c[1] >> (8 - lastbyte_bits));
-	else if ((offset % 8) == 0)
-	  /* If little endian and the least significant byte is 8 bits aligned,
-	  then we can handle the information byte by byte as we read.  */
-	  *value = (c[1] << lastbyte_bits) | c[0];
-	else
-	  {
-	    /* Consider the order of bits in a little endian number:
-	    7-6-5-4-3-2-1-0-15-14-13-12-11-10-9-8- ... If such an
-	    encoding is not byte-aligned, we have to first shift to fill the
-	    least significant byte to get the right bits in the same bytes.  */
-	    uint64_t reg;
-	    reg = (c[0] << (8 + offset % 8)) | (c[1] << offset % 8);
-	    *value = ((reg & 0xff) << (bits % 8)) | (reg >> 8);
-	  }
-      }
-    else
-      {
-	/* We should shift to fill the least significant byte
-	which is the last 8 bits.  */
-	*value = (c[0] << lastbyte_bits) | (c[1] >> (8 - lastbyte_bits));
-      }
-    return IOS_OK;
+/* Plain paths are opened with direct IO if this is 1.  */
 
-  case 2:
-    IOS_READ_INTO_CHARRAY_2BYTES(c+1);
-    ios_mask_last_byte(&c[2], lastbyte_bits);
-    if (endian == IOS_ENDIAN_LSB)
-      {
-	if ((offset % 8) == 0)
-	  /* If little endian and the least significant byte is 8 bits aligned,
-	  then we can handle the information byte by byte as we read.  */
-	  *value = (c[2] << (8 + lastbyte_bits)) | (c[1] << 8) | c[0];
-	else
-	  {
-	    /* We have to shift to fill the least significant byte to get
-	       the right bits in the same bytes.  */
-	    uint64_t reg;
-	    reg = (c[0] << (56 + offset % 8)) | (c[1] << (48 + offset % 8))
-		  | (c[2] << (40 + offset % 8));
-	    /* The bits in the most-significant-byte-to-be is alligned to left,
-	       shift it towards right! */
-	    if (bits <= 16)
-	      reg = ((reg & 0x00ff000000000000LL) >> (16 - bits))
-		    | (reg & 0xff00ffffffffffffLL);
-	    else
-	      reg = ((reg & 0x0000ff0000000000LL) >> (24 - bits))
-		    | (reg & 0xffff00ffffffffffLL);
-	    /* Now we can place the bytes correctly.  */
-	    *value = __bswap_64(reg);
-	  }
-      }
-    else
-      {
-	/* We should shift to fill the least significant byte
-	which is the last 8 bits.  */
-	*value = (c[0] << (8 + lastbyte_bits)) | (c[1] << lastbyte_bits)
-		 | (c[2] >> (8 - lastbyte_bits));
-      }
-    return IOS_OK;
+static int ios_direct_io_p = 0;
 
-  case 3:
-    IOS_READ_INTO_CHARRAY_3BYTES(c+1);
-    ios_mask_last_byte(&c[3], lastbyte_bits);
-    if (endian == IOS_ENDIAN_LSB)
-      {
-	if ((offset % 8) == 0)
-	  /* If little endian and the least significant byte is 8 bits aligned,
-	  then we can handle the information byte by byte as we read.  */
-	  *value = (c[3] << (16 + lastbyte_bits)) | (c[2] << 16) | (c[1] << 8)
-		   | c[0];
-	else
-	  {
-	    /* We have to shift to fill the least significant byte to get
-	       the right bits in the same bytes.  */
-	    uint64_t reg;
-	    reg = (c[0] << (56 + offset % 8)) | (c[1] << (48 + offset % 8))
-		  | (c[2] << (40 + offset % 8)) | (c[3] << (32 + offset % 8));
-	    /* The bits in the most-significant-byte-to-be is alligned to left,
-	       shift it towards right! */
-	    if (bits <= 24)
-	      reg = ((reg & 0x0000ff0000000000LL) >> (24 - bits))
-		    | (reg & 0xffff00ffffffffffLL);
-	    else
-	      reg = ((reg & 0x000000ff00000000LL) >> (32 - bits))
-		    | (reg & 0xffffff00ffffffffLL);
-	    /* Now we can place the bytes correctly.  */
-	    *value = __bswap_64(reg);
-	  }
-      }
-    else
-      {
-	/* We should shift to fill the least significant byte
-	which is the last 8 bits.  */
-	*value = (c[0] << (16 + lastbyte_bits)) | (c[1] << (8 + lastbyte_bits))
-		 | (c[2] << lastbyte_bits) | (c[3] >> (8 - lastbyte_bits));
-      }
-    return IOS_OK;
+void
+ios_set_direct_io (int direct_p)
+{
+  ios_direct_io_p = direct_p;
+}
 
-  case 4:
-    IOS_READ_INTO_CHARRAY_4BYTES(c+1);
-    ios_mask_last_byte(&c[4], lastbyte_bits);
-    if (endian == IOS_ENDIAN_LSB)
-      {
-	if ((offset % 8) == 0)
-	  /* If little endian and the least significant byte is 8 bits aligned,
-	  then we can handle the information byte by byte as we read.  */
-	  *value = (c[4] << (24 + lastbyte_bits)) | (c[3] << 24) | (c[2] << 16)
-		   | (c[1] << 8) | c[0];
-	else
-	  {
-	    /* We have to shift to fill the least significant byte to get
-	       the right bits in the same bytes.  */
-	    uint64_t reg;
-	    reg = (c[0] << (56 + offset % 8)) | (c[1] << (48 + offset % 8))
-		  | (c[2] << (40 + offset % 8)) | (c[3] << (32 + offset % 8))
-		  | (c[4] << (24 + offset % 8));
-	    /* The bits in the most-significant-byte-to-be is alligned to left,
-	       shift it towards right! */
-	    if (bits <= 32)
-	      reg = ((reg & 0x000000ff00000000LL) >> (32 - bits))
-		    | (reg & 0xffffff00ffffffffLL);
-	    else
-	      reg = ((reg & 0x00000000ff000000LL) >> (40 - bits))
-		    | (reg & 0xffffffff00ffffffLL);
-	    /* Now we can place the bytes correctly.  */
-	    *value = __bswap_64(reg);
-	  }
-      }
-    else
-      {
-	/* We should shift to fill the least significant byte
-	which is the last 8 bits.  */
-	*value = (c[0] << (24 + lastbyte_bits)) | (c[1] << (16 + lastbyte_bits))
-		 | (c[2] << (8 + lastbyte_bits)) | (c[3] << lastbyte_bits)
-		 | (c[4] >> (8 - lastbyte_bits));
-      }
-    return IOS_OK;
+int
+ios_direct_io (void)
+{
+  return ios_direct_io_p;
+}
 
-  case 5:
-    IOS_READ_INTO_CHARRAY_5BYTES(c+1);
-    ios_mask_last_byte(&c[5], lastbyte_bits);
-    if (endian == IOS_ENDIAN_LSB)
-      {
-	if ((offset % 8) == 0)
-	  /* If little endian and the least significant byte is 8 bits aligned,
-	  then we can handle the information byte by byte as we read.  */
-	  *value = (c[5] << (32 + lastbyte_bits)) | (c[4] << 32) | (c[3] << 24)
-		   | (c[2] << 16) | (c[1] << 8) | c[0];
-	else
-	  {
-	    /* We have to shift to fill the least significant byte to get
-	       the right bits in the same bytes.  */
-	    uint64_t reg;
-	    reg = (c[0] << (56 + offset % 8)) | (c[1] << (48 + offset % 8))
-		  | (c[2] << (40 + offset % 8)) | (c[3] << (32 + offset % 8))
-		  | (c[4] << (24 + offset % 8)) | (c[5] << (16 + offset % 8));
-	    /* The bits in the most-significant-byte-to-be is alligned to left,
-	       shift it towards right! */
-	    if (bits <= 40)
-	      reg = ((reg & 0x00000000ff000000LL) >> (40 - bits))
-		    | (reg & 0xffffffff00ffffffLL);
-	    else
-	      reg = ((reg & 0x0000000000ff0000LL) >> (48 - bits))
-		    | (reg & 0xffffffffff00ffffLL);
-	    /* Now we can place the bytes correctly.  */
-	    *value = __bswap_64(reg);
-	  }
-      }
-    else
-      {
-	/* We should shift to fill the least significant byte
-	which is the last 8 bits.  */
-	*value = (c[0] << (32 + lastbyte_bits)) | (c[1] << (24 + lastbyte_bits))
-		 | (c[2] << (16 + lastbyte_bits)) | (c[3] << (8 + lastbyte_bits))
-		 | (c[4] << lastbyte_bits) | (c[5] >> (8 - lastbyte_bits));
-      }
-    return IOS_OK;
+int
+ios_dev_direct_io_p (void)
+{
+  return ios_direct_io_p;
+}
 
-  case 6:
-    IOS_READ_INTO_CHARRAY_6BYTES(c+1);
-    ios_mask_last_byte(&c[6], lastbyte_bits);
-    if (endian == IOS_ENDIAN_LSB)
-      {
-	if ((offset % 8) == 0)
-	  /* If little endian and the least significant byte is 8 bits aligned,
-	  then we can handle the information byte by byte as we read.  */
-	  *value = (c[6] << (40 + lastbyte_bits)) | (c[5] << 40) | (c[4] << 32)
-		   | (c[3] << 24) | (c[2] << 16) | (c[1] << 8) | c[0];
-	else
-	  {
-	    /* We have to shift to fill the least significant byte to get
-	       the right bits in the same bytes.  */
-	    uint64_t reg;
-	    reg = (c[0] << (56 + offset % 8)) | (c[1] << (48 + offset % 8))
-		  | (c[2] << (40 + offset % 8)) | (c[3] << (32 + offset % 8))
-		  | (c[4] << (24 + offset % 8)) | (c[5] << (16 + offset % 8))
-		  | (c[6] << (8 + offset % 8));
-	    /* The bits in the most-significant-byte-to-be is alligned to left,
-	       shift it towards right! */
-	    if (bits <= 48)
-	      reg = ((reg & 0x0000000000ff0000LL) >> (48 - bits))
-		    | (reg & 0xffffffffff00ffffLL);
-	    else
-	      reg = ((reg & 0x000000000000ff00LL) >> (56 - bits))
-		    | (reg & 0xffffffffffff00ffLL);
-	    /* Now we can place the bytes correctly.  */
-	    *value = __bswap_64(reg);
-	  }
-      }
-    else
-      {
-	/* We should shift to fill the least significant byte
-	which is the last 8 bits.  */
-	*value = (c[0] << (40 + lastbyte_bits)) | (c[1] << (32 + lastbyte_bits))
-		 | (c[2] << (24 + lastbyte_bits)) | (c[3] << (16 + lastbyte_bits))
-		 | (c[4] << (8 + lastbyte_bits)) | (c[5] << lastbyte_bits)
-		 | (c[6] >> (8 - lastbyte_bits));
-      }
-    return IOS_OK;
+/* Extract the unsigned integer of size BITS, 1 to 64, located at the
+   bit offset BIT_OFF, 0 to 7, of the buffer BYTES.  BYTES contains
+   all the bytes spanned by the integer followed by zeroes, and it
+   must be at least 9 bytes long.
 
-  case 7:
-    IOS_READ_INTO_CHARRAY_7BYTES(c+1);
-    ios_mask_last_byte(&c[7], lastbyte_bits);
-    if (endian == IOS_ENDIAN_LSB)
-      {
-	if ((offset % 8) == 0)
-	  /* If little endian and the least significant byte is 8 bits aligned,
-	  then we can handle the information byte by byte as we read.  */
-	  *value = (c[7] << (48 + lastbyte_bits)) | (c[6] << 48) | (c[5] << 40)
-		   | (c[4] << 32) | (c[3] << 24) | (c[2] << 16) | (c[1] << 8)
-		   | c[0];
-	else
-	  {
-	    /* We have to shift to fill the least significant byte to get
-	       the right bits in the same bytes.  */
-	    uint64_t reg;
-	    reg = (c[0] << (56 + offset % 8)) | (c[1] << (48 + offset % 8))
-		  | (c[2] << (40 + offset % 8)) | (c[3] << (32 + offset % 8))
-		  | (c[4] << (24 + offset % 8)) | (c[5] << (16 + offset % 8))
-		  | (c[6] << (8 + offset % 8)) | (c[7] << offset % 8);
-	    /* The bits in the most-significant-byte-to-be is alligned to left,
-	       shift it towards right! */
-	    if (bits <= 56)
-	      reg = ((reg & 0x000000000000ff00LL) >> (56 - bits))
-		    | (reg & 0xffffffffffff00ffLL);
-	    else
-	      reg = ((reg & 0x00000000000000ffLL) >> (64 - bits))
-		    | (reg & 0xffffffffffffff00LL);
-	    /* Now we can place the bytes correctly.  */
-	    *value = __bswap_64(reg);
-	  }
-      }
-    else
-      {
-	/* We should shift to fill the least significant byte
-	which is the last 8 bits.  */
-	*value = (c[0] << (48 + lastbyte_bits)) | (c[1] << (40 + lastbyte_bits))
-		 | (c[2] << (32 + lastbyte_bits)) | (c[3] << (24 + lastbyte_bits))
-		 | (c[4] << (16 + lastbyte_bits)) | (c[5] << (8 + lastbyte_bits))
-		 | (c[6] << lastbyte_bits) | (c[7] >> (8 - lastbyte_bits));
-      }
-    return IOS_OK;
+   The first eight bytes are loaded in a single big-endian word, and
+   the ninth byte provides the bits shifted out by the bit offset.
+   This leaves the integer left-aligned in WINDOW regardless of its
+   size and alignment, and it can then be extracted with a fixed
+   sequence of shifts and masks.  */
 
-  case 8:
-    IOS_READ_INTO_CHARRAY_8BYTES(c+1);
-    ios_mask_last_byte(&c[8], lastbyte_bits);
-    if (endian == IOS_ENDIAN_LSB)
-      {
-	/* We have to shift to fill the least significant byte to get
-	   the right bits in the same bytes.  */
-	uint64_t reg;
-	reg = (c[0] << (56 + offset % 8)) | (c[1] << (48 + offset % 8))
-	      | (c[2] << (40 + offset % 8)) | (c[3] << (32 + offset % 8))
-	      | (c[4] << (24 + offset % 8)) | (c[5] << (16 + offset % 8))
-	      | (c[6] << (8 + offset % 8)) | (c[7] << offset % 8)
-	      | (c[8] >> firstbyte_bits);
-	/* The bits in the most-significant-byte-to-be is alligned to left,
-	   shift it towards right! */
-	reg = ((reg & 0x00000000000000ffLL) >> (64 - bits))
-	      | (reg & 0xffffffffffffff00LL);
-	/* Now we can place the bytes correctly.  */
-	*value = __bswap_64(reg);
-      }
-    else
-      {
-	/* We should shift to fill the least significant byte
-	which is the last 8 bits.  */
-	*value = (c[0] << (56 + lastbyte_bits)) | (c[1] << (48 + lastbyte_bits))
-		 | (c[2] << (40 + lastbyte_bits)) | (c[3] << (32 + lastbyte_bits))
-		 | (c[4] << (24 + lastbyte_bits)) | (c[5] << (16 + lastbyte_bits))
-		 | (c[6] << (8 + lastbyte_bits)) | (c[7] << lastbyte_bits)
-		 | (c[8] >> (8 - lastbyte_bits));
-      }
-    return IOS_OK;
+static inline uint64_t
+ios_extract_uint (const uint8_t *bytes, int bit_off, int bits,
+                  enum ios_endian endian)
+{
+  uint64_t window;
 
-  default:
-    assert(0);
-  }
+  memcpy (&window, bytes, sizeof (window));
+#ifndef WORDS_BIGENDIAN
+  window = bswap_64 (window);
+#endif
+  window = (window << bit_off) | ((uint64_t) bytes[8] >> (8 - bit_off));
+
+  if (endian == IOS_ENDIAN_MSB)
+    return window >> (64 - bits);
+  else
+    {
+      /* The integer is composed by the complete bytes in the bit
+         stream, least significant first, followed by the RBITS
+         remaining bits, which are the most significant ones.  Byte
+         swapping the stream puts the complete bytes in place, and
+         leaves the remaining bits at the top of the next byte.  */
+      int kbits = bits / 8 * 8;
+      int rbits = bits % 8;
+
+      window = bswap_64 ((window >> (64 - bits)) << (64 - bits));
+      if (rbits != 0)
+        window = (window & ((UINT64_C (1) << kbits) - 1))
+                 | ((window >> (8 - rbits)) & (~UINT64_C (0) << kbits));
+      return window;
+    }
 }
 
 int
@@ -695,127 +2999,20 @@ ios_read_int (ios io, ios_off offset, int flags,
               enum ios_nenc nenc,
               int64_t *value)
 {
-  /* We always need to start reading from offset / 8  */
-  if (io->dev_if->seek (io->dev, offset / 8, IOD_SEEK_SET) == -1)
-    return IOS_EIOFF;
-
-  /* Fast track for byte-aligned 8x bits  */
-  if (offset % 8 == 0 && bits % 8 == 0)
-    {
-      switch (bits) {
-      case 8:
-	{
-	  int8_t c[1] = {0};
-	  IOS_READ_INTO_CHARRAY_1BYTE(c);
-	  *value = c[0];
-	  return IOS_OK;
-	}
-
-      case 16:
-	{
-	  int16_t c[2] = {0, 0};
-	  IOS_READ_INTO_CHARRAY_2BYTES(c);
-	  if (endian == IOS_ENDIAN_LSB)
-	    *value = (c[1] << 8) | c[0];
-	  else
-	    *value = (c[0] << 8) | c[1];
-	  return IOS_OK;
-	}
-
-      case 24:
-	{
-	  int64_t c[3] = {0, 0, 0};
-	  IOS_READ_INTO_CHARRAY_3BYTES(c);
-	  if (endian == IOS_ENDIAN_LSB)
-	    *value = (c[2] << 16) | (c[1] << 8) | c[0];
-	  else
-	    *value = (c[0] << 16) | (c[1] << 8) | c[2];
-	  *value <<= 40;
-	  *value >>= 40;
-	  return IOS_OK;
-	}
-
-      case 32:
-        {
-	  int32_t c[4] = {0, 0, 0, 0};
-	  IOS_READ_INTO_CHARRAY_4BYTES(c);
-	  if (endian == IOS_ENDIAN_LSB)
-	    *value = (c[3] << 24) | (c[2] << 16) | (c[1] << 8) | c[0];
-	  else
-	    *value = (c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
-	  return IOS_OK;
-	}
-
-      case 40:
-        {
-	  int64_t c[5] = {0, 0, 0, 0, 0};
-	  IOS_READ_INTO_CHARRAY_5BYTES(c);
-	  if (endian == IOS_ENDIAN_LSB)
-	    *value = (c[4] << 32) | (c[3] << 24) | (c[2] << 16) | (c[1] << 8)
-		     | c[0];
-	  else
-	    *value = (c[0] << 32) | (c[1] << 24) | (c[2] << 16) | (c[3] << 8)
-		     | c[4];
-	  *value <<= 24;
-	  *value >>= 24;
-	  return IOS_OK;
-	}
-
-      case 48:
-	{
-	  int64_t c[6] = {0, 0, 0, 0, 0, 0};
-	  IOS_READ_INTO_CHARRAY_6BYTES(c);
-	  if (endian == IOS_ENDIAN_LSB)
-	    *value = (c[5] << 40) | (c[4] << 32) | (c[3] << 24) | (c[2] << 16)
-		     | (c[1] << 8) | c[0];
-	  else
-	    *value = (c[0] << 40) | (c[1] << 32) | (c[2] << 24) | (c[3] << 16)
-		     | (c[4] << 8) | c[5];
-	  *value <<= 16;
-	  *value >>= 16;
-	  return IOS_OK;
-	}
-
-      case 56:
-	{
-	  int64_t c[7] = {0, 0, 0, 0, 0, 0, 0};
-	  IOS_READ_INTO_CHARRAY_7BYTES(c);
-	  if (endian == IOS_ENDIAN_LSB)
-	    *value = (c[6] << 48) | (c[5] << 40) | (c[4] << 32) | (c[3] << 24)
-		     | (c[2] << 16) | (c[1] << 8) | c[0];
-	  else
-	    *value = (c[0] << 48) | (c[1] << 40) | (c[2] << 32) | (c[3] << 24)
-		     | (c[4] << 16) | (c[5] << 8) | c[6];
-	  *value <<= 8;
-	  *value >>= 8;
-	  return IOS_OK;
-	}
-
-      case 64:
-	{
-	  int64_t c[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-	  IOS_READ_INTO_CHARRAY_8BYTES(c);
-	  if (endian == IOS_ENDIAN_LSB)
-	    *value = (c[7] << 56) | (c[6] << 48) | (c[5] << 40) | (c[4] << 32)
-		     | (c[3] << 24) | (c[2] << 16) | (c[1] << 8) | c[0];
-	  else
-	    *value = (c[0] << 56) | (c[1] << 48) | (c[2] << 40) | (c[3] << 32)
-		     | (c[4] << 24) | (c[5] << 16) | (c[6] << 8) | c[7];
-	  return IOS_OK;
-	}
-      }
-    }
-
-  /* Fall into the case for the unaligned and the sizes other than 8k.  */
-  int ret_val = ios_read_int_common(io, offset, flags, bits, endian,
-				    (uint64_t *) value);
-  if (ret_val == IOS_OK)
-    {
-      *value <<= 64 - bits;
-      *value >>= 64 - bits;
-      return IOS_OK;
-    }
-  return ret_val;
+  uint64_t uvalue;
+  int ret;
+
+  ret = ios_read_uint (io, offset, flags, bits, endian, &uvalue);
+  if (ret != IOS_OK)
+    return ret;
+
+  /* Sign-extend the integer.  In one's complement the negative
+     numbers are one less than their two's complement
+     counterparts.  */
+  *value = (int64_t) (uvalue << (64 - bits)) >> (64 - bits);
+  if (nenc == IOS_NENC_1 && *value < 0)
+    *value += 1;
+  return IOS_OK;
 }
 
 int
@@ -824,217 +3021,237 @@ ios_read_uint (ios io, ios_off offset, int flags,
                enum ios_endian endian,
                uint64_t *value)
 {
-  /* When aligned, 1 to 64 bits can span at most 8 bytes.  */
-  uint64_t c[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  /* 64 bits might span at most 9 bytes.  */
+  uint8_t bytes[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+  int ret;
 
-  /* We always need to start reading from offset / 8  */
-  if (io->dev_if->seek (io->dev, offset / 8, IOD_SEEK_SET) == -1)
+  if (offset < 0)
     return IOS_EIOFF;
 
-  /* Fast track for byte-aligned 8x bits  */
-  if (offset % 8 == 0 && bits % 8 == 0)
-    {
-      switch (bits) {
-      case 8:
-	IOS_READ_INTO_CHARRAY_1BYTE(c);
-	*value = c[0];
-	return IOS_OK;
-
-      case 16:
-	IOS_READ_INTO_CHARRAY_2BYTES(c);
-	if (endian == IOS_ENDIAN_LSB)
-	  *value = (c[1] << 8) | c[0];
-	else
-	  *value = (c[0] << 8) | c[1];
-	return IOS_OK;
-
-      case 24:
-	IOS_READ_INTO_CHARRAY_3BYTES(c);
-	if (endian == IOS_ENDIAN_LSB)
-	  *value = (c[2] << 16) | (c[1] << 8) | c[0];
-	else
-	  *value = (c[0] << 16) | (c[1] << 8) | c[2];
-	return IOS_OK;
-
-      case 32:
-	IOS_READ_INTO_CHARRAY_4BYTES(c);
-	if (endian == IOS_ENDIAN_LSB)
-	  *value = (c[3] << 24) | (c[2] << 16) | (c[1] << 8) | c[0];
-	else
-	  *value = (c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
-	return IOS_OK;
-
-      case 40:
-	IOS_READ_INTO_CHARRAY_5BYTES(c);
-	if (endian == IOS_ENDIAN_LSB)
-	  *value = (c[4] << 32) | (c[3] << 24) | (c[2] << 16) | (c[1] << 8)
-		   | c[0];
-	else
-	  *value = (c[0] << 32) | (c[1] << 24) | (c[2] << 16) | (c[3] << 8)
-		   | c[4];
-	return IOS_OK;
-
-      case 48:
-	IOS_READ_INTO_CHARRAY_6BYTES(c);
-	if (endian == IOS_ENDIAN_LSB)
-	  *value = (c[5] << 40) | (c[4] << 32) | (c[3] << 24) | (c[2] << 16)
-		   | (c[1] << 8) | c[0];
-	else
-	  *value = (c[0] << 40) | (c[1] << 32) | (c[2] << 24) | (c[3] << 16)
-		   | (c[4] << 8) | c[5];
-	return IOS_OK;
-
-      case 56:
-	IOS_READ_INTO_CHARRAY_7BYTES(c);
-	if (endian == IOS_ENDIAN_LSB)
-	  *value = (c[6] << 48) | (c[5] << 40) | (c[4] << 32) | (c[3] << 24)
-		   | (c[2] << 16) | (c[1] << 8) | c[0];
-	else
-	  *value = (c[0] << 48) | (c[1] << 40) | (c[2] << 32) | (c[3] << 24)
-		   | (c[4] << 16) | (c[5] << 8) | c[6];
-	return IOS_OK;
-
-      case 64:
-	IOS_READ_INTO_CHARRAY_8BYTES(c);
-	if (endian == IOS_ENDIAN_LSB)
-	  *value = (c[7] << 56) | (c[6] << 48) | (c[5] << 40) | (c[4] << 32)
-		   | (c[3] << 24) | (c[2] << 16) | (c[1] << 8) | c[0];
-	else
-	  *value = (c[0] << 56) | (c[1] << 48) | (c[2] << 40) | (c[3] << 32)
-		   | (c[4] << 24) | (c[5] << 16) | (c[6] << 8) | c[7];
-	return IOS_OK;
-      }
-    }
-
-  /* Fall into the case for the unaligned and the sizes other than 8k.  */
-  return ios_read_int_common (io, offset, flags, bits, endian, value);
+  /* Read all the bytes spanned by the integer at once.  */
+  ret = ios_read_raw (io, flags, offset / 8, bytes,
+                      (offset % 8 + bits + 7) / 8);
+  if (ret != IOS_OK)
+    return ret;
+
+  *value = ios_extract_uint (bytes, offset % 8, bits, endian);
+  return IOS_OK;
 }
 
+/* Size of the buffer used to read arrays of integers.  */
+
+#define IOS_ARRAY_BUF_SIZE 4096
+
+/* Put in VALUES the COUNT integers of SIZE bytes in BUF, byte swapped
+   if SWAP_P.  The loops are simple enough for the compiler to
+   vectorize them.  */
+
+#define IOS_WIDEN_ARRAY(TYPE,BSWAP)                                     \
+  do                                                                    \
+    {                                                                   \
+      TYPE v;                                                           \
+                                                                        \
+      if (swap_p)                                                       \
+        for (i = 0; i < n; ++i)                                         \
+          {                                                             \
+            memcpy (&v, buf + i * sizeof (TYPE), sizeof (TYPE));        \
+            values[i] = BSWAP (v);                                      \
+          }                                                             \
+      else                                                              \
+        for (i = 0; i < n; ++i)                                         \
+          {                                                             \
+            memcpy (&v, buf + i * sizeof (TYPE), sizeof (TYPE));        \
+            values[i] = v;                                              \
+          }                                                             \
+    }                                                                   \
+  while (0)
+
 int
-ios_read_string (ios io, ios_off offset, int flags, char **value)
+ios_read_uint_array (ios io, ios_off offset, int flags,
+                     int bits,
+                     enum ios_endian endian,
+                     size_t count,
+                     uint64_t *values)
 {
-  char *str = NULL;
-  size_t i = 0;
-  int c;
-
-  if (io->dev_if->seek (io->dev, offset / 8, IOD_SEEK_SET)
-      == -1)
+  uint8_t buf[IOS_ARRAY_BUF_SIZE];
+  size_t size = bits / 8;
+  size_t max = IOS_ARRAY_BUF_SIZE / (size > 0 ? size : 1);
+  size_t i, n;
+  int ret;
+#ifdef WORDS_BIGENDIAN
+  int swap_p = (endian == IOS_ENDIAN_LSB);
+#else
+  int swap_p = (endian == IOS_ENDIAN_MSB);
+#endif
+
+  if (offset < 0)
     return IOS_EIOFF;
 
-  do
+  /* Integers that are not byte-aligned, or whose size is not a power
+     of two, are read one by one.  */
+  if (offset % 8 != 0
+      || (bits != 8 && bits != 16 && bits != 32 && bits != 64))
     {
-      if (i % 128 == 0)
-        str = xrealloc (str, i + 128 * sizeof (char));
+      for (i = 0; i < count; ++i)
+        {
+          ret = ios_read_uint (io, offset + i * bits, flags, bits, endian,
+                               &values[i]);
+          if (ret != IOS_OK)
+            return ret;
+        }
+      return IOS_OK;
+    }
 
-      c = io->dev_if->get_c (io->dev);
-      if (c == IOD_EOF)
-        str[i] = '\0';
-      else
-        str[i] = (char) c;
+  /* Otherwise read as many integers as fit in the buffer at once, and
+     convert them to host integers.  */
+  while (count > 0)
+    {
+      n = count < max ? count : max;
+      ret = ios_read_raw (io, flags, offset / 8, buf, n * size);
+      if (ret != IOS_OK)
+        return ret;
+
+      switch (bits)
+        {
+        case 8:
+          for (i = 0; i < n; ++i)
+            values[i] = buf[i];
+          break;
+        case 16: IOS_WIDEN_ARRAY (uint16_t, bswap_16); break;
+        case 32: IOS_WIDEN_ARRAY (uint32_t, bswap_32); break;
+        case 64: IOS_WIDEN_ARRAY (uint64_t, bswap_64); break;
+        default:
+          assert (0);
+        }
+
+      offset += n * bits;
+      values += n;
+      count -= n;
     }
-  while (str[i++] != '\0');
 
-  *value = str;
   return IOS_OK;
 }
 
 int
-ios_write_int (ios io, ios_off offset, int flags,
-               int bits,
-               enum ios_endian endian,
-               enum ios_nenc nenc,
-               int64_t value)
+ios_read_int_array (ios io, ios_off offset, int flags,
+                    int bits,
+                    enum ios_endian endian,
+                    enum ios_nenc nenc,
+                    size_t count,
+                    int64_t *values)
 {
-  if (offset % 8 == 0)
+  size_t i;
+  int ret;
+
+  ret = ios_read_uint_array (io, offset, flags, bits, endian, count,
+                             (uint64_t *) values);
+  if (ret != IOS_OK)
+    return ret;
+
+  /* Sign-extend the integers, like in ios_read_int.  */
+  for (i = 0; i < count; ++i)
     {
-      if (io->dev_if->seek (io->dev, offset / 8, IOD_SEEK_SET)
-          == -1)
-        return IOS_EIOFF;
+      uint64_t uvalue = values[i];
 
-      switch (bits)
-        {
-        case 32:
-          {
-            int32_t c1, c2, c3, c4;
+      values[i] = (int64_t) (uvalue << (64 - bits)) >> (64 - bits);
+      if (nenc == IOS_NENC_1 && values[i] < 0)
+        values[i] += 1;
+    }
+  return IOS_OK;
+}
 
-            c1 = (value >> 24) & 0xff;
-            c2 = (value >> 16) & 0xff;
-            c3 = (value >> 8) & 0xff;
-            c4 = value & 0xff;
+int
+ios_read_string (ios io, ios_off offset, int flags, size_t max_len,
+                 char **value)
+{
+  ios_dev_off dev_off = offset / 8;
+  size_t len;
+  char *str;
+  int ret;
+
+  /* Find the end of the string first, so it can be read with a
+     single allocation.  */
+  ret = ios_string_length (io, flags, dev_off, max_len, &len);
+  if (ret != IOS_OK)
+    return ret;
+
+  str = xmalloc (len + 1);
+  if (len > 0
+      && (ret = ios_read_raw (io, flags, dev_off, str, len)) != IOS_OK)
+    {
+      free (str);
+      return ret;
+    }
+  str[len] = '\0';
 
-            if (io->dev_if->put_c (io->dev, c1)
-                == IOD_EOF)
-              return IOS_EIOFF;
+  *value = str;
+  return IOS_OK;
+}
 
-            if (io->dev_if->put_c (io->dev, c2)
-                == IOD_EOF)
-              return IOS_EIOFF;
+/* Deposit the unsigned integer VALUE of size BITS, 1 to 64, at the
+   bit offset BIT_OFF, 0 to 7, of the buffer BYTES, preserving the
+   rest of the bits in the buffer.  BYTES must be at least 9 bytes
+   long.  This is the inverse of ios_extract_uint.  */
 
-            if (io->dev_if->put_c (io->dev, c3)
-                == IOD_EOF)
-              return IOS_EIOFF;
+static inline void
+ios_deposit_uint (uint8_t *bytes, int bit_off, int bits,
+                  enum ios_endian endian, uint64_t value)
+{
+  uint64_t field_mask = ~UINT64_C (0) << (64 - bits);
+  uint64_t low_mask = (UINT64_C (1) << bit_off) - 1;
+  uint64_t field, window;
 
-            if (io->dev_if->put_c (io->dev, c4)
-                == IOD_EOF)
-              return IOS_EIOFF;
+  if (bits < 64)
+    value &= (UINT64_C (1) << bits) - 1;
 
-            break;
-          }
-        case 64:
-          {
-            int32_t c1, c2, c3, c4, c5, c6, c7, c8;
-
-            c1 = (value >> 56) & 0xff;
-            c2 = (value >> 48) & 0xff;
-            c3 = (value >> 40) & 0xff;
-            c4 = (value >> 32) & 0xff;
-            c5 = (value >> 24) & 0xff;
-            c6 = (value >> 16) & 0xff;
-            c7 = (value >> 8) & 0xff;
-            c8 = value & 0xff;
-
-            if (io->dev_if->put_c (io->dev, c1)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c2)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c3)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c4)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c5)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c6)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c7)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c8)
-                == IOD_EOF)
-              return IOS_EIOFF;
-            break;
-          }
-        default:
-          assert (0);
-          break;
-        }
-    }
+  /* Build the bit stream of the integer, left-aligned in FIELD.  */
+  if (endian == IOS_ENDIAN_MSB)
+    field = value << (64 - bits);
   else
-    assert (0);
+    {
+      /* The complete bytes go least significant first, followed by
+         the RBITS most significant bits of the value.  See
+         ios_extract_uint.  */
+      int kbits = bits / 8 * 8;
+      int rbits = bits % 8;
+
+      if (rbits != 0)
+        value = (value & ((UINT64_C (1) << kbits) - 1))
+                | ((value >> kbits) << (kbits + 8 - rbits));
+      field = bswap_64 (value);
+    }
 
-  return IOS_OK;
+  /* Merge the stream in the window, shifting it by the bit offset.
+     The bits shifted out go to the top of the ninth byte.  */
+  memcpy (&window, bytes, sizeof (window));
+#ifndef WORDS_BIGENDIAN
+  window = bswap_64 (window);
+#endif
+  window = (window & ~(field_mask >> bit_off)) | (field >> bit_off);
+#ifndef WORDS_BIGENDIAN
+  window = bswap_64 (window);
+#endif
+  memcpy (bytes, &window, sizeof (window));
+
+  bytes[8] = (bytes[8] & ~((field_mask & low_mask) << (8 - bit_off)))
+             | ((field & low_mask) << (8 - bit_off));
+}
+
+int
+ios_write_int (ios io, ios_off offset, int flags,
+               int bits,
+               enum ios_endian endian,
+               enum ios_nenc nenc,
+               int64_t value)
+{
+  uint64_t uvalue = (uint64_t) value;
+
+  /* In one's complement the negative numbers are one less than their
+     two's complement counterparts.  */
+  if (nenc == IOS_NENC_1 && value < 0)
+    uvalue -= 1;
+
+  return ios_write_uint (io, offset, flags, bits, endian, uvalue);
 }
 
 int
@@ -1043,111 +3260,75 @@ ios_write_uint (ios io, ios_off offset, int flags,
                 enum ios_endian endian,
                 uint64_t value)
 {
-  /* XXX: writeme.  */
+  /* 64 bits might span at most 9 bytes.  */
+  uint8_t bytes[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+  int nbytes = (offset % 8 + bits + 7) / 8;
+  int ret;
 
+  if (offset < 0)
+    return IOS_EIOFF;
 
-  if (offset % 8 == 0)
+  /* If the integer doesn't cover its first and last bytes completely,
+     the bits surrounding it must be preserved.  The bytes past the end
+     of the IO space have no bits to preserve, and are taken as zeroes
+     so integers can still be written there.  */
+  if (offset % 8 != 0 || bits % 8 != 0)
     {
-      if (io->dev_if->seek (io->dev, offset / 8, IOD_SEEK_SET)
-          == -1)
-        return IOS_EIOFF;
-
-      switch (bits)
+      ret = ios_read_raw (io, flags, offset / 8, bytes, nbytes);
+      if (ret == IOS_EIOFF)
         {
-        case 8:
-          if (io->dev_if->put_c (io->dev, (int) value)
-              == IOD_EOF)
-            return IOS_EIOBJ;
-          break;
-        case 32:
-          {
-            int32_t c1, c2, c3, c4;
-
-            c1 = (value >> 24) & 0xff;
-            c2 = (value >> 16) & 0xff;
-            c3 = (value >> 8) & 0xff;
-            c4 = value & 0xff;
-
-            if (io->dev_if->put_c (io->dev, c1)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c2)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c3)
-                == IOD_EOF)
-              return IOS_EIOFF;
+          int i;
 
-            if (io->dev_if->put_c (io->dev, c4)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            break;
-          }
-        case 64:
-          {
-            int32_t c1, c2, c3, c4, c5, c6, c7, c8;
-
-            c1 = (value >> 56) & 0xff;
-            c2 = (value >> 48) & 0xff;
-            c3 = (value >> 40) & 0xff;
-            c4 = (value >> 32) & 0xff;
-            c5 = (value >> 24) & 0xff;
-            c6 = (value >> 16) & 0xff;
-            c7 = (value >> 8) & 0xff;
-            c8 = value & 0xff;
-
-            if (io->dev_if->put_c (io->dev, c1)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c2)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c3)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c4)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c5)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c6)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c7)
-                == IOD_EOF)
-              return IOS_EIOFF;
-
-            if (io->dev_if->put_c (io->dev, c8)
-                == IOD_EOF)
-              return IOS_EIOFF;
-            break;
-          }
-        default:
-          assert (0);
-          break;
+          memset (bytes, 0, sizeof bytes);
+          for (i = 0; i < nbytes; i++)
+            if (ios_read_raw (io, flags, offset / 8 + i, bytes + i, 1)
+                != IOS_OK)
+              break;
         }
+      else if (ret != IOS_OK)
+        return ret;
     }
-  else
-    assert (0);
-
 
-  return IOS_OK;
+  ios_deposit_uint (bytes, offset % 8, bits, endian, value);
+  return ios_write_raw (io, flags, offset / 8, bytes, nbytes);
 }
 
 int
 ios_write_string (ios io, ios_off offset, int flags,
                   const char *value)
 {
-  /* XXX: writeme.  */
-  return IOS_OK;
+  size_t len;
+
+  if (offset < 0)
+    return IOS_EIOFF;
+
+  /* Note that the terminating NULL byte is also written.  */
+  len = strlen (value) + 1;
+
+  if (offset % 8 != 0)
+    {
+      /* Unaligned strings are written as a stream of big-endian
+         integers of up to 64 bits, which preserves the bits
+         surrounding them.  */
+      size_t i, j;
+      int ret;
+
+      for (i = 0; i < len; i += 8)
+        {
+          size_t n = len - i < 8 ? len - i : 8;
+          uint64_t word = 0;
+
+          for (j = 0; j < n; j++)
+            word = (word << 8) | (uint8_t) value[i + j];
+
+          ret = ios_write_uint (io, offset + i * 8, flags, n * 8,
+                                IOS_ENDIAN_MSB, word);
+          if (ret != IOS_OK)
+            return ret;
+        }
+
+      return IOS_OK;
+    }
+
+  return ios_write_raw (io, flags, offset / 8, value, len);
 }
@@ -20,6 +20,7 @@
 #define IOS_H
 
 #include <config.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* The following two functions intialize and shutdown the IO poke
@@ -108,15 +109,32 @@ typedef int64_t ios_off;
 
 /* Open an IO space using a handler and make it the current space.
    Return IOS_ERROR if there is an error opening the space (such as an
-   unrecognized handler), IOS_OK otherwise.  */
+   unrecognized handler), IOS_OK otherwise.
+
+   A handler of the form slice://START+SIZE/HANDLER opens a "slice",
+   i.e. a window of SIZE bytes starting at the byte offset START of
+   the open IO space operating HANDLER.  Offset 0 in the slice is
+   START in that space.  Slices can't grow, and they share the cache,
+   transactions and journal of the space they are a window of.
+   Closing a space also closes its slices.  */
 
 int ios_open (const char *handler);
 
 /* Close the given IO space, freing all used resources and flushing
-   the space cache associated with the space.  */
+   the space cache associated with the space.  Transactions still in
+   progress in the space are rolled back.  If the space is the current
+   one, the most recently opened space becomes the current space.  */
 
 void ios_close (ios io);
 
+/* Set a function to be called by ios_close right before an IO space
+   is closed, while its contents can still be read.  This lets the
+   users of the space copy whatever they still need from it.  The
+   function is not called for the spaces closed by ios_shutdown.  */
+
+typedef void (*ios_close_fn) (ios io);
+void ios_set_close_hook (ios_close_fn fn);
+
 /* Depending on the underlying IOD, an IO space may allow several
    operations but not others.  For example, a read-only file won't
    allow being written to.  In order to reflect this, every IO space
@@ -139,6 +157,13 @@ ios_off ios_tell (ios io);
 
 const char *ios_handler (ios io);
 
+/* Write the whole contents of the IO space IO to the file FILENAME,
+   creating the file if it doesn't exist and truncating it if it
+   exists.  Return IOS_ERROR if the file can't be written, IOS_OK
+   otherwise.  */
+
+int ios_save (ios io, const char *filename);
+
 /* Return the current IO space, or NULL if there are no open
    spaces.  */
 
@@ -153,12 +178,20 @@ void ios_set_cur (ios io);
 
 ios ios_search (const char *handler);
 
-/* Return the Nth IO space.  If N is negative or bigger than the
-   number of IO spaces which are currently opened, return NULL.  */
+/* Return the IO space whose identifier is ID.  If no such space is
+   currently opened, return NULL.  */
+
+ios ios_get (int id);
 
-ios ios_get (int n);
+/* Return the identifier of the IO space IO.  Identifiers are
+   assigned in increasing order when the spaces are opened, starting
+   from 0, and are not reused.  */
 
-/* Map over all the open IO spaces executing a handler.  */
+int ios_get_id (ios io);
+
+/* Map over all the open IO spaces executing a handler.  The spaces
+   are visited in the order in which they were opened, i.e. in
+   increasing order of identifier.  */
 
 typedef void (*ios_map_fn) (ios io, void *data);
 void ios_map (ios_map_fn cb, void *data);
@@ -232,11 +265,41 @@ int ios_read_uint (ios io, ios_off offset, int flags,
                    enum ios_endian endian,
                    uint64_t *value);
 
+/* Read the COUNT unsigned integers of size BITS stored one after the
+   other starting at the given OFFSET, and put their values in VALUES.
+   It is assumed the integers are encoded using the ENDIAN byte
+   endianness.  Byte-aligned integers of 8, 16, 32 or 64 bits are read
+   in bulk, which is much faster than reading them one by one.  */
+
+int ios_read_uint_array (ios io, ios_off offset, int flags,
+                         int bits,
+                         enum ios_endian endian,
+                         size_t count,
+                         uint64_t *values);
+
+/* Likewise for signed integers encoded using the NENC negative
+   encoding.  */
+
+int ios_read_int_array (ios io, ios_off offset, int flags,
+                        int bits,
+                        enum ios_endian endian,
+                        enum ios_nenc nenc,
+                        size_t count,
+                        int64_t *values);
+
 /* Read a NULL-terminated string of bytes located at the given OFFSET,
    and put its value in VALUE.  It is up to the caller to free the
-   memory occupied by the returned string, when no longer needed.  */
+   memory occupied by the returned string, when no longer needed.
+
+   The end of the underlying IO device also terminates the string.  If
+   MAX_LEN is not zero, it is the maximum length of the string, not
+   counting the terminating NULL byte.  IOS_EIOBJ is returned if no
+   NULL byte is found within that length.  The strings mapped by Poke
+   programs are unbounded, so the PVM always passes zero; MAX_LEN is
+   meant for the other users of this library.  */
 
-int ios_read_string (ios io, ios_off offset, int flags, char **value);
+int ios_read_string (ios io, ios_off offset, int flags, size_t max_len,
+                     char **value);
 
 /* Write the signed integer of size BITS in VALUE to the space IO, at
    the given OFFSET.  Use the byte endianness ENDIAN and encoding NENC
@@ -258,20 +321,295 @@ int ios_write_uint (ios io, ios_off offset, int flags,
                     uint64_t value);
 
 /* Write the NULL-terminated string in VALUE to the space IO, at the
-   given OFFSET.  */
+   given OFFSET, including the terminating NULL byte.  OFFSET doesn't
+   need to be byte-aligned, in which case the bits surrounding the
+   string are preserved.  */
 
 int ios_write_string (ios io, ios_off offset, int flags,
                       const char *value);
 
-/* **************** Update API **************** */
+/* **************** Cache API ****************
+
+   Every IO space caches the contents of its underlying IO device in a
+   set of fixed-size pages.  When a page is needed and the cache is
+   full, the least recently used page is evicted.
+
+   The read/write API above goes through the cache unless the
+   IOS_F_BYPASS_CACHE flag is passed.  Writes are buffered in the
+   cache, and they are written back to the IO device when the space
+   is flushed or closed, or when more than half of the pages of the
+   cache contain pending writes.  Runs of contiguous pending writes
+   are written back with a single operation.
+
+   When the pages of the cache are missed in ascending order, the IO
+   device is asked to prefetch the pages that follow, so reading
+   sequentially through an IO space doesn't wait for every page.  */
+
+/* The cache of an IO space can't have more than IOS_CACHE_MAX_PAGES
+   pages, nor hold more than IOS_CACHE_MAX_SIZE bytes.  */
+
+#define IOS_CACHE_MAX_PAGES ((size_t) 1 << 20)
+#define IOS_CACHE_MAX_SIZE ((size_t) 1 << 30)
+
+/* Set the geometry of the cache of the IO space IO.  PAGE_SIZE is the
+   size of every page, in bytes, and must be a power of two.
+   NUM_PAGES is the maximum number of pages the cache can hold.  Any
+   page currently in the cache is flushed and dropped, and the values
+   mapped from IO are considered stale, so they are read again.  Return
+   IOS_ERROR if the provided geometry is not valid or the cache can't
+   be flushed, IOS_OK otherwise.  Slices use the cache of their parent,
+   so setting theirs has no effect.  */
+
+int ios_set_cache (ios io, size_t page_size, size_t num_pages);
+
+/* Set the geometry of the caches of the IO spaces opened from now on,
+   and also of all the currently open IO spaces.  Return IOS_ERROR if
+   the provided geometry is not valid or the caches of the open IO
+   spaces can't be flushed, in which case nothing is changed.  Return
+   IOS_OK otherwise.  */
+
+int ios_set_cache_default (size_t page_size, size_t num_pages);
+
+/* Get the geometry set by ios_set_cache_default.  */
+
+void ios_cache_default (size_t *page_size, size_t *num_pages);
+
+/* The readahead window of an IO space can't have more than
+   IOS_READAHEAD_MAX_PAGES pages.  */
+
+#define IOS_READAHEAD_MAX_PAGES IOS_CACHE_MAX_PAGES
+
+/* Set the size of the readahead window of the IO space IO, in pages.
+   Zero disables readahead.  Return IOS_ERROR if NUM_PAGES is too big,
+   IOS_OK otherwise.  */
+
+int ios_set_readahead (ios io, size_t num_pages);
+
+/* Set the size of the readahead windows of the IO spaces opened from
+   now on, and also of all the currently open IO spaces.  Return
+   IOS_ERROR if NUM_PAGES is too big, IOS_OK otherwise.  */
+
+int ios_set_readahead_default (size_t num_pages);
+
+/* Get the size set by ios_set_readahead_default.  */
+
+size_t ios_readahead_default (void);
+
+/* Set whether the IO devices building indexes of their contents, like
+   the compressed file devices, save them in order to reuse them the
+   next time the same file is opened.  This is disabled by
+   default.  */
+
+void ios_set_save_indexes (int save_p);
+
+/* Get the value set by ios_set_save_indexes.  */
+
+int ios_save_indexes (void);
+
+/* Set whether the files opened from now on given plain paths, like
+   block devices, are accessed with direct IO, bypassing the buffers of
+   the operating system.  This is disabled by default.  */
+
+void ios_set_direct_io (int direct_p);
+
+/* Get the value set by ios_set_direct_io.  */
+
+int ios_direct_io (void);
+
+/* Tell the IO space IO that the SIZE bits starting at the bit offset
+   OFFSET are going to be read soon, like when mapping an array whose
+   size is known beforehand.  Depending on the IO device, the bytes
+   are read into the cache at once, or the device is asked to start
+   fetching them.  */
+
+void ios_prefetch (ios io, ios_off offset, ios_off size);
+
+/* Write back to the IO device all the pending writes buffered in the
+   cache of the IO space IO.  Return IOS_ERROR if some of the writes
+   failed, IOS_OK otherwise.  */
+
+int ios_flush (ios io);
+
+/* Some IO devices, like sparse files, have holes: ranges of bytes
+   which are not stored, and read as zeroes.  Reading the pages of an
+   IO space that are entirely in a hole doesn't access the device.
+
+   ios_next_data puts in DATA the bit offset of the first byte at or
+   after the bit offset OFFSET in IO that is not in a hole, or the end
+   of IO if there are only holes after OFFSET.  Spaces without holes
+   get OFFSET itself.  Return IOS_EIOFF if OFFSET is past the end of
+   IO, IOS_OK otherwise.
+
+   ios_next_hole puts in HOLE the bit offset of the first byte at or
+   after OFFSET that is in a hole.  Return IOS_EIOFF if there are no
+   holes after OFFSET, IOS_OK otherwise.  */
+
+int ios_next_data (ios io, ios_off offset, ios_off *data);
+int ios_next_hole (ios io, ios_off offset, ios_off *hole);
+
+/* **************** Update API ****************
+
+   The values mapped from an IO space, like the arrays and structs of
+   Poke programs, keep a copy of the bytes they were read from.  In
+   order to tell whether such a copy is still up to date, every IO
+   space keeps an index of the ranges covered by the values mapped
+   from it.  Writing to the space marks the values overlapping the
+   written bytes as stale, unless the write is performed with
+   IOS_F_BYPASS_UPDATE.
+
+   The index has a limited size.  When it is full, the value that was
+   registered the longest ago is marked as stale to make room for the
+   new one.  */
+
+/* Register a value mapped from the IO space IO, covering the SIZE
+   bits starting at the bit offset OFFSET, and return an identifier
+   for it.  If SIZE is negative, the value depends on all the bytes
+   following OFFSET, like arrays mapped until the end of IO.  ENDIAN
+   and NENC are the endianness and negative encoding used by default
+   when mapping the value.
+
+   Return 0 if IO doesn't keep track of the values mapped from it,
+   because its contents may change on their own.  Such values are never
+   up to date.  */
+
+uint64_t ios_update_register (ios io, ios_off offset, ios_off size,
+                              enum ios_endian endian,
+                              enum ios_nenc nenc);
+
+/* Return 1 if the value mapped from the IO space IO identified by ID
+   is up to date, 0 if it is stale.  A value is also stale if ENDIAN
+   or NENC are not the ones it was registered with, since mapping it
+   again with them may give a different value.  */
+
+int ios_update_fresh_p (ios io, uint64_t id,
+                        enum ios_endian endian, enum ios_nenc nenc);
+
+/* **************** Transaction API ****************
+
+   A transaction groups a sequence of writes performed in an IO space,
+   so they can be either committed or undone as a whole.  While a
+   transaction is in progress, the original contents of every range
+   written in the space are saved in an undo log.
+
+   Transactions can be nested.  Committing an inner transaction makes
+   its writes part of the enclosing transaction, so they are undone
+   if the later is rolled back.
+
+   Note that bytes appended past the end of the IO device by a
+   transaction are not removed when the transaction is rolled
+   back.  */
+
+/* Begin a new transaction in the IO space IO.  Return IOS_OK.  */
+
+int ios_tx_begin (ios io);
+
+/* Commit the innermost transaction in progress in the IO space IO.
+   If it is the outermost transaction, the cache of the space is
+   flushed.  Return IOS_ERROR if there is no transaction in progress
+   or the cache couldn't be flushed, IOS_OK otherwise.  */
+
+int ios_tx_commit (ios io);
+
+/* Undo all the writes performed in the IO space IO since the
+   beginning of the innermost transaction in progress, and finish it.
+   The undoing writes are not recorded in the journal.  If it is the
+   outermost transaction, the cache of the space is flushed.  Return
+   IOS_ERROR if there is no transaction in progress or some of the
+   original contents couldn't be restored, IOS_OK otherwise.  */
+
+int ios_tx_rollback (ios io);
+
+/* Return the number of nested transactions in progress in the IO
+   space IO.  */
+
+int ios_tx_depth (ios io);
+
+/* **************** Delta API ****************
+
+   Some IO spaces, like the ones operating copy-on-write overlays
+   (handlers of the form cow://HANDLER), keep the bytes written to
+   them apart from the underlying storage.  These bytes are the
+   "delta" of the space.  A delta can be exported to a file, and
+   imported later in any IO space.  */
+
+/* Write the delta of the IO space IO to the file FILENAME, creating
+   the file if it doesn't exist and truncating it if it exists.
+   Return IOS_ERROR if the space doesn't keep a delta or the file
+   can't be written, IOS_OK otherwise.  */
+
+int ios_delta_export (ios io, const char *filename);
+
+/* Write the delta stored in the file FILENAME, as written by
+   ios_delta_export, to the IO space IO.  The writes are performed in
+   a transaction.  Return IOS_ERROR if the file can't be read or is
+   not valid, or if some write fails, IOS_OK otherwise.  In case of
+   error the contents of the space are not modified.  */
+
+int ios_delta_import (ios io, const char *filename);
+
+/* Write the delta of the IO space IO to the underlying storage, and
+   discard it.  Either all the delta is written or nothing is.  Return
+   IOS_ERROR if the space doesn't keep a delta or the delta can't be
+   written, IOS_OK otherwise.  */
+
+int ios_delta_apply (ios io);
+
+/* **************** Journal API ****************
+
+   Every IO space keeps a journal of the writes performed in it,
+   recording both the previous and the new contents of the written
+   ranges, so the writes can be undone and redone.
+
+   The writes performed between two calls to ios_journal_seal form a
+   group, which is undone and redone as a whole.  Adjacent writes of
+   the same group are coalesced in a single journal entry.
+
+   The memory used by the journal of an IO space is bounded.  When
+   the bound is exceeded, the oldest entries are discarded.  */
+
+/* Finish the current group of writes in the journals of all the IO
+   spaces.  The writes performed from now on are undone separately
+   from the previous ones.  */
+
+void ios_journal_seal (void);
+
+/* Status returned by ios_undo and ios_redo when the journal has no
+   writes to undo or redo, respectively.  */
+
+#define IOS_EJOURNAL -4
+
+/* Undo the last group of writes performed in the IO space IO.  Return
+   IOS_EJOURNAL if there is nothing to undo, IOS_ERROR if the previous
+   contents couldn't be restored, IOS_OK otherwise.  */
+
+int ios_undo (ios io);
+
+/* Redo the last group of writes undone in the IO space IO.  Return
+   IOS_EJOURNAL if there is nothing to redo, IOS_ERROR if the writes
+   couldn't be performed, IOS_OK otherwise.  */
+
+int ios_redo (ios io);
+
+/* The journal of an IO space can't be allowed to use more than
+   IOS_JOURNAL_SIZE_LIMIT bytes.  */
+
+#define IOS_JOURNAL_SIZE_LIMIT ((size_t) 1 << 30)
+
+/* Set the maximum amount of memory, in bytes, used by the journal of
+   the IO space IO.  A size of zero disables the journal.  Any write
+   that can be redone is discarded.  Return IOS_ERROR if MAX_SIZE is
+   too big, IOS_OK otherwise.  */
+
+int ios_set_journal_size (ios io, size_t max_size);
 
-/* XXX: writeme.  */
+/* Set the maximum size of the journals of the IO spaces opened from
+   now on, and also of all the currently open IO spaces.  Return
+   IOS_ERROR if MAX_SIZE is too big, IOS_OK otherwise.  */
 
-/* XXX: we need functions to temporarily disable updates in a given IO
-   range, to be used by the struct writer functions.  */
+int ios_set_journal_size_default (size_t max_size);
 
-/* **************** Transaction API **************** */
+/* Get the size set by ios_set_journal_size_default.  */
 
-/* XXX: writeme.  */
+size_t ios_journal_size_default (void);
 
 #endif /* ! IOS_H */
@@ -43,6 +43,11 @@
 
 extern struct pk_cmd file_cmd; /* pk-file.c  */
 extern struct pk_cmd close_cmd; /* pk-file.c */
+extern struct pk_cmd mem_cmd; /* pk-file.c */
+extern struct pk_cmd save_cmd; /* pk-file.c */
+extern struct pk_cmd flush_cmd; /* pk-file.c */
+extern struct pk_cmd undo_cmd; /* pk-file.c */
+extern struct pk_cmd redo_cmd; /* pk-file.c */
 extern struct pk_cmd load_cmd; /* pk-file.c */
 extern struct pk_cmd info_cmd; /* pk-info.c  */
 extern struct pk_cmd exit_cmd; /* pk-misc.c  */
@@ -51,6 +56,8 @@ extern struct pk_cmd help_cmd; /* pk-help.c */
 extern struct pk_cmd vm_cmd; /* pk-vm.c  */
 extern struct pk_cmd print_cmd; /* pk-print.c */
 extern struct pk_cmd set_cmd; /* pk-set.c */
+extern struct pk_cmd tx_cmd; /* pk-tx.c */
+extern struct pk_cmd delta_cmd; /* pk-delta.c */
 
 struct pk_cmd null_cmd =
   {NULL, NULL, NULL, 0, NULL, NULL};
@@ -62,11 +69,18 @@ static struct pk_cmd *cmds[] =
     &version_cmd,
     &info_cmd,
     &close_cmd,
+    &mem_cmd,
+    &save_cmd,
+    &flush_cmd,
+    &undo_cmd,
+    &redo_cmd,
     &load_cmd,
     &help_cmd,
     &vm_cmd,
     &print_cmd,
     &set_cmd,
+    &tx_cmd,
+    &delta_cmd,
     &null_cmd
   };
 
@@ -598,6 +612,12 @@ extern struct pk_trie *vm_disas_trie; /* pk-vm.c */
 extern struct pk_cmd *set_cmds[]; /* pk-set.c */
 extern struct pk_trie *set_trie; /* pk-set.c */
 
+extern struct pk_cmd *tx_cmds[]; /* pk-tx.c */
+extern struct pk_trie *tx_trie; /* pk-tx.c */
+
+extern struct pk_cmd *delta_cmds[]; /* pk-delta.c */
+extern struct pk_trie *delta_trie; /* pk-delta.c */
+
 static struct pk_trie *cmds_trie;
 
 int
@@ -609,6 +629,10 @@ pk_cmd_exec (char *str)
 
   char *cmd = skip_blanks (str);
 
+  /* The writes performed by different commands are undone
+     separately.  */
+  ios_journal_seal ();
+
   if (*cmd == '.')
     return pk_cmd_exec_1 (cmd + 1, cmds_trie, NULL);
   else
@@ -750,6 +774,8 @@ pk_cmd_init (void)
   vm_trie = pk_trie_from_cmds (vm_cmds);
   vm_disas_trie = pk_trie_from_cmds (vm_disas_cmds);
   set_trie = pk_trie_from_cmds (set_cmds);
+  tx_trie = pk_trie_from_cmds (tx_cmds);
+  delta_trie = pk_trie_from_cmds (delta_cmds);
 
   /* Compile commands written in Poke.  */
   {
@@ -783,4 +809,6 @@ pk_cmd_shutdown (void)
   pk_trie_free (vm_trie);
   pk_trie_free (vm_disas_trie);
   pk_trie_free (set_trie);
+  pk_trie_free (tx_trie);
+  pk_trie_free (delta_trie);
 }
@@ -0,0 +1,117 @@
+/* pk-delta.c - Commands for IO space deltas.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <gettext.h>
+#define _(str) dgettext (PACKAGE, str)
+#include <assert.h>
+
+#include "pk-cmd.h"
+#include "pk-term.h"
+#include "ios.h"
+
+static int
+pk_cmd_delta_export (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* delta export FILENAME  */
+
+  const char *filename;
+
+  assert (argc == 1);
+
+  filename = PK_CMD_ARG_STR (argv[0]);
+  if (ios_delta_export (ios_cur (), filename) != IOS_OK)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_printf (_("%s: error writing the delta\n"), filename);
+      return 0;
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_delta_import (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* delta import FILENAME  */
+
+  const char *filename;
+
+  assert (argc == 1);
+
+  filename = PK_CMD_ARG_STR (argv[0]);
+  if (ios_delta_import (ios_cur (), filename) != IOS_OK)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_printf (_("%s: error importing the delta\n"), filename);
+      return 0;
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_delta_apply (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* delta apply  */
+
+  assert (argc == 0);
+
+  if (ios_delta_apply (ios_cur ()) != IOS_OK)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_puts (_("the delta couldn't be applied.\n"));
+      return 0;
+    }
+
+  return 1;
+}
+
+extern struct pk_cmd null_cmd; /* pk-cmd.c  */
+
+struct pk_cmd delta_export_cmd =
+  {"export", "f", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_delta_export,
+   "delta export FILENAME"};
+
+struct pk_cmd delta_import_cmd =
+  {"import", "f", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_delta_import,
+   "delta import FILENAME"};
+
+struct pk_cmd delta_apply_cmd =
+  {"apply", "", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_delta_apply,
+   "delta apply"};
+
+struct pk_cmd *delta_cmds[] =
+  {
+   &delta_export_cmd,
+   &delta_import_cmd,
+   &delta_apply_cmd,
+   &null_cmd
+  };
+
+struct pk_trie *delta_trie;
+
+struct pk_cmd delta_cmd =
+  {"delta", "", "", 0, &delta_trie, NULL,
+   "delta (export FILENAME|import FILENAME|apply)"};
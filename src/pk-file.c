@@ -18,6 +18,8 @@
 
 #include <config.h>
 #include <assert.h>
+#include <inttypes.h>
+#include <string.h>
 #include <unistd.h>
 #include <gettext.h>
 #define _(str) dgettext (PACKAGE, str)
@@ -25,6 +27,7 @@
 #include "ios.h"
 #include "poke.h"
 #include "pk-cmd.h"
+#include "pk-term.h"
 
 static int
 pk_cmd_file (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
@@ -54,32 +57,196 @@ pk_cmd_file (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
     {
       /* Create a new IO space.  */
       const char *arg_str = PK_CMD_ARG_STR (argv[0]);
-      char *filename
-        = xmalloc (strlen ("file://") + strlen (arg_str) + 1);
+      char *filename;
 
-      if (access (arg_str, R_OK) != 0)
+      if (strstr (arg_str, "://") != NULL)
+        /* The argument is a handler for some particular IO device,
+           like mmap://FILENAME.  Use it verbatim.  */
+        filename = xstrdup (arg_str);
+      else
         {
-          pk_printf (_("%s: file cannot be read\n"), arg_str);
-          return 0;
+          if (access (arg_str, R_OK) != 0)
+            {
+              pk_printf (_("%s: file cannot be read\n"), arg_str);
+              return 0;
+            }
+
+          filename = xmalloc (strlen ("file://") + strlen (arg_str) + 1);
+          strcpy (filename, "file://");
+          strcat (filename, arg_str);
         }
 
-      strcpy (filename, "file://");
-      strcat (filename, arg_str);
-
       if (ios_search (filename) != NULL)
         {
           printf (_("File %s already opened.  Use `file #N' to switch.\n"),
                   filename);
+          free (filename);
           return 0;
         }
 
-      ios_open (filename);
+      if (!ios_open (filename))
+        {
+          pk_printf (_("%s: error opening the IO space\n"), filename);
+          free (filename);
+          return 0;
+        }
       free (filename);
     }
 
   if (poke_interactive_p && !poke_quiet_p)
-    pk_printf (_("The current file is now `%s'.\n"),
-               ios_handler (ios_cur ()) + strlen ("file://"));
+    {
+      const char *handler = ios_handler (ios_cur ());
+
+      if (strncmp (handler, "file://", 7) == 0)
+        handler += 7;
+      pk_printf (_("The current file is now `%s'.\n"), handler);
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_mem (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* mem NAME[,SIZE]  */
+
+  const char *arg_str;
+  char *handler;
+
+  assert (argc == 2);
+
+  arg_str = PK_CMD_ARG_STR (argv[0]);
+  if (*arg_str == '\0')
+    {
+      pk_puts (_("Usage: mem NAME[,SIZE]\n"));
+      return 0;
+    }
+
+  /* The handler of a memory IO space is its name surrounded by
+     asterisks.  */
+  handler = xmalloc (strlen (arg_str) + 3);
+  strcpy (handler, "*");
+  strcat (handler, arg_str);
+  strcat (handler, "*");
+
+  if (ios_search (handler) != NULL)
+    {
+      printf (_("Buffer %s already opened.  Use `file #N' to switch.\n"),
+              handler);
+      free (handler);
+      return 0;
+    }
+
+  if (!ios_open (handler))
+    {
+      pk_printf (_("%s: error creating the IO space\n"), handler);
+      free (handler);
+      return 0;
+    }
+
+  /* Writing the last byte of the buffer makes it grow to the
+     requested size.  The new contents are zeroed.  */
+  if (PK_CMD_ARG_TYPE (argv[1]) == PK_CMD_ARG_INT
+      && PK_CMD_ARG_INT (argv[1]) > 0
+      && (PK_CMD_ARG_INT (argv[1]) > INT64_MAX / 8
+          || ios_write_uint (ios_cur (),
+                             (PK_CMD_ARG_INT (argv[1]) - 1) * 8,
+                             0, 8, IOS_ENDIAN_MSB, 0) != IOS_OK))
+    pk_printf (_("%s: error growing the IO space to %" PRIi64
+                 " bytes\n"),
+               handler, PK_CMD_ARG_INT (argv[1]));
+
+  if (poke_interactive_p && !poke_quiet_p)
+    pk_printf (_("The current file is now `%s'.\n"), handler);
+
+  free (handler);
+  return 1;
+}
+
+static int
+pk_cmd_save (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* save FILENAME  */
+
+  const char *filename;
+
+  assert (argc == 1);
+
+  filename = PK_CMD_ARG_STR (argv[0]);
+  if (ios_save (ios_cur (), filename) != IOS_OK)
+    {
+      pk_printf (_("%s: error writing the file\n"), filename);
+      return 0;
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_flush (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* flush  */
+
+  assert (argc == 0);
+
+  if (ios_flush (ios_cur ()) != IOS_OK)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_puts (_("some pending writes couldn't be flushed\n"));
+      return 0;
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_undo (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* undo  */
+
+  int ret;
+
+  assert (argc == 0);
+
+  ret = ios_undo (ios_cur ());
+  if (ret != IOS_OK)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      if (ret == IOS_EJOURNAL)
+        pk_puts (_("nothing to undo\n"));
+      else
+        pk_puts (_("the previous contents couldn't be restored\n"));
+      return 0;
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_redo (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* redo  */
+
+  int ret;
+
+  assert (argc == 0);
+
+  ret = ios_redo (ios_cur ());
+  if (ret != IOS_OK)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      if (ret == IOS_EJOURNAL)
+        pk_puts (_("nothing to redo\n"));
+      else
+        pk_puts (_("the writes couldn't be performed again\n"));
+      return 0;
+    }
 
   return 1;
 }
@@ -128,10 +295,9 @@ pk_cmd_close (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
 static void
 print_info_file (ios io, void *data)
 {
-  int *i = (int *) data;
   pk_printf ("%s#%d\t%s\t0x%08jx#b\t%s\n",
              io == ios_cur () ? "* " : "  ",
-             (*i)++,
+             ios_get_id (io),
              ios_mode (io) & IOS_M_RDWR ? "rw" : "r ",
              ios_tell (io), ios_handler (io));
 }
@@ -139,13 +305,10 @@ print_info_file (ios io, void *data)
 static int
 pk_cmd_info_files (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
 {
-  int id;
-
   assert (argc == 0);
 
-  id = 0;
   pk_printf (_("  Id\tMode\tPosition\tFilename\n"));
-  ios_map (print_info_file, &id);
+  ios_map (print_info_file, NULL);
 
   return 1;
 }
@@ -196,6 +359,21 @@ pk_cmd_load_file (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
 struct pk_cmd file_cmd =
   {"file", "tf", "", 0, NULL, pk_cmd_file, "file (FILENAME|#ID)"};
 
+struct pk_cmd mem_cmd =
+  {"mem", "s,?n", "", 0, NULL, pk_cmd_mem, "mem NAME[,SIZE]"};
+
+struct pk_cmd save_cmd =
+  {"save", "f", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_save, "save FILENAME"};
+
+struct pk_cmd flush_cmd =
+  {"flush", "", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_flush, "flush"};
+
+struct pk_cmd undo_cmd =
+  {"undo", "", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_undo, "undo"};
+
+struct pk_cmd redo_cmd =
+  {"redo", "", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_redo, "redo"};
+
 struct pk_cmd close_cmd =
   {"close", "?t", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_close, "close [#ID]"};
 
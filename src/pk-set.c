@@ -278,6 +278,203 @@ pk_cmd_set_error_on_warning (int argc, struct pk_cmd_arg argv[],
   return 1;
 }
 
+static int
+pk_cmd_set_cache_geometry (int argc, struct pk_cmd_arg argv[],
+                           int which)
+{
+  size_t geometry[2];
+  int64_t value;
+
+  assert (argc == 1);
+
+  ios_cache_default (&geometry[0], &geometry[1]);
+
+  if (PK_CMD_ARG_TYPE (argv[0]) == PK_CMD_ARG_NULL)
+    pk_printf ("%zu\n", geometry[which]);
+  else
+    {
+      value = PK_CMD_ARG_INT (argv[0]);
+      if (value <= 0
+          || (which == 0 && (value & (value - 1)) != 0)
+          || (uint64_t) value > (which == 0
+                                 ? IOS_CACHE_MAX_SIZE
+                                 : IOS_CACHE_MAX_PAGES))
+        {
+          pk_term_class ("error");
+          pk_puts ("error: ");
+          pk_term_end_class ("error");
+          if (which == 0)
+            pk_printf ("cache-page-size should be a power of two not "
+                       "larger than %zu.\n", IOS_CACHE_MAX_SIZE);
+          else
+            pk_printf ("cache-pages should be a positive number not "
+                       "larger than %zu.\n", IOS_CACHE_MAX_PAGES);
+          return 0;
+        }
+
+      geometry[which] = value;
+      if (geometry[0] > IOS_CACHE_MAX_SIZE / geometry[1])
+        {
+          pk_term_class ("error");
+          pk_puts ("error: ");
+          pk_term_end_class ("error");
+          pk_printf ("the cache can't be larger than %zu bytes.\n",
+                     IOS_CACHE_MAX_SIZE);
+          return 0;
+        }
+
+      if (ios_set_cache_default (geometry[0], geometry[1]) != IOS_OK)
+        {
+          pk_term_class ("error");
+          pk_puts ("error: ");
+          pk_term_end_class ("error");
+          pk_puts ("the caches of the open IO spaces couldn't be "
+                   "flushed.\n");
+          return 0;
+        }
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_set_cache_page_size (int argc, struct pk_cmd_arg argv[],
+                            uint64_t uflags)
+{
+  /* set cache-page-size [BYTES]  */
+  return pk_cmd_set_cache_geometry (argc, argv, 0);
+}
+
+static int
+pk_cmd_set_cache_pages (int argc, struct pk_cmd_arg argv[],
+                        uint64_t uflags)
+{
+  /* set cache-pages [NUM]  */
+  return pk_cmd_set_cache_geometry (argc, argv, 1);
+}
+
+static int
+pk_cmd_set_journal_size (int argc, struct pk_cmd_arg argv[],
+                         uint64_t uflags)
+{
+  /* set journal-size [BYTES]  */
+
+  int64_t value;
+
+  assert (argc == 1);
+
+  if (PK_CMD_ARG_TYPE (argv[0]) == PK_CMD_ARG_NULL)
+    pk_printf ("%zu\n", ios_journal_size_default ());
+  else
+    {
+      value = PK_CMD_ARG_INT (argv[0]);
+      if (value < 0
+          || (uint64_t) value > IOS_JOURNAL_SIZE_LIMIT
+          || ios_set_journal_size_default (value) != IOS_OK)
+        {
+          pk_term_class ("error");
+          pk_puts ("error: ");
+          pk_term_end_class ("error");
+          pk_printf ("journal-size should be a number of bytes not "
+                     "larger than %zu.\n", IOS_JOURNAL_SIZE_LIMIT);
+          return 0;
+        }
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_set_readahead (int argc, struct pk_cmd_arg argv[],
+                      uint64_t uflags)
+{
+  /* set readahead [PAGES]  */
+
+  int64_t value;
+
+  assert (argc == 1);
+
+  if (PK_CMD_ARG_TYPE (argv[0]) == PK_CMD_ARG_NULL)
+    pk_printf ("%zu\n", ios_readahead_default ());
+  else
+    {
+      value = PK_CMD_ARG_INT (argv[0]);
+      if (value < 0
+          || (uint64_t) value > IOS_READAHEAD_MAX_PAGES
+          || ios_set_readahead_default (value) != IOS_OK)
+        {
+          pk_term_class ("error");
+          pk_puts ("error: ");
+          pk_term_end_class ("error");
+          pk_printf ("readahead should be a number of pages not larger "
+                     "than %zu.\n", IOS_READAHEAD_MAX_PAGES);
+          return 0;
+        }
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_set_save_indexes (int argc, struct pk_cmd_arg argv[],
+                         uint64_t uflags)
+{
+  /* set save-indexes {yes,no}  */
+
+  const char *arg;
+
+  /* See the note in pk_cmd_set_pretty_print.  */
+  assert (argc == 1);
+  arg = PK_CMD_ARG_STR (argv[0]);
+
+  if (*arg == '\0')
+    pk_puts (ios_save_indexes () ? "yes\n" : "no\n");
+  else if (STREQ (arg, "yes"))
+    ios_set_save_indexes (1);
+  else if (STREQ (arg, "no"))
+    ios_set_save_indexes (0);
+  else
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_puts (" save-indexes should be one of `yes' or `no'.\n");
+      return 0;
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_set_direct_io (int argc, struct pk_cmd_arg argv[],
+                      uint64_t uflags)
+{
+  /* set direct-io {yes,no}  */
+
+  const char *arg;
+
+  /* See the note in pk_cmd_set_pretty_print.  */
+  assert (argc == 1);
+  arg = PK_CMD_ARG_STR (argv[0]);
+
+  if (*arg == '\0')
+    pk_puts (ios_direct_io () ? "yes\n" : "no\n");
+  else if (STREQ (arg, "yes"))
+    ios_set_direct_io (1);
+  else if (STREQ (arg, "no"))
+    ios_set_direct_io (0);
+  else
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_puts (" direct-io should be one of `yes' or `no'.\n");
+      return 0;
+    }
+
+  return 1;
+}
+
 extern struct pk_cmd null_cmd; /* pk-cmd.c  */
 
 struct pk_cmd set_obase_cmd =
@@ -297,6 +494,30 @@ struct pk_cmd set_error_on_warning_cmd =
   {"error-on-warning", "s?", "", 0, NULL, pk_cmd_set_error_on_warning,
    "set error-on-warning (yes|no)"};
 
+struct pk_cmd set_cache_page_size_cmd =
+  {"cache-page-size", "?n", "", 0, NULL, pk_cmd_set_cache_page_size,
+   "set cache-page-size [BYTES]"};
+
+struct pk_cmd set_cache_pages_cmd =
+  {"cache-pages", "?n", "", 0, NULL, pk_cmd_set_cache_pages,
+   "set cache-pages [NUM]"};
+
+struct pk_cmd set_readahead_cmd =
+  {"readahead", "?n", "", 0, NULL, pk_cmd_set_readahead,
+   "set readahead [PAGES]"};
+
+struct pk_cmd set_save_indexes_cmd =
+  {"save-indexes", "s?", "", 0, NULL, pk_cmd_set_save_indexes,
+   "set save-indexes (yes|no)"};
+
+struct pk_cmd set_direct_io_cmd =
+  {"direct-io", "s?", "", 0, NULL, pk_cmd_set_direct_io,
+   "set direct-io (yes|no)"};
+
+struct pk_cmd set_journal_size_cmd =
+  {"journal-size", "?n", "", 0, NULL, pk_cmd_set_journal_size,
+   "set journal-size [BYTES]"};
+
 struct pk_cmd *set_cmds[] =
   {
    &set_obase_cmd,
@@ -304,6 +525,12 @@ struct pk_cmd *set_cmds[] =
    &set_nenc_cmd,
    &set_pretty_print_cmd,
    &set_error_on_warning_cmd,
+   &set_cache_page_size_cmd,
+   &set_cache_pages_cmd,
+   &set_readahead_cmd,
+   &set_save_indexes_cmd,
+   &set_direct_io_cmd,
+   &set_journal_size_cmd,
    &null_cmd
   };
 
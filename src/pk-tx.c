@@ -0,0 +1,122 @@
+/* pk-tx.c - Commands for IO space transactions.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <gettext.h>
+#define _(str) dgettext (PACKAGE, str)
+#include <assert.h>
+
+#include "pk-cmd.h"
+#include "pk-term.h"
+#include "ios.h"
+
+static int
+pk_cmd_tx_begin (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* tx begin  */
+
+  assert (argc == 0);
+
+  ios_tx_begin (ios_cur ());
+  return 1;
+}
+
+static int
+pk_cmd_tx_commit (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* tx commit  */
+
+  ios io = ios_cur ();
+
+  assert (argc == 0);
+
+  if (ios_tx_depth (io) == 0)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_puts (_("no transaction in progress.\n"));
+      return 0;
+    }
+
+  if (ios_tx_commit (io) != IOS_OK)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_puts (_("some pending writes couldn't be flushed.\n"));
+      return 0;
+    }
+
+  return 1;
+}
+
+static int
+pk_cmd_tx_rollback (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* tx rollback  */
+
+  ios io = ios_cur ();
+
+  assert (argc == 0);
+
+  if (ios_tx_depth (io) == 0)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_puts (_("no transaction in progress.\n"));
+      return 0;
+    }
+
+  if (ios_tx_rollback (io) != IOS_OK)
+    {
+      pk_term_class ("error");
+      pk_puts ("error: ");
+      pk_term_end_class ("error");
+      pk_puts (_("some writes couldn't be undone.\n"));
+      return 0;
+    }
+
+  return 1;
+}
+
+extern struct pk_cmd null_cmd; /* pk-cmd.c  */
+
+struct pk_cmd tx_begin_cmd =
+  {"begin", "", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_tx_begin, "tx begin"};
+
+struct pk_cmd tx_commit_cmd =
+  {"commit", "", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_tx_commit, "tx commit"};
+
+struct pk_cmd tx_rollback_cmd =
+  {"rollback", "", "", PK_CMD_F_REQ_IO, NULL, pk_cmd_tx_rollback,
+   "tx rollback"};
+
+struct pk_cmd *tx_cmds[] =
+  {
+   &tx_begin_cmd,
+   &tx_commit_cmd,
+   &tx_rollback_cmd,
+   &null_cmd
+  };
+
+struct pk_trie *tx_trie;
+
+struct pk_cmd tx_cmd =
+  {"tx", "", "", 0, &tx_trie, NULL, "tx (begin|commit|rollback)"};
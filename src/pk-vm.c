@@ -18,6 +18,7 @@
 
 #include <config.h>
 #include <assert.h>
+#include <inttypes.h>
 
 #include "poke.h"
 #include "pk-cmd.h"
@@ -174,6 +175,25 @@ pk_cmd_vm_disas_writ (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
   return 1;
 }
 
+static int
+pk_cmd_vm_cache (int argc, struct pk_cmd_arg argv[], uint64_t uflags)
+{
+  /* vm cache  */
+
+  struct pvm_cache_stats stats;
+
+  assert (argc == 0);
+
+  pvm_cache_get_stats (&stats);
+  pk_printf ("hits: %" PRIu64 "\n", stats.hits);
+  pk_printf ("misses: %" PRIu64 "\n", stats.misses);
+  pk_printf ("evictions: %" PRIu64 "\n", stats.evictions);
+  pk_printf ("entries: %zu\n", stats.entries);
+  pk_printf ("size: %zu\n", stats.size);
+  pk_printf ("budget: %zu\n", stats.budget);
+
+  return 1;
+}
 
 extern struct pk_cmd null_cmd; /* pk-cmd.c  */
 
@@ -216,13 +236,17 @@ struct pk_cmd vm_disas_cmd =
   {"disassemble", "e", PK_VM_DIS_UFLAGS, 0, &vm_disas_trie, NULL,
    "vm disassemble (expression|function)"};
 
+struct pk_cmd vm_cache_cmd =
+  {"cache", "", "", 0, NULL, pk_cmd_vm_cache, "vm cache"};
+
 struct pk_cmd *vm_cmds[] =
   {
     &vm_disas_cmd,
+    &vm_cache_cmd,
     &null_cmd
   };
 
 struct pk_trie *vm_trie;
 
 struct pk_cmd vm_cmd =
-  {"vm", "", "", 0, &vm_trie, NULL, "vm (disassemble)"};
+  {"vm", "", "", 0, &vm_trie, NULL, "vm (disassemble|cache)"};
@@ -1013,12 +1013,20 @@ pkl_asm_insn_bnz (pkl_asm pasm,
    ( VAL ARR -- VAL ARR BOOL )
 
    Push 0 (false) if the given VAL is not found in the container ARR.
-   Push 1 (true) otherwise.  */
+   Push 1 (true) otherwise.
+
+   Arrays of integers are searched by the VM itself, which can compare
+   the integers in compactly stored arrays without boxing them.  */
 
 static void
 pkl_asm_insn_ais (pkl_asm pasm, pkl_ast_node atype)
 {
-  RAS_MACRO_AIS (PKL_AST_TYPE_A_ETYPE (atype));
+  pkl_ast_node etype = PKL_AST_TYPE_A_ETYPE (atype);
+
+  if (PKL_AST_TYPE_CODE (etype) == PKL_TYPE_INTEGRAL)
+    pkl_asm_insn (pasm, PKL_INSN_AISI);
+  else
+    RAS_MACRO_AIS (etype);
 }
 
 /* Create a new instance of an assembler.  This initializes a new
@@ -898,6 +898,114 @@ pkl_ast_type_is_complete (pkl_ast_node type)
   return complete;
 }
 
+/* Return 1 if the value of the expression or type AST doesn't depend
+   on any variable, except the fields of the struct being mapped if
+   IN_STRUCT is 1.  Return 0 otherwise.  */
+
+static int
+pkl_ast_closed_p (pkl_ast_node ast, int in_struct)
+{
+  size_t i;
+
+  if (ast == NULL)
+    return 1;
+
+  if (PKL_AST_CODE (ast) == PKL_AST_TYPE)
+    {
+      switch (PKL_AST_TYPE_CODE (ast))
+        {
+        case PKL_TYPE_INTEGRAL:
+        case PKL_TYPE_STRING:
+          return 1;
+        case PKL_TYPE_OFFSET:
+          return (pkl_ast_closed_p (PKL_AST_TYPE_O_BASE_TYPE (ast), in_struct)
+                  && pkl_ast_closed_p (PKL_AST_TYPE_O_UNIT (ast), in_struct));
+        case PKL_TYPE_ARRAY:
+          return (pkl_ast_closed_p (PKL_AST_TYPE_A_ETYPE (ast), in_struct)
+                  && pkl_ast_closed_p (PKL_AST_TYPE_A_BOUND (ast), in_struct));
+        case PKL_TYPE_STRUCT:
+          {
+            pkl_ast_node elem;
+
+            /* The methods and the other declarations of a struct can
+               refer to anything.  */
+            if (PKL_AST_TYPE_S_NDECL (ast) != 0)
+              return 0;
+
+            for (elem = PKL_AST_TYPE_S_ELEMS (ast); elem;
+                 elem = PKL_AST_CHAIN (elem))
+              {
+                pkl_ast_node field_type, constraint, label;
+
+                if (PKL_AST_CODE (elem) != PKL_AST_STRUCT_TYPE_FIELD)
+                  return 0;
+
+                field_type = PKL_AST_STRUCT_TYPE_FIELD_TYPE (elem);
+                constraint = PKL_AST_STRUCT_TYPE_FIELD_CONSTRAINT (elem);
+                label = PKL_AST_STRUCT_TYPE_FIELD_LABEL (elem);
+                if (!pkl_ast_closed_p (field_type, 1)
+                    || !pkl_ast_closed_p (constraint, 1)
+                    || !pkl_ast_closed_p (label, 1))
+                  return 0;
+              }
+            return 1;
+          }
+        default:
+          return 0;
+        }
+    }
+
+  if (PKL_AST_LITERAL_P (ast))
+    return 1;
+
+  switch (PKL_AST_CODE (ast))
+    {
+    case PKL_AST_INTEGER:
+    case PKL_AST_STRING:
+      return 1;
+    case PKL_AST_OFFSET:
+      return (pkl_ast_closed_p (PKL_AST_OFFSET_MAGNITUDE (ast), in_struct)
+              && pkl_ast_closed_p (PKL_AST_OFFSET_UNIT (ast), in_struct));
+    case PKL_AST_VAR:
+      /* The variables in the innermost frame of a struct type are its
+         fields.  */
+      return in_struct && PKL_AST_VAR_BACK (ast) == 0;
+    case PKL_AST_EXP:
+      for (i = 0; i < PKL_AST_EXP_NUMOPS (ast); ++i)
+        if (!pkl_ast_closed_p (PKL_AST_EXP_OPERAND (ast, i), in_struct))
+          return 0;
+      return 1;
+    case PKL_AST_COND_EXP:
+      return (pkl_ast_closed_p (PKL_AST_COND_EXP_COND (ast), in_struct)
+              && pkl_ast_closed_p (PKL_AST_COND_EXP_THENEXP (ast), in_struct)
+              && pkl_ast_closed_p (PKL_AST_COND_EXP_ELSEEXP (ast), in_struct));
+    case PKL_AST_CAST:
+      return (pkl_ast_closed_p (PKL_AST_CAST_TYPE (ast), in_struct)
+              && pkl_ast_closed_p (PKL_AST_CAST_EXP (ast), in_struct));
+    case PKL_AST_STRUCT_REF:
+      return pkl_ast_closed_p (PKL_AST_STRUCT_REF_STRUCT (ast), in_struct);
+    case PKL_AST_INDEXER:
+      return (pkl_ast_closed_p (PKL_AST_INDEXER_ENTITY (ast), in_struct)
+              && pkl_ast_closed_p (PKL_AST_INDEXER_INDEX (ast), in_struct));
+    default:
+      return 0;
+    }
+}
+
+/* Return 1 if mapping a value of the given TYPE doesn't depend on
+   any variable, i.e. if the mapped value only depends on the mapped
+   bytes.  Return 0 otherwise.  Note that the bound of TYPE, if it is
+   an array type, is not considered.  */
+
+int
+pkl_ast_type_is_closed (pkl_ast_node type)
+{
+  if (PKL_AST_TYPE_CODE (type) == PKL_TYPE_ARRAY)
+    return pkl_ast_closed_p (PKL_AST_TYPE_A_ETYPE (type), 0);
+
+  return pkl_ast_closed_p (type, 0);
+}
+
 /* Print a textual description of TYPE to the file OUT.  If TYPE is a
    named type then it's given name is preferred if USE_GIVEN_NAME is
    1.  */
@@ -1279,13 +1387,16 @@ pkl_ast_make_isa (pkl_ast ast,
 
 pkl_ast_node
 pkl_ast_make_map (pkl_ast ast,
-                  pkl_ast_node type, pkl_ast_node offset)
+                  pkl_ast_node type, pkl_ast_node ios,
+                  pkl_ast_node offset)
 {
   pkl_ast_node map = pkl_ast_make_node (ast, PKL_AST_MAP);
 
   assert (type && offset);
 
   PKL_AST_MAP_TYPE (map) = ASTREF (type);
+  if (ios)
+    PKL_AST_MAP_IOS (map) = ASTREF (ios);
   PKL_AST_MAP_OFFSET (map) = ASTREF (offset);
 
   return map;
@@ -1814,6 +1925,7 @@ pkl_ast_node_free (pkl_ast_node ast)
     case PKL_AST_MAP:
 
       pkl_ast_node_free (PKL_AST_MAP_TYPE (ast));
+      pkl_ast_node_free (PKL_AST_MAP_IOS (ast));
       pkl_ast_node_free (PKL_AST_MAP_OFFSET (ast));
       break;
 
@@ -2544,6 +2656,7 @@ pkl_ast_print_1 (FILE *fd, pkl_ast_node ast, int indent)
       PRINT_COMMON_FIELDS;
       PRINT_AST_SUBAST (type, TYPE);
       PRINT_AST_SUBAST (map_type, MAP_TYPE);
+      PRINT_AST_OPT_SUBAST (ios, MAP_IOS);
       PRINT_AST_SUBAST (offset, MAP_OFFSET);
       break;
 
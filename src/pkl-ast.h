@@ -923,6 +923,7 @@ int pkl_ast_type_promoteable (pkl_ast_node ft, pkl_ast_node tt,
                               int promote_array_of_any);
 pkl_ast_node pkl_ast_sizeof_type (pkl_ast ast, pkl_ast_node type);
 int pkl_ast_type_is_complete (pkl_ast_node type);
+int pkl_ast_type_is_closed (pkl_ast_node type);
 void pkl_print_type (FILE *out, pkl_ast_node type, int use_given_name);
 char *pkl_type_str (pkl_ast_node type, int use_given_name);
 int pkl_ast_func_all_optargs (pkl_ast_node type);
@@ -1056,9 +1057,14 @@ pkl_ast_node pkl_ast_make_isa (pkl_ast ast,
 
    TYPE is the mapped type.
 
+   IOS is an expression evaluating to the identifier of the IO space
+   where the TYPE is mapped.  If it is NULL then the current IO space
+   is used.
+
    OFFSET is the offset in IO space where the TYPE is mapped.  */
 
 #define PKL_AST_MAP_TYPE(AST) ((AST)->map.type)
+#define PKL_AST_MAP_IOS(AST) ((AST)->map.ios)
 #define PKL_AST_MAP_OFFSET(AST) ((AST)->map.offset)
 
 struct pkl_ast_map
@@ -1066,11 +1072,13 @@ struct pkl_ast_map
   struct pkl_ast_common common;
 
   union pkl_ast_node *type;
+  union pkl_ast_node *ios;
   union pkl_ast_node *offset;
 };
 
 pkl_ast_node pkl_ast_make_map (pkl_ast ast,
                                pkl_ast_node type,
+                               pkl_ast_node ios,
                                pkl_ast_node offset);
 
 /* PKL_AST_SCONS nodes represent struct constructors.
@@ -1202,6 +1210,10 @@ pkl_ast_node pkl_ast_make_var (pkl_ast ast,
 #define PKL_AST_BUILTIN_RAND 2
 #define PKL_AST_BUILTIN_GET_ENDIAN 3
 #define PKL_AST_BUILTIN_SET_ENDIAN 4
+#define PKL_AST_BUILTIN_TX_BEGIN 5
+#define PKL_AST_BUILTIN_TX_COMMIT 6
+#define PKL_AST_BUILTIN_TX_ROLLBACK 7
+#define PKL_AST_BUILTIN_IO_NEXT_DATA 8
 
 struct pkl_ast_comp_stmt
 {
@@ -388,6 +388,23 @@ PKL_PHASE_BEGIN_HANDLER (pkl_gen_ps_comp_stmt)
           pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_PUSH, pvm_make_int (1, 32));
           pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_RETURN);
           break;
+        case PKL_AST_BUILTIN_TX_BEGIN:
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_TXBEGIN);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_RETURN);
+          break;
+        case PKL_AST_BUILTIN_TX_COMMIT:
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_TXCOMMIT);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_RETURN);
+          break;
+        case PKL_AST_BUILTIN_TX_ROLLBACK:
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_TXROLLBACK);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_RETURN);
+          break;
+        case PKL_AST_BUILTIN_IO_NEXT_DATA:
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_PUSHVAR, 0, 0);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_IODATA);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_RETURN);
+          break;
         default:
           assert (0);
         }
@@ -1385,6 +1402,7 @@ PKL_PHASE_END_HANDLER
 
 /*
  * MAP
+ * | [MAP_IOS]
  * | MAP_OFFSET
  * | MAP_TYPE
  */
@@ -1393,17 +1411,47 @@ PKL_PHASE_BEGIN_HANDLER (pkl_gen_pr_map)
 {
   pkl_ast_node map = PKL_PASS_NODE;
   pkl_ast_node map_type = PKL_AST_MAP_TYPE (map);
+  pkl_ast_node map_ios = PKL_AST_MAP_IOS (map);
   pkl_ast_node map_offset = PKL_AST_MAP_OFFSET (map);
 
+  /* Save the IO space where values are mapped, if another one is
+     going to be selected.  */
+  if (map_ios)
+    pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_PUSHIOS); /* OLDIOS */
+
   /* Push the offset of the map.  */
   /* XXX converted to a bit-offset in an ulong<64>.  */
   /* XXX here we can assume the offset is offset<ulong<64>,b> as per
      promo.  */
   PKL_PASS_SUBPASS (map_offset);
 
+  /* Select the IO space of the map.  Note that this is done after
+     evaluating the offset, so maps in the offset expression use the
+     IO space in effect.  */
+  if (map_ios)
+    {
+      PKL_PASS_SUBPASS (map_ios);                  /* OLDIOS OFF IOS */
+      pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_POPIOS); /* OLDIOS OFF */
+    }
+
+  /* Values whose mapping doesn't depend on variables can be taken
+     from the cache of mapped values.  */
+  PKL_GEN_PAYLOAD->cache_map
+    = ((PKL_AST_TYPE_CODE (map_type) == PKL_TYPE_ARRAY
+        || PKL_AST_TYPE_CODE (map_type) == PKL_TYPE_STRUCT)
+       && pkl_ast_type_is_closed (map_type));
+
   PKL_GEN_PAYLOAD->in_mapper = 1;
   PKL_PASS_SUBPASS (map_type);
   PKL_GEN_PAYLOAD->in_mapper = 0;
+  PKL_GEN_PAYLOAD->cache_map = 0;
+
+  /* Restore the IO space where values are mapped.  */
+  if (map_ios)
+    {
+      pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_SWAP);  /* VAL OLDIOS */
+      pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_POPIOS); /* VAL */
+    }
 
   PKL_PASS_BREAK;
 }
@@ -1809,6 +1857,14 @@ PKL_PHASE_BEGIN_HANDLER (pkl_gen_pr_type_array)
       pvm_val array_type_mapper = PKL_AST_TYPE_A_MAPPER (array_type);
       pvm_val array_type_writer = PKL_AST_TYPE_A_WRITER (array_type);
 
+      int cache_map = PKL_GEN_PAYLOAD->cache_map;
+      jitter_label hit_label = pkl_asm_fresh_label (PKL_GEN_ASM);
+      jitter_label done_label = pkl_asm_fresh_label (PKL_GEN_ASM);
+
+      /* Note that the types mapped while generating this one, like
+         the type of the elements, are not cached.  */
+      PKL_GEN_PAYLOAD->cache_map = 0;
+
       if (PKL_GEN_PAYLOAD->in_valmapper)
         {
           pvm_val mapper_closure;
@@ -1909,6 +1965,16 @@ PKL_PHASE_BEGIN_HANDLER (pkl_gen_pr_type_array)
                                                          /* CLS OFF EBOUND CLS SBOUND */
 
           pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_SWAP);     /* CLS OFF EBOUND SBOUND CLS */
+
+          /* Take the value from the cache of mapped values if it is
+             there, and skip the call.  */
+          if (cache_map)
+            {
+              pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_MCGET); /* CLS OFF EBOUND SBOUND CLS VAL */
+              pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_BNN, hit_label);
+              pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);  /* CLS OFF EBOUND SBOUND CLS */
+            }
+
           pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_CALL);     /* CLS VAL */
 
           /* Install the mapper into the value.  */
@@ -1935,6 +2001,24 @@ PKL_PHASE_BEGIN_HANDLER (pkl_gen_pr_type_array)
         }
 
       pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_MSETW);                /* VAL */
+
+      if (cache_map)
+        {
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_MCPUT);   /* VAL */
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_BA, done_label);
+
+          /* The cached value has its mapper and writer already.  */
+          pkl_asm_label (PKL_GEN_ASM, hit_label);       /* CLS OFF EBOUND SBOUND CLS VAL */
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_TOR);     /* CLS OFF EBOUND SBOUND CLS */
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_FROMR);   /* VAL */
+          pkl_asm_label (PKL_GEN_ASM, done_label);
+        }
+
       /* Yay!, we are done ;) */
       PKL_PASS_BREAK;
     }
@@ -2067,6 +2151,13 @@ PKL_PHASE_BEGIN_HANDLER (pkl_gen_pr_type_struct)
       pvm_val type_struct_mapper = PKL_AST_TYPE_S_MAPPER (type_struct);
       pvm_val type_struct_writer = PKL_AST_TYPE_S_WRITER (type_struct);
 
+      int cache_map = PKL_GEN_PAYLOAD->cache_map;
+      jitter_label hit_label = pkl_asm_fresh_label (PKL_GEN_ASM);
+      jitter_label done_label = pkl_asm_fresh_label (PKL_GEN_ASM);
+
+      /* Note that the types of the fields are not cached.  */
+      PKL_GEN_PAYLOAD->cache_map = 0;
+
       if (type_struct_mapper != PVM_NULL)
         {
           pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_PUSH,
@@ -2094,6 +2185,16 @@ PKL_PHASE_BEGIN_HANDLER (pkl_gen_pr_type_struct)
       pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_PUSH, PVM_NULL);      /* CLS OFF EBOUND */
       pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_PUSH, PVM_NULL);      /* CLS OFF EBOUND SBOUND */
       pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_FROMR);               /* CLS OFF EBOUND SBOUND CLS */
+
+      /* Take the value from the cache of mapped values if it is
+         there, and skip the call.  */
+      if (cache_map)
+        {
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_MCGET);           /* CLS OFF EBOUND SBOUND CLS VAL */
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_BNN, hit_label);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);            /* CLS OFF EBOUND SBOUND CLS */
+        }
+
       pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_CALL);                /* CLS VAL */
 
       /* Install the mapper into the value.  */
@@ -2120,6 +2221,23 @@ PKL_PHASE_BEGIN_HANDLER (pkl_gen_pr_type_struct)
       /* Install the writer into the value.  */
       pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_MSETW);                /* VAL */
 
+      if (cache_map)
+        {
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_MCPUT);            /* VAL */
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_BA, done_label);
+
+          /* The cached value has its mapper and writer already.  */
+          pkl_asm_label (PKL_GEN_ASM, hit_label);                /* CLS OFF EBOUND SBOUND CLS VAL */
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_TOR);              /* CLS OFF EBOUND SBOUND CLS */
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_DROP);
+          pkl_asm_insn (PKL_GEN_ASM, PKL_INSN_FROMR);            /* VAL */
+          pkl_asm_label (PKL_GEN_ASM, done_label);
+        }
+
       /* And we are done.  */
       PKL_PASS_BREAK;
     }
@@ -77,6 +77,10 @@
    IN_ARRAY_BOUNDER is 1 when an array bounder function is being
    generated.  0 otherwise.
 
+   CACHE_MAP is 1 when the array or struct type being generated is the
+   type of a map operator, and the mapped value can be taken from the
+   cache of mapped values.  0 otherwise.
+
    ENDIAN is the endianness to be used when mapping and writing
    integral types.  */
 
@@ -96,6 +100,7 @@ struct pkl_gen_payload
   int in_valmapper;
   int in_lvalue;
   int in_array_bounder;
+  int cache_map;
   int endian;
 };
 
@@ -1196,14 +1196,26 @@ PKL_PHASE_BEGIN_HANDLER (pkl_promo_ps_func_arg)
 }
 PKL_PHASE_END_HANDLER
 
-/* The offsets in maps should be promoted to offset<uint<64>,b>.  This
-   is expected by the code generator and the run-time.  */
+/* The offsets in maps should be promoted to offset<uint<64>,b>, and
+   the IO space identifiers to int<32>.  This is expected by the code
+   generator and the run-time.  */
 
 PKL_PHASE_BEGIN_HANDLER (pkl_promo_ps_map)
 {
   pkl_ast_node map = PKL_PASS_NODE;
+  pkl_ast_node map_ios = PKL_AST_MAP_IOS (map);
   pkl_ast_node map_offset = PKL_AST_MAP_OFFSET (map);
-  int restart;
+  int restart, restart_ios = 0;
+
+  if (map_ios
+      && !promote_integral (PKL_PASS_AST, 32, 1,
+                            &PKL_AST_MAP_IOS (map), &restart_ios))
+    {
+      pkl_ice (PKL_PASS_AST, PKL_AST_LOC (map_ios),
+               "couldn't promote IO space of map #%" PRIu64,
+               PKL_AST_UID (map));
+      PKL_PASS_ERROR;
+    }
 
   if (!promote_offset (PKL_PASS_AST,
                        64, 0, 1,
@@ -1216,7 +1228,7 @@ PKL_PHASE_BEGIN_HANDLER (pkl_promo_ps_map)
       PKL_PASS_ERROR;
     }
 
-  PKL_PASS_RESTART = restart;
+  PKL_PASS_RESTART = restart || restart_ios;
 }
 PKL_PHASE_END_HANDLER
 
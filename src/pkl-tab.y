@@ -239,6 +239,8 @@ pkl_register_dummies (struct pkl_parser *parser, int n)
 %token PRINTF
 %token UNMAP
 %token BUILTIN_RAND BUILTIN_GET_ENDIAN BUILTIN_SET_ENDIAN
+%token BUILTIN_TX_BEGIN BUILTIN_TX_COMMIT BUILTIN_TX_ROLLBACK
+%token BUILTIN_IO_NEXT_DATA
 
 /* ATTRIBUTE operator.  */
 
@@ -638,7 +640,14 @@ bconc:
 map:
           simple_type_specifier '@' expression
                 {
-                    $$ = pkl_ast_make_map (pkl_parser->ast, $1, $3);
+                    $$ = pkl_ast_make_map (pkl_parser->ast, $1,
+                                           NULL, $3);
+                    PKL_AST_LOC ($$) = @$;
+                }
+        | simple_type_specifier '@' '(' expression ':' expression ')'
+                {
+                    $$ = pkl_ast_make_map (pkl_parser->ast, $1,
+                                           $4, $6);
                     PKL_AST_LOC ($$) = @$;
                 }
 
@@ -1347,6 +1356,10 @@ builtin:
 	  BUILTIN_RAND		{ $$ = PKL_AST_BUILTIN_RAND; }
 	| BUILTIN_GET_ENDIAN	{ $$ = PKL_AST_BUILTIN_GET_ENDIAN; }
 	| BUILTIN_SET_ENDIAN	{ $$ = PKL_AST_BUILTIN_SET_ENDIAN; }
+	| BUILTIN_TX_BEGIN	{ $$ = PKL_AST_BUILTIN_TX_BEGIN; }
+	| BUILTIN_TX_COMMIT	{ $$ = PKL_AST_BUILTIN_TX_COMMIT; }
+	| BUILTIN_TX_ROLLBACK	{ $$ = PKL_AST_BUILTIN_TX_ROLLBACK; }
+	| BUILTIN_IO_NEXT_DATA	{ $$ = PKL_AST_BUILTIN_IO_NEXT_DATA; }
 	;
 
 stmt_decl_list:
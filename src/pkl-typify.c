@@ -1424,15 +1424,26 @@ PKL_PHASE_BEGIN_HANDLER (pkl_typify1_ps_type_array)
 PKL_PHASE_END_HANDLER
 
 /* The type of a map is the type of the mapped value.  The expression
-   in a map should be an offset.  */
+   in a map should be an offset, and the IO space, if specified, an
+   integral identifier.  */
 
 PKL_PHASE_BEGIN_HANDLER (pkl_typify1_ps_map)
 {
   pkl_ast_node map = PKL_PASS_NODE;
   pkl_ast_node map_type = PKL_AST_MAP_TYPE (map);
+  pkl_ast_node map_ios = PKL_AST_MAP_IOS (map);
   pkl_ast_node map_offset = PKL_AST_MAP_OFFSET (map);
   pkl_ast_node map_offset_type = PKL_AST_TYPE (map_offset);
 
+  if (map_ios
+      && PKL_AST_TYPE_CODE (PKL_AST_TYPE (map_ios)) != PKL_TYPE_INTEGRAL)
+    {
+      PKL_ERROR (PKL_AST_LOC (map_ios),
+                 "expected integral IO space identifier");
+      PKL_TYPIFY_PAYLOAD->errors++;
+      PKL_PASS_ERROR;
+    }
+
   if (PKL_AST_TYPE_CODE (map_offset_type) != PKL_TYPE_OFFSET)
     {
       PKL_ERROR (PKL_AST_LOC (map_offset),
@@ -26,6 +26,12 @@ pvm_alloc (size_t size)
   return GC_MALLOC (size);
 }
 
+void *
+pvm_alloc_atomic (size_t size)
+{
+  return GC_MALLOC_ATOMIC (size);
+}
+
 char *
 pvm_alloc_strdup (const char *string)
 {
@@ -49,6 +55,19 @@ pvm_alloc_cls (void)
   return cls;
 }
 
+void
+pvm_alloc_register_weak (void **link, void *object)
+{
+  *link = object;
+  GC_general_register_disappearing_link (link, object);
+}
+
+void
+pvm_alloc_unregister_weak (void **link)
+{
+  GC_unregister_disappearing_link (link);
+}
+
 void
 pvm_alloc_initialize ()
 {
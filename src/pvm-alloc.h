@@ -44,6 +44,12 @@ void pvm_alloc_remove_gc_roots (void *pointer, size_t nelems);
 
 void *pvm_alloc (size_t size);
 
+/* Likewise, but the allocated memory shall not contain pointers to
+   memory allocated by pvm_alloc_*, so the garbage collector doesn't
+   have to scan it.  This is suitable for big buffers of raw data.  */
+
+void *pvm_alloc_atomic (size_t size);
+
 /* Allocate a pvm_cls struct and return a pointer to the allocated
    memory.  This type-specific allocator is needed because the GC
    needs additional information to free these structs.  */
@@ -55,6 +61,15 @@ void *pvm_alloc_cls (void);
 
 char *pvm_alloc_strdup (const char *string);
 
+/* Make the pointer at LINK, which shall not be scanned by the
+   garbage collector, a weak reference to OBJECT, which was allocated
+   by pvm_alloc_*: it doesn't keep OBJECT alive, and it is set to NULL
+   when OBJECT is collected.  pvm_alloc_unregister_weak shall be
+   called before disposing LINK.  */
+
+void pvm_alloc_register_weak (void **link, void *object);
+void pvm_alloc_unregister_weak (void **link);
+
 /* Forced collection.  */
 
 void pvm_alloc_gc (void);
@@ -0,0 +1,396 @@
+/* pvm-cache.c - Cache of mapped values for the PVM.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "ios.h"
+#include "pvm-val.h"
+#include "pvm-alloc.h"
+#include "pvm-cache.h"
+
+/* The cached values are kept in a hash table, chained through CHAIN,
+   and in a list sorted by the time they were last used, from OLDER to
+   NEWER, which tells which ones to evict first.
+
+   IOS_ID, OFFSET and MAPPER are the key of the entry, as described in
+   pvm-cache.h.  The bounds of arrays are compared against the ones of
+   the value itself.  SIZE is the estimated number of bytes used by
+   VAL.
+
+   The entries are allocated with pvm_alloc, and they are kept alive
+   by the hash table, which is registered as a root for the garbage
+   collector.  */
+
+#define PVM_CACHE_BUCKETS 1024
+
+struct pvm_cache_entry
+{
+  int ios_id;
+  uint64_t offset;
+  pvm_val mapper;
+  pvm_val val;
+  size_t size;
+  struct pvm_cache_entry *chain;
+  struct pvm_cache_entry *older;
+  struct pvm_cache_entry *newer;
+};
+
+static struct pvm_cache_entry *pvm_cache_buckets[PVM_CACHE_BUCKETS];
+static struct pvm_cache_entry *pvm_cache_oldest;
+static struct pvm_cache_entry *pvm_cache_newest;
+static struct pvm_cache_stats pvm_cache_stats;
+
+static size_t
+pvm_cache_hash (int ios_id, uint64_t offset, pvm_val mapper)
+{
+  uint64_t hash = offset * 0x9e3779b97f4a7c15ULL;
+
+  hash ^= (uint64_t) mapper + (hash << 6) + (hash >> 2);
+  hash ^= (uint64_t) ios_id + (hash << 6) + (hash >> 2);
+  return hash % PVM_CACHE_BUCKETS;
+}
+
+static uint64_t
+pvm_cache_offset_bits (pvm_val offset)
+{
+  return (PVM_VAL_INTEGRAL (PVM_VAL_OFF_MAGNITUDE (offset))
+          * PVM_VAL_INTEGRAL (PVM_VAL_OFF_UNIT (offset)));
+}
+
+/* Return 1 if the map bounds A and B are the same, 0 otherwise.
+   OFFSET_P is 1 if the bounds are offsets, 0 if they are numbers of
+   elements.  */
+
+static int
+pvm_cache_bound_eq (pvm_val a, pvm_val b, int offset_p)
+{
+  if (a == PVM_NULL || b == PVM_NULL)
+    return a == b;
+
+  if (offset_p)
+    return pvm_cache_offset_bits (a) == pvm_cache_offset_bits (b);
+  else
+    return PVM_VAL_INTEGRAL (a) == PVM_VAL_INTEGRAL (b);
+}
+
+/* Return 1 if the value in ENTRY is still mapped where the key of
+   ENTRY says, none of the bytes it covers have been written since it
+   was mapped, and it was mapped with the endianness ENDIAN and the
+   negative encoding NENC.  Return 0 otherwise.  */
+
+static int
+pvm_cache_fresh_p (struct pvm_cache_entry *entry,
+                   enum ios_endian endian, enum ios_nenc nenc)
+{
+  pvm_val val = entry->val;
+  pvm_val ios_id = PVM_VAL_IOS (val);
+  pvm_val offset = PVM_VAL_OFFSET (val);
+  pvm_val mapid = PVM_VAL_MAPID (val);
+  ios io;
+
+  if (ios_id == PVM_NULL || offset == PVM_NULL || mapid == PVM_NULL
+      || PVM_VAL_INT (ios_id) != entry->ios_id
+      || pvm_cache_offset_bits (offset) != entry->offset
+      || PVM_VAL_MAPPER (val) != entry->mapper)
+    return 0;
+
+  io = ios_get (entry->ios_id);
+  return (io != NULL
+          && ios_update_fresh_p (io, PVM_VAL_ULONG (mapid), endian, nenc));
+}
+
+/* Estimate the number of bytes of memory used by the value VAL,
+   including the values it contains.  Types and closures are shared
+   by many values, and are not counted.  The elements of arrays mapped
+   lazily are not in memory yet.  */
+
+static size_t
+pvm_cache_val_size (pvm_val val)
+{
+  size_t size;
+  uint64_t i, n;
+
+  if (val == PVM_NULL || PVM_IS_INT (val) || PVM_IS_UINT (val))
+    return 0;
+
+  if (PVM_IS_LONG (val) || PVM_IS_ULONG (val))
+    return 2 * sizeof (int64_t);
+
+  if (PVM_IS_STR (val))
+    return sizeof (struct pvm_val_box) + strlen (PVM_VAL_STR (val)) + 1;
+
+  if (PVM_IS_OFF (val))
+    return (sizeof (struct pvm_val_box) + sizeof (struct pvm_off)
+            + pvm_cache_val_size (PVM_VAL_OFF_MAGNITUDE (val)));
+
+  if (PVM_IS_ARR (val))
+    {
+      pvm_array arr = PVM_VAL_ARR (val);
+
+      n = PVM_VAL_ULONG (arr->nelem);
+      size = sizeof (struct pvm_val_box) + sizeof (struct pvm_array);
+      if (arr->lazy != NULL)
+        size += sizeof (struct pvm_array_lazy);
+      else if (arr->packed != NULL)
+        size += sizeof (struct pvm_array_packed) + n * arr->packed->width;
+      else
+        {
+          size += n * sizeof (struct pvm_array_elem);
+          for (i = 0; i < n; ++i)
+            size += (pvm_cache_val_size (arr->elems[i].value)
+                     + pvm_cache_val_size (arr->elems[i].offset));
+        }
+
+      return size;
+    }
+
+  if (PVM_IS_SCT (val))
+    {
+      n = PVM_VAL_ULONG (PVM_VAL_SCT_NFIELDS (val));
+      size = (sizeof (struct pvm_val_box) + sizeof (struct pvm_struct)
+              + n * sizeof (struct pvm_struct_field)
+              + (PVM_VAL_ULONG (PVM_VAL_SCT_NMETHODS (val))
+                 * sizeof (struct pvm_struct_method)));
+      for (i = 0; i < n; ++i)
+        size += (pvm_cache_val_size (PVM_VAL_SCT_FIELD_VALUE (val, i))
+                 + pvm_cache_val_size (PVM_VAL_SCT_FIELD_OFFSET (val, i)));
+
+      return size;
+    }
+
+  return 0;
+}
+
+/* Return a copy of the array or struct VAL, and of the arrays and
+   structs it contains, so the copy can be changed without affecting
+   VAL, and the other way around.  Other values can't be changed, and
+   are shared.  */
+
+static pvm_val
+pvm_cache_copy (pvm_val val)
+{
+  pvm_val copy;
+  uint64_t i, n;
+
+  if (PVM_IS_ARR (val))
+    {
+      pvm_array arr;
+
+      copy = pvm_val_copy (val);
+      arr = PVM_VAL_ARR (copy);
+      if (arr->elems != NULL)
+        {
+          n = PVM_VAL_ULONG (arr->nelem);
+          for (i = 0; i < n; ++i)
+            arr->elems[i].value = pvm_cache_copy (arr->elems[i].value);
+        }
+    }
+  else if (PVM_IS_SCT (val))
+    {
+      copy = pvm_val_copy (val);
+      n = PVM_VAL_ULONG (PVM_VAL_SCT_NFIELDS (copy));
+      for (i = 0; i < n; ++i)
+        PVM_VAL_SCT_FIELD_VALUE (copy, i)
+          = pvm_cache_copy (PVM_VAL_SCT_FIELD_VALUE (copy, i));
+    }
+  else
+    copy = val;
+
+  return copy;
+}
+
+static void
+pvm_cache_unlink (struct pvm_cache_entry *entry)
+{
+  if (entry->older)
+    entry->older->newer = entry->newer;
+  else
+    pvm_cache_oldest = entry->newer;
+
+  if (entry->newer)
+    entry->newer->older = entry->older;
+  else
+    pvm_cache_newest = entry->older;
+
+  entry->older = entry->newer = NULL;
+}
+
+static void
+pvm_cache_link_newest (struct pvm_cache_entry *entry)
+{
+  entry->older = pvm_cache_newest;
+  entry->newer = NULL;
+
+  if (pvm_cache_newest)
+    pvm_cache_newest->newer = entry;
+  else
+    pvm_cache_oldest = entry;
+  pvm_cache_newest = entry;
+}
+
+static void
+pvm_cache_remove (struct pvm_cache_entry *entry)
+{
+  struct pvm_cache_entry **p
+    = &pvm_cache_buckets[pvm_cache_hash (entry->ios_id, entry->offset,
+                                         entry->mapper)];
+
+  while (*p != entry)
+    p = &(*p)->chain;
+  *p = entry->chain;
+
+  pvm_cache_unlink (entry);
+  pvm_cache_stats.entries--;
+  pvm_cache_stats.size -= entry->size;
+}
+
+void
+pvm_cache_initialize (void)
+{
+  memset (pvm_cache_buckets, 0, sizeof (pvm_cache_buckets));
+  pvm_cache_oldest = pvm_cache_newest = NULL;
+  memset (&pvm_cache_stats, 0, sizeof (pvm_cache_stats));
+  pvm_cache_stats.budget = PVM_CACHE_BUDGET;
+
+  pvm_alloc_add_gc_roots (pvm_cache_buckets, PVM_CACHE_BUCKETS);
+}
+
+void
+pvm_cache_finalize (void)
+{
+  pvm_cache_flush ();
+  pvm_alloc_remove_gc_roots (pvm_cache_buckets, PVM_CACHE_BUCKETS);
+}
+
+pvm_val
+pvm_cache_lookup (int ios_id, uint64_t offset, pvm_val mapper,
+                  pvm_val ebound, pvm_val sbound,
+                  enum ios_endian endian, enum ios_nenc nenc)
+{
+  struct pvm_cache_entry *entry
+    = pvm_cache_buckets[pvm_cache_hash (ios_id, offset, mapper)];
+
+  for (; entry; entry = entry->chain)
+    {
+      if (entry->ios_id != ios_id
+          || entry->offset != offset
+          || entry->mapper != mapper
+          || !pvm_cache_bound_eq (PVM_VAL_ELEMS_BOUND (entry->val),
+                                  ebound, 0)
+          || !pvm_cache_bound_eq (PVM_VAL_SIZE_BOUND (entry->val),
+                                  sbound, 1))
+        continue;
+
+      /* Values whose bytes have been written, or that were mapped
+         with another endianness or negative encoding, are mapped
+         again.  */
+      if (!pvm_cache_fresh_p (entry, endian, nenc))
+        {
+          pvm_cache_remove (entry);
+          break;
+        }
+
+      pvm_cache_unlink (entry);
+      pvm_cache_link_newest (entry);
+      pvm_cache_stats.hits++;
+      return pvm_cache_copy (entry->val);
+    }
+
+  pvm_cache_stats.misses++;
+  return PVM_NULL;
+}
+
+void
+pvm_cache_insert (pvm_val val)
+{
+  struct pvm_cache_entry *entry, **bucket;
+  pvm_val ios_id, offset, mapper;
+  uint64_t bit_offset;
+  size_t size;
+
+  if (!PVM_IS_ARR (val) && !PVM_IS_SCT (val))
+    return;
+
+  ios_id = PVM_VAL_IOS (val);
+  offset = PVM_VAL_OFFSET (val);
+  mapper = PVM_VAL_MAPPER (val);
+  if (ios_id == PVM_NULL || offset == PVM_NULL || mapper == PVM_NULL
+      || PVM_VAL_MAPID (val) == PVM_NULL)
+    return;
+
+  size = pvm_cache_val_size (val);
+  if (size > PVM_CACHE_BUDGET)
+    return;
+
+  /* Replace the value mapped previously with the same key, if
+     any.  */
+  bit_offset = pvm_cache_offset_bits (offset);
+  bucket = &pvm_cache_buckets[pvm_cache_hash (PVM_VAL_INT (ios_id),
+                                              bit_offset, mapper)];
+  for (entry = *bucket; entry; entry = entry->chain)
+    if (entry->ios_id == PVM_VAL_INT (ios_id)
+        && entry->offset == bit_offset
+        && entry->mapper == mapper
+        && pvm_cache_bound_eq (PVM_VAL_ELEMS_BOUND (entry->val),
+                               PVM_VAL_ELEMS_BOUND (val), 0)
+        && pvm_cache_bound_eq (PVM_VAL_SIZE_BOUND (entry->val),
+                               PVM_VAL_SIZE_BOUND (val), 1))
+      {
+        pvm_cache_remove (entry);
+        break;
+      }
+
+  /* Make room for the new value.  */
+  while (pvm_cache_oldest
+         && (pvm_cache_stats.size + size > PVM_CACHE_BUDGET
+             || pvm_cache_stats.entries >= PVM_CACHE_MAX_ENTRIES))
+    {
+      pvm_cache_remove (pvm_cache_oldest);
+      pvm_cache_stats.evictions++;
+    }
+
+  entry = pvm_alloc (sizeof (struct pvm_cache_entry));
+  entry->ios_id = PVM_VAL_INT (ios_id);
+  entry->offset = bit_offset;
+  entry->mapper = mapper;
+  entry->val = pvm_cache_copy (val);
+  entry->size = size;
+  entry->chain = *bucket;
+  *bucket = entry;
+  pvm_cache_link_newest (entry);
+
+  pvm_cache_stats.entries++;
+  pvm_cache_stats.size += size;
+}
+
+void
+pvm_cache_flush (void)
+{
+  memset (pvm_cache_buckets, 0, sizeof (pvm_cache_buckets));
+  pvm_cache_oldest = pvm_cache_newest = NULL;
+  pvm_cache_stats.entries = 0;
+  pvm_cache_stats.size = 0;
+}
+
+void
+pvm_cache_get_stats (struct pvm_cache_stats *stats)
+{
+  *stats = pvm_cache_stats;
+}
@@ -0,0 +1,109 @@
+/* pvm-cache.h - Cache of mapped values for the PVM.  */
+
+/* Copyright (C) 2019 Jose E. Marchesi */
+
+/* This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PVM_CACHE_H
+#define PVM_CACHE_H
+
+#include <config.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ios.h"
+#include "pvm-val.h"
+
+/* Mapping the same type at the same place of an IO space over and
+   over, like a function that maps a table of headers every time it is
+   called, yields values with the same contents as long as the mapped
+   bytes are not written.  The PVM keeps a cache of the arrays and
+   structs it maps, so they can be reused instead of being mapped
+   again.
+
+   The cached values are identified by the IO space and the bit offset
+   where they are mapped, the mapper closure that mapped them, which
+   stands for their type, and the number of elements or the size to
+   which mapped arrays are bounded.  A cached value is only reused if
+   it is still up to date in the update index of its IO space (see
+   ios_update_register); otherwise it is forgotten and the value is
+   mapped again.
+
+   The cache keeps its own copies of the values, and hands out copies
+   of them, so the values obtained by different map operations never
+   share memory, like when they are mapped from scratch.
+
+   The compiler only uses the cache for types whose mapping doesn't
+   depend on variables, since the mapper closure alone can't tell the
+   values of those.
+
+   The memory used by the cached values, as estimated from their
+   contents, is bounded by PVM_CACHE_BUDGET bytes, and their number
+   by PVM_CACHE_MAX_ENTRIES, since the update indexes don't hold more
+   than that anyway.  When either limit is exceeded, the values that
+   were used the longest ago are evicted.  */
+
+#define PVM_CACHE_BUDGET (8 * 1024 * 1024)
+#define PVM_CACHE_MAX_ENTRIES 16384
+
+/* Initialize and finalize the cache, respectively.  */
+
+void pvm_cache_initialize (void);
+void pvm_cache_finalize (void);
+
+/* Return the value mapped by the closure MAPPER at the bit offset
+   OFFSET of the IO space with identifier IOS_ID, bounded by EBOUND
+   elements or SBOUND bits, either of which can be PVM_NULL, if it is
+   in the cache and up to date for the current endianness ENDIAN and
+   negative encoding NENC.  The value returned is a copy of the cached
+   one.  Return PVM_NULL otherwise.  */
+
+pvm_val pvm_cache_lookup (int ios_id, uint64_t offset, pvm_val mapper,
+                          pvm_val ebound, pvm_val sbound,
+                          enum ios_endian endian, enum ios_nenc nenc);
+
+/* Add a copy of the mapped array or struct VAL to the cache.  The
+   key is obtained from the mapping attributes of VAL.  Values that
+   are not mapped, not registered in the update index of their IO
+   space, or too big for the cache, are ignored.  */
+
+void pvm_cache_insert (pvm_val val);
+
+/* Forget all the values in the cache.  */
+
+void pvm_cache_flush (void);
+
+/* Statistics of the cache.
+
+   HITS and MISSES are the number of lookups that found a value and
+   that didn't, respectively.  EVICTIONS is the number of values that
+   were forgotten to honor the budget.
+
+   ENTRIES is the number of values currently in the cache, and SIZE
+   the number of bytes they are estimated to use, out of BUDGET.  */
+
+struct pvm_cache_stats
+{
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  size_t entries;
+  size_t size;
+  size_t budget;
+};
+
+void pvm_cache_get_stats (struct pvm_cache_stats *stats);
+
+#endif /* ! PVM_CACHE_H */
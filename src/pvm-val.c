@@ -95,12 +95,16 @@ pvm_make_array (pvm_val nelem, pvm_val type)
   size_t i;
 
   arr->offset = PVM_NULL;
+  arr->ios = PVM_NULL;
+  arr->mapid = PVM_NULL;
   arr->elems_bound = PVM_NULL;
   arr->size_bound = PVM_NULL;
   arr->mapper = PVM_NULL;
   arr->writer = PVM_NULL;
   arr->nelem = nelem;
   arr->type = type;
+  arr->lazy = NULL;
+  arr->packed = NULL;
   arr->elems = pvm_alloc (nbytes);
 
   for (i = 0; i < PVM_VAL_ULONG (nelem); ++i)
@@ -113,6 +117,653 @@ pvm_make_array (pvm_val nelem, pvm_val type)
   return PVM_BOX (box);
 }
 
+/* Arrays mapped lazily, which are read into memory when the IO space
+   they are mapped from is closed.  The links are allocated with
+   malloc, so the garbage collector doesn't scan them: they don't keep
+   the arrays alive, and they are set to NULL when the arrays are
+   collected.  The dead links are purged whenever the number of links
+   doubles.  */
+
+struct pvm_lazy_link
+{
+  pvm_array arr;
+  int ios_id;
+  struct pvm_lazy_link *next;
+};
+
+#define PVM_LAZY_MIN_LINKS 64
+
+static struct pvm_lazy_link *lazy_links;
+static size_t lazy_num_links;
+static size_t lazy_max_links = PVM_LAZY_MIN_LINKS;
+
+static void
+pvm_lazy_unlink (struct pvm_lazy_link **p)
+{
+  struct pvm_lazy_link *link = *p;
+
+  pvm_alloc_unregister_weak ((void **) &link->arr);
+  *p = link->next;
+  free (link);
+  lazy_num_links--;
+}
+
+static void
+pvm_lazy_link (pvm_array arr, int ios_id)
+{
+  struct pvm_lazy_link *link, **p;
+
+  if (lazy_num_links >= lazy_max_links)
+    {
+      for (p = &lazy_links; *p != NULL;)
+        {
+          if ((*p)->arr == NULL || (*p)->arr->lazy == NULL)
+            pvm_lazy_unlink (p);
+          else
+            p = &(*p)->next;
+        }
+
+      lazy_max_links = 2 * lazy_num_links;
+      if (lazy_max_links < PVM_LAZY_MIN_LINKS)
+        lazy_max_links = PVM_LAZY_MIN_LINKS;
+    }
+
+  link = xmalloc (sizeof (struct pvm_lazy_link));
+  pvm_alloc_register_weak ((void **) &link->arr, arr);
+  link->ios_id = ios_id;
+  link->next = lazy_links;
+  lazy_links = link;
+  lazy_num_links++;
+}
+
+pvm_val
+pvm_make_lazy_array (pvm_val nelem, pvm_val type, pvm_val offset,
+                     int ios_id, int endian, int nenc)
+{
+  pvm_val_box box = pvm_make_box (PVM_VAL_TAG_ARR);
+  pvm_array arr = pvm_alloc (sizeof (struct pvm_array));
+  struct pvm_array_lazy *lazy = pvm_alloc (sizeof (struct pvm_array_lazy));
+  pvm_val etype = PVM_VAL_TYP_A_ETYPE (type);
+  pvm_val itype = etype;
+  size_t i;
+
+  if (PVM_VAL_TYP_CODE (etype) == PVM_TYPE_OFFSET)
+    itype = PVM_VAL_TYP_O_BASE_TYPE (etype);
+  assert (PVM_VAL_TYP_CODE (itype) == PVM_TYPE_INTEGRAL);
+
+  lazy->offset = (PVM_VAL_ULONG (PVM_VAL_OFF_MAGNITUDE (offset))
+                  * PVM_VAL_ULONG (PVM_VAL_OFF_UNIT (offset)));
+  lazy->elem_size = PVM_VAL_ULONG (PVM_VAL_TYP_I_SIZE (itype));
+  lazy->etype = etype;
+  lazy->ios_id = ios_id;
+  lazy->endian = endian;
+  lazy->nenc = nenc;
+  lazy->mapid = 0;
+  for (i = 0; i < PVM_ARRAY_LAZY_CACHE_SIZE; ++i)
+    lazy->cache_val[i] = PVM_NULL;
+
+  arr->offset = offset;
+  arr->ios = PVM_NULL;
+  arr->mapid = PVM_NULL;
+  arr->elems_bound = PVM_NULL;
+  arr->size_bound = PVM_NULL;
+  arr->mapper = PVM_NULL;
+  arr->writer = PVM_NULL;
+  arr->nelem = nelem;
+  arr->type = type;
+  arr->elems = NULL;
+  arr->lazy = lazy;
+  arr->packed = NULL;
+
+  pvm_lazy_link (arr, ios_id);
+
+  PVM_VAL_BOX_ARR (box) = arr;
+  return PVM_BOX (box);
+}
+
+/* Return an integer of SIZE bits holding RAW, which is signed if
+   SIGNED_P.  The bits of RAW beyond SIZE are ignored.  */
+
+static pvm_val
+pvm_make_raw_integral (uint64_t raw, int size, int signed_p)
+{
+  if (signed_p)
+    {
+      int64_t value = (int64_t) (raw << (64 - size)) >> (64 - size);
+
+      return (size <= 32
+              ? pvm_make_int (value, size)
+              : pvm_make_long (value, size));
+    }
+  else
+    return (size <= 32
+            ? pvm_make_uint (raw, size)
+            : pvm_make_ulong (raw, size));
+}
+
+/* Empty the cache of the lazily mapped array described by LAZY, whose
+   NELEM elements are read from IO, if some of them have been written
+   since they were cached.  This way the array never mixes old and new
+   contents.  */
+
+static void
+pvm_array_lazy_refresh (struct pvm_array_lazy *lazy, ios io,
+                        uint64_t nelem)
+{
+  size_t i;
+
+  if (lazy->mapid != 0
+      && ios_update_fresh_p (io, lazy->mapid, lazy->endian, lazy->nenc))
+    return;
+
+  for (i = 0; i < PVM_ARRAY_LAZY_CACHE_SIZE; ++i)
+    lazy->cache_val[i] = PVM_NULL;
+
+  /* Values mapped from volatile devices are never registered, and so
+     their elements are read every time.  */
+  lazy->mapid = ios_update_register (io, lazy->offset,
+                                     nelem * lazy->elem_size,
+                                     lazy->endian, lazy->nenc);
+}
+
+/* Read the COUNT integers underlying the elements starting at FIRST
+   of the lazily mapped array described by LAZY from IO, and put them
+   in RAW.  Return an IOS status code.  */
+
+static int
+pvm_array_lazy_read_raw (struct pvm_array_lazy *lazy, uint64_t first,
+                         size_t count, uint64_t *raw, int signed_p)
+{
+  ios io = ios_get (lazy->ios_id);
+  ios_off offset = lazy->offset + first * lazy->elem_size;
+
+  if (io == NULL)
+    return IOS_ERROR;
+
+  /* Read all the elements at once.  */
+  if (signed_p)
+    return ios_read_int_array (io, offset, 0, lazy->elem_size,
+                               lazy->endian, lazy->nenc, count,
+                               (int64_t *) raw);
+  else
+    return ios_read_uint_array (io, offset, 0, lazy->elem_size,
+                                lazy->endian, count, raw);
+}
+
+/* Read the COUNT elements starting at FIRST of the lazily mapped
+   array described by LAZY from IO, and put them in VALUES.  COUNT
+   should not exceed PVM_ARRAY_LAZY_CACHE_SIZE.  Return an IOS status
+   code.  */
+
+static int
+pvm_array_lazy_read (struct pvm_array_lazy *lazy, uint64_t first,
+                     size_t count, pvm_val *values)
+{
+  pvm_val etype = lazy->etype;
+  pvm_val itype = etype;
+  uint64_t raw[PVM_ARRAY_LAZY_CACHE_SIZE];
+  int signed_p;
+  size_t i;
+  int ret;
+
+  assert (count <= PVM_ARRAY_LAZY_CACHE_SIZE);
+
+  if (PVM_VAL_TYP_CODE (etype) == PVM_TYPE_OFFSET)
+    itype = PVM_VAL_TYP_O_BASE_TYPE (etype);
+  signed_p = PVM_VAL_UINT (PVM_VAL_TYP_I_SIGNED (itype));
+
+  ret = pvm_array_lazy_read_raw (lazy, first, count, raw, signed_p);
+  if (ret != IOS_OK)
+    return ret;
+
+  for (i = 0; i < count; ++i)
+    {
+      pvm_val val = pvm_make_raw_integral (raw[i], lazy->elem_size,
+                                           signed_p);
+
+      if (PVM_VAL_TYP_CODE (etype) == PVM_TYPE_OFFSET)
+        val = pvm_make_offset (val, PVM_VAL_TYP_O_UNIT (etype));
+      values[i] = val;
+    }
+
+  return IOS_OK;
+}
+
+/* Return the number of bytes used to store each integer of SIZE bits
+   in a packed array.  */
+
+static int
+pvm_array_packed_width (int size)
+{
+  return size <= 8 ? 1 : size <= 16 ? 2 : size <= 32 ? 4 : 8;
+}
+
+/* Make an empty packed array storage for NELEM integers of SIZE bits,
+   signed if SIGNED_P.  */
+
+static struct pvm_array_packed *
+pvm_make_array_packed (uint64_t nelem, int size, int signed_p)
+{
+  struct pvm_array_packed *packed
+    = pvm_alloc (sizeof (struct pvm_array_packed));
+
+  packed->size = size;
+  packed->signed_p = signed_p;
+  packed->width = pvm_array_packed_width (size);
+  packed->mapped_p = 0;
+  packed->offset = 0;
+  packed->data = pvm_alloc_atomic (nelem * packed->width);
+  return packed;
+}
+
+static uint64_t
+pvm_array_packed_get (struct pvm_array_packed *packed, uint64_t idx)
+{
+  switch (packed->width)
+    {
+    case 1: return ((uint8_t *) packed->data)[idx];
+    case 2: return ((uint16_t *) packed->data)[idx];
+    case 4: return ((uint32_t *) packed->data)[idx];
+    default: return ((uint64_t *) packed->data)[idx];
+    }
+}
+
+static void
+pvm_array_packed_put (struct pvm_array_packed *packed, uint64_t idx,
+                      uint64_t raw)
+{
+  switch (packed->width)
+    {
+    case 1: ((uint8_t *) packed->data)[idx] = raw; break;
+    case 2: ((uint16_t *) packed->data)[idx] = raw; break;
+    case 4: ((uint32_t *) packed->data)[idx] = raw; break;
+    default: ((uint64_t *) packed->data)[idx] = raw; break;
+    }
+}
+
+/* Return 1 if VALUE can be stored in the packed array storage PACKED,
+   i.e. if it is an integer of the right size and signedness.  Return
+   0 otherwise.  */
+
+static int
+pvm_array_packed_fits_p (struct pvm_array_packed *packed, pvm_val value)
+{
+  int size = packed->size;
+
+  if (size <= 32)
+    return (packed->signed_p
+            ? PVM_IS_INT (value) && PVM_VAL_INT_SIZE (value) == size
+            : PVM_IS_UINT (value) && PVM_VAL_UINT_SIZE (value) == size);
+  else
+    return (packed->signed_p
+            ? PVM_IS_LONG (value) && PVM_VAL_LONG_SIZE (value) == size
+            : PVM_IS_ULONG (value) && PVM_VAL_ULONG_SIZE (value) == size);
+}
+
+/* Return the bits of the integer VALUE.  */
+
+static uint64_t
+pvm_array_packed_raw (pvm_val value)
+{
+  if (PVM_IS_INT (value))
+    return PVM_VAL_INT (value);
+  else if (PVM_IS_UINT (value))
+    return PVM_VAL_UINT (value);
+  else if (PVM_IS_LONG (value))
+    return PVM_VAL_LONG (value);
+  else
+    return PVM_VAL_ULONG (value);
+}
+
+/* Return the bit offset denoted by the offset value OFFSET.  */
+
+static uint64_t
+pvm_offset_bits (pvm_val offset)
+{
+  return (PVM_VAL_INTEGRAL (PVM_VAL_OFF_MAGNITUDE (offset))
+          * PVM_VAL_INTEGRAL (PVM_VAL_OFF_UNIT (offset)));
+}
+
+int
+pvm_array_pack (pvm_val arr)
+{
+  pvm_array array = PVM_VAL_ARR (arr);
+  struct pvm_array_packed packed, *result;
+  uint64_t nelem, i;
+  pvm_val etype;
+
+  if (array->packed != NULL)
+    return 1;
+  if (array->lazy != NULL
+      || array->type == PVM_NULL
+      || PVM_VAL_TYP_CODE (array->type) != PVM_TYPE_ARRAY)
+    return 0;
+
+  etype = PVM_VAL_TYP_A_ETYPE (array->type);
+  nelem = PVM_VAL_ULONG (array->nelem);
+  if (PVM_VAL_TYP_CODE (etype) != PVM_TYPE_INTEGRAL
+      || nelem == 0)
+    return 0;
+
+  packed.size = PVM_VAL_ULONG (PVM_VAL_TYP_I_SIZE (etype));
+  packed.signed_p = PVM_VAL_UINT (PVM_VAL_TYP_I_SIGNED (etype));
+  packed.mapped_p = (array->elems[0].offset != PVM_NULL);
+  if (packed.mapped_p)
+    packed.offset = pvm_offset_bits (array->elems[0].offset);
+
+  /* Check that the offsets of the elements can be derived from the
+     offset of the first element.  */
+  for (i = 0; i < nelem; ++i)
+    {
+      pvm_val elem_offset = array->elems[i].offset;
+
+      if (!pvm_array_packed_fits_p (&packed, array->elems[i].value))
+        return 0;
+
+      if (packed.mapped_p
+          ? (elem_offset == PVM_NULL
+             || (pvm_offset_bits (elem_offset)
+                 != packed.offset + i * packed.size))
+          : elem_offset != PVM_NULL)
+        return 0;
+    }
+
+  result = pvm_make_array_packed (nelem, packed.size, packed.signed_p);
+  result->mapped_p = packed.mapped_p;
+  result->offset = packed.offset;
+  for (i = 0; i < nelem; ++i)
+    pvm_array_packed_put (result, i,
+                          pvm_array_packed_raw (array->elems[i].value));
+
+  array->elems = NULL;
+  array->packed = result;
+  return 1;
+}
+
+/* Store the elements of the packed array ARR as regular array
+   elements.  */
+
+static void
+pvm_array_unpack (pvm_val arr)
+{
+  pvm_array array = PVM_VAL_ARR (arr);
+  struct pvm_array_packed *packed = array->packed;
+  uint64_t nelem = PVM_VAL_ULONG (array->nelem);
+  struct pvm_array_elem *elems
+    = pvm_alloc (sizeof (struct pvm_array_elem) * nelem);
+  uint64_t i;
+
+  for (i = 0; i < nelem; ++i)
+    {
+      uint64_t raw = pvm_array_packed_get (packed, i);
+
+      elems[i].value = pvm_make_raw_integral (raw, packed->size,
+                                              packed->signed_p);
+      elems[i].offset = pvm_array_elem_offset (arr, i);
+    }
+
+  array->elems = elems;
+  array->packed = NULL;
+}
+
+void
+pvm_array_set_elem (pvm_val arr, uint64_t idx, pvm_val value)
+{
+  struct pvm_array_packed *packed = PVM_VAL_ARR_PACKED (arr);
+
+  assert (PVM_VAL_ARR_LAZY (arr) == NULL);
+
+  if (packed != NULL)
+    {
+      if (pvm_array_packed_fits_p (packed, value))
+        {
+          pvm_array_packed_put (packed, idx, pvm_array_packed_raw (value));
+          return;
+        }
+
+      /* The new value can't be stored compactly.  */
+      pvm_array_unpack (arr);
+    }
+
+  PVM_VAL_ARR_ELEM_VALUE (arr, idx) = value;
+}
+
+int
+pvm_array_contains (pvm_val arr, pvm_val value, int *found)
+{
+  struct pvm_array_packed *packed = PVM_VAL_ARR_PACKED (arr);
+  uint64_t nelem = PVM_VAL_ULONG (PVM_VAL_ARR_NELEM (arr));
+  uint64_t raw = pvm_array_packed_raw (value);
+  uint64_t i;
+
+  *found = 0;
+
+  if (packed != NULL)
+    {
+      /* Compare the stored integers directly.  */
+      uint64_t mask = (packed->width == 8
+                       ? (uint64_t) -1
+                       : ((uint64_t) 1 << (packed->width * 8)) - 1);
+
+      raw &= mask;
+      for (i = 0; i < nelem; ++i)
+        if (pvm_array_packed_get (packed, i) == raw)
+          {
+            *found = 1;
+            break;
+          }
+      return IOS_OK;
+    }
+
+  for (i = 0; i < nelem; ++i)
+    {
+      pvm_val elem;
+      int ret = pvm_array_elem (arr, i, &elem);
+
+      if (ret != IOS_OK)
+        return ret;
+      if (pvm_array_packed_raw (elem) == raw)
+        {
+          *found = 1;
+          break;
+        }
+    }
+
+  return IOS_OK;
+}
+
+int
+pvm_array_elem (pvm_val arr, uint64_t idx, pvm_val *value)
+{
+  struct pvm_array_lazy *lazy = PVM_VAL_ARR_LAZY (arr);
+  struct pvm_array_packed *packed = PVM_VAL_ARR_PACKED (arr);
+  pvm_val values[PVM_ARRAY_LAZY_CACHE_SIZE];
+  uint64_t nelem, first;
+  size_t slot, count, i;
+  ios io;
+  int ret;
+
+  if (packed != NULL)
+    {
+      *value = pvm_make_raw_integral (pvm_array_packed_get (packed, idx),
+                                      packed->size, packed->signed_p);
+      return IOS_OK;
+    }
+
+  if (lazy == NULL)
+    {
+      *value = PVM_VAL_ARR_ELEM_VALUE (arr, idx);
+      return IOS_OK;
+    }
+
+  if ((io = ios_get (lazy->ios_id)) == NULL)
+    return IOS_ERROR;
+
+  nelem = PVM_VAL_ULONG (PVM_VAL_ARR_NELEM (arr));
+  pvm_array_lazy_refresh (lazy, io, nelem);
+
+  slot = idx % PVM_ARRAY_LAZY_CACHE_SIZE;
+  if (lazy->cache_val[slot] != PVM_NULL
+      && lazy->cache_idx[slot] == idx)
+    {
+      *value = lazy->cache_val[slot];
+      return IOS_OK;
+    }
+
+  /* Elements are often referenced in order, so fill the cache with
+     the block of elements containing IDX.  */
+  first = idx - slot;
+  count = (first < nelem && nelem - first < PVM_ARRAY_LAZY_CACHE_SIZE
+           ? nelem - first : PVM_ARRAY_LAZY_CACHE_SIZE);
+
+  if (first >= nelem
+      || pvm_array_lazy_read (lazy, first, count, values) != IOS_OK)
+    {
+      /* Some element of the block can't be read: read just IDX.  */
+      ret = pvm_array_lazy_read (lazy, idx, 1, values);
+      if (ret != IOS_OK)
+        return ret;
+
+      lazy->cache_idx[slot] = idx;
+      lazy->cache_val[slot] = values[0];
+      *value = values[0];
+      return IOS_OK;
+    }
+
+  for (i = 0; i < count; ++i)
+    {
+      lazy->cache_idx[i] = first + i;
+      lazy->cache_val[i] = values[i];
+    }
+
+  *value = values[slot];
+  return IOS_OK;
+}
+
+pvm_val
+pvm_array_elem_offset (pvm_val arr, uint64_t idx)
+{
+  struct pvm_array_lazy *lazy = PVM_VAL_ARR_LAZY (arr);
+  struct pvm_array_packed *packed = PVM_VAL_ARR_PACKED (arr);
+
+  if (packed != NULL)
+    {
+      if (!packed->mapped_p)
+        return PVM_NULL;
+      return pvm_make_offset (pvm_make_ulong (packed->offset
+                                              + idx * packed->size, 64),
+                              pvm_make_ulong (1, 64));
+    }
+
+  if (lazy == NULL)
+    return PVM_VAL_ARR_ELEM_OFFSET (arr, idx);
+
+  return pvm_make_offset (pvm_make_ulong (lazy->offset
+                                          + idx * lazy->elem_size, 64),
+                          pvm_make_ulong (1, 64));
+}
+
+/* Read all the elements of the lazily mapped array ARRAY, so it
+   becomes a regular array.  Return an IOS status code.  */
+
+static int
+pvm_array_lazy_materialize (pvm_array array)
+{
+  struct pvm_array_lazy *lazy = array->lazy;
+  pvm_val values[PVM_ARRAY_LAZY_CACHE_SIZE];
+  uint64_t raw[PVM_ARRAY_LAZY_CACHE_SIZE];
+  struct pvm_array_packed *packed = NULL;
+  struct pvm_array_elem *elems = NULL;
+  uint64_t nelem, i, j;
+  ios io;
+
+  if (lazy == NULL)
+    return IOS_OK;
+
+  /* Integers are stored compactly, without boxing them.  */
+  nelem = PVM_VAL_ULONG (array->nelem);
+  if (PVM_VAL_TYP_CODE (lazy->etype) == PVM_TYPE_INTEGRAL)
+    {
+      int signed_p = PVM_VAL_UINT (PVM_VAL_TYP_I_SIGNED (lazy->etype));
+
+      packed = pvm_make_array_packed (nelem, lazy->elem_size, signed_p);
+      packed->mapped_p = 1;
+      packed->offset = lazy->offset;
+    }
+  else
+    elems = pvm_alloc (sizeof (struct pvm_array_elem) * nelem);
+
+  /* Let the IO space read all the elements at once.  */
+  io = ios_get (lazy->ios_id);
+  if (io != NULL)
+    ios_prefetch (io, lazy->offset, nelem * lazy->elem_size);
+
+  for (i = 0; i < nelem; i += PVM_ARRAY_LAZY_CACHE_SIZE)
+    {
+      size_t count = (nelem - i < PVM_ARRAY_LAZY_CACHE_SIZE
+                      ? nelem - i : PVM_ARRAY_LAZY_CACHE_SIZE);
+      int ret;
+
+      if (packed != NULL)
+        {
+          ret = pvm_array_lazy_read_raw (lazy, i, count, raw,
+                                         packed->signed_p);
+          if (ret != IOS_OK)
+            return ret;
+
+          for (j = 0; j < count; ++j)
+            pvm_array_packed_put (packed, i + j, raw[j]);
+          continue;
+        }
+
+      ret = pvm_array_lazy_read (lazy, i, count, values);
+      if (ret != IOS_OK)
+        return ret;
+
+      for (j = 0; j < count; ++j)
+        {
+          elems[i + j].value = values[j];
+          elems[i + j].offset
+            = pvm_make_offset (pvm_make_ulong (lazy->offset
+                                               + (i + j) * lazy->elem_size,
+                                               64),
+                               pvm_make_ulong (1, 64));
+        }
+    }
+
+  array->elems = elems;
+  array->packed = packed;
+  array->lazy = NULL;
+  return IOS_OK;
+}
+
+int
+pvm_array_materialize (pvm_val arr)
+{
+  return pvm_array_lazy_materialize (PVM_VAL_ARR (arr));
+}
+
+void
+pvm_array_materialize_ios (int ios_id)
+{
+  struct pvm_lazy_link **p = &lazy_links;
+
+  while (*p != NULL)
+    {
+      pvm_array arr = (*p)->arr;
+
+      if ((*p)->ios_id != ios_id)
+        {
+          p = &(*p)->next;
+          continue;
+        }
+
+      if (arr != NULL && arr->lazy != NULL)
+        pvm_array_lazy_materialize (arr);
+      pvm_lazy_unlink (p);
+    }
+}
+
 pvm_val
 pvm_make_struct (pvm_val nfields, pvm_val nmethods, pvm_val type)
 {
@@ -125,6 +776,8 @@ pvm_make_struct (pvm_val nfields, pvm_val nmethods, pvm_val type)
     = sizeof (struct pvm_struct_method) * PVM_VAL_ULONG (nmethods);
 
   sct->offset = PVM_NULL;
+  sct->ios = PVM_NULL;
+  sct->mapid = PVM_NULL;
   sct->mapper = PVM_NULL;
   sct->writer = PVM_NULL;
   sct->type = type;
@@ -395,6 +1048,61 @@ pvm_val_writer (pvm_val val)
   return PVM_NULL;
 }
 
+pvm_val
+pvm_val_copy (pvm_val val)
+{
+  if (PVM_IS_ARR (val))
+    {
+      pvm_val_box box = pvm_make_box (PVM_VAL_TAG_ARR);
+      pvm_array arr = pvm_alloc (sizeof (struct pvm_array));
+      uint64_t nelem = PVM_VAL_ULONG (PVM_VAL_ARR_NELEM (val));
+
+      *arr = *PVM_VAL_ARR (val);
+
+      /* The elements of arrays mapped lazily are read from IO, so
+         they can be shared.  */
+      if (arr->packed != NULL)
+        {
+          size_t nbytes = nelem * arr->packed->width;
+          struct pvm_array_packed *packed
+            = pvm_alloc (sizeof (struct pvm_array_packed));
+
+          *packed = *arr->packed;
+          packed->data = pvm_alloc_atomic (nbytes);
+          memcpy (packed->data, arr->packed->data, nbytes);
+          arr->packed = packed;
+        }
+      else if (arr->lazy != NULL)
+        pvm_lazy_link (arr, arr->lazy->ios_id);
+      else if (arr->elems != NULL)
+        {
+          size_t nbytes = sizeof (struct pvm_array_elem) * nelem;
+
+          arr->elems = pvm_alloc (nbytes);
+          memcpy (arr->elems, PVM_VAL_ARR (val)->elems, nbytes);
+        }
+
+      PVM_VAL_BOX_ARR (box) = arr;
+      return PVM_BOX (box);
+    }
+  else if (PVM_IS_SCT (val))
+    {
+      pvm_val_box box = pvm_make_box (PVM_VAL_TAG_SCT);
+      pvm_struct sct = pvm_alloc (sizeof (struct pvm_struct));
+      size_t nbytes = (sizeof (struct pvm_struct_field)
+                       * PVM_VAL_ULONG (PVM_VAL_SCT_NFIELDS (val)));
+
+      *sct = *PVM_VAL_SCT (val);
+      sct->fields = pvm_alloc (nbytes);
+      memcpy (sct->fields, PVM_VAL_SCT (val)->fields, nbytes);
+
+      PVM_VAL_BOX_SCT (box) = sct;
+      return PVM_BOX (box);
+    }
+
+  return val;
+}
+
 uint64_t
 pvm_sizeof (pvm_val val)
 {
@@ -414,6 +1122,11 @@ pvm_sizeof (pvm_val val)
       size_t size = 0;
 
       nelem = PVM_VAL_ULONG (PVM_VAL_ARR_NELEM (val));
+      if (PVM_VAL_ARR_LAZY (val) != NULL)
+        return nelem * PVM_VAL_ARR_LAZY (val)->elem_size;
+      if (PVM_VAL_ARR_PACKED (val) != NULL)
+        return nelem * PVM_VAL_ARR_PACKED (val)->size;
+
       for (i = 0; i < nelem; ++i)
         size += pvm_sizeof (PVM_VAL_ARR_ELEM_VALUE (val, i));
 
@@ -783,8 +1496,13 @@ pvm_print_val (pvm_val val, int base, int flags)
       pk_puts ("[");
       for (idx = 0; idx < nelem; idx++)
         {
-          pvm_val elem_offset = PVM_VAL_ARR_ELEM_OFFSET (val, idx);
-          pvm_val elem_value = PVM_VAL_ARR_ELEM_VALUE (val, idx);
+          pvm_val elem_offset = pvm_array_elem_offset (val, idx);
+          pvm_val elem_value;
+
+          /* Elements that can't be read from IO anymore are printed
+             as null.  */
+          if (pvm_array_elem (val, idx, &elem_value) != IOS_OK)
+            elem_value = PVM_NULL;
 
           if (idx != 0)
             pk_puts (",");
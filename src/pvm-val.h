@@ -186,9 +186,18 @@ void pvm_print_string (pvm_val string);
 /* Arrays values are boxed, and store sequences of homogeneous values
    called array "elements".  They can be mapped in IO, or unmapped.
 
-   OFFSET is an ulong<64> value with the bit offset in the current IO
-   space where the array is mapped.  If the array is not mapped then
-   this is PVM_NULL.
+   OFFSET is an ulong<64> value with the bit offset in the IO space
+   where the array is mapped.  If the array is not mapped then this is
+   PVM_NULL.
+
+   IOS is an int<32> value with the identifier of the IO space where
+   the array is mapped.  If the array is not mapped then this is
+   PVM_NULL.
+
+   MAPID is an ulong<64> value identifying the array in the update
+   index of the IO space where it is mapped, which tells whether it
+   is up to date.  If the array is not registered in the index then
+   this is PVM_NULL.  See ios_update_register.
 
    If the array is mapped, ELEMS_BOUND is an unsigned long containing
    the number of elements to which the map is bounded.  Similarly,
@@ -215,10 +224,20 @@ void pvm_print_string (pvm_val string);
    NELEM is the number of elements contained in the array.
 
    ELEMS is a list of elements.  The order of the elements is
-   relevant.  */
+   relevant.
+
+   LAZY is NULL unless the array is mapped lazily, in which case its
+   elements are read from IO when they are referenced, and ELEMS is
+   NULL.  See pvm_make_lazy_array below.
+
+   PACKED is NULL unless the elements of the array are integers stored
+   compactly, in which case ELEMS is NULL.  See pvm_array_pack
+   below.  */
 
 #define PVM_VAL_ARR(V) (PVM_VAL_BOX_ARR (PVM_VAL_BOX ((V))))
 #define PVM_VAL_ARR_OFFSET(V) (PVM_VAL_ARR(V)->offset)
+#define PVM_VAL_ARR_IOS(V) (PVM_VAL_ARR(V)->ios)
+#define PVM_VAL_ARR_MAPID(V) (PVM_VAL_ARR(V)->mapid)
 #define PVM_VAL_ARR_ELEMS_BOUND(V) (PVM_VAL_ARR(V)->elems_bound)
 #define PVM_VAL_ARR_SIZE_BOUND(V) (PVM_VAL_ARR(V)->size_bound)
 #define PVM_VAL_ARR_MAPPER(V) (PVM_VAL_ARR(V)->mapper)
@@ -226,10 +245,14 @@ void pvm_print_string (pvm_val string);
 #define PVM_VAL_ARR_TYPE(V) (PVM_VAL_ARR(V)->type)
 #define PVM_VAL_ARR_NELEM(V) (PVM_VAL_ARR(V)->nelem)
 #define PVM_VAL_ARR_ELEM(V,I) (PVM_VAL_ARR(V)->elems[(I)])
+#define PVM_VAL_ARR_LAZY(V) (PVM_VAL_ARR(V)->lazy)
+#define PVM_VAL_ARR_PACKED(V) (PVM_VAL_ARR(V)->packed)
 
 struct pvm_array
 {
   pvm_val offset;
+  pvm_val ios;
+  pvm_val mapid;
   pvm_val elems_bound;
   pvm_val size_bound;
   pvm_val mapper;
@@ -237,6 +260,8 @@ struct pvm_array
   pvm_val type;
   pvm_val nelem;
   struct pvm_array_elem *elems;
+  struct pvm_array_lazy *lazy;
+  struct pvm_array_packed *packed;
 };
 
 typedef struct pvm_array *pvm_array;
@@ -263,13 +288,133 @@ struct pvm_array_elem
 
 pvm_val pvm_make_array (pvm_val nelem, pvm_val type);
 
+/* Arrays of integers or offsets whose number of elements is known
+   when they are mapped can be mapped lazily: instead of reading all
+   the elements at once, each element is read from IO the first time
+   it is referenced.  This makes mapping a big array cheap when only a
+   few of its elements are used.
+
+   OFFSET is the bit offset in the IO space where the array is
+   mapped.  The elements are ELEM_SIZE bits long and of type ETYPE,
+   and they are read from the IO space whose identifier is IOS_ID,
+   using the given ENDIAN and NENC.
+
+   The most recently read elements are kept in a small cache, indexed
+   by the index of the element modulo PVM_ARRAY_LAZY_CACHE_SIZE.
+   CACHE_IDX holds the indexes of the cached elements, and CACHE_VAL
+   their values, which are PVM_NULL for the empty entries.  MAPID
+   identifies the elements in the update index of the IO space: once
+   some of them are written, the whole cache is emptied, so the cached
+   elements are never older than the others.
+
+   The elements are read into memory before the IO space is closed,
+   and the array becomes a regular array.  */
+
+#define PVM_ARRAY_LAZY_CACHE_SIZE 64
+
+struct pvm_array_lazy
+{
+  uint64_t offset;
+  uint64_t elem_size;
+  pvm_val etype;
+  int ios_id;
+  int endian;
+  int nenc;
+  uint64_t mapid;
+  uint64_t cache_idx[PVM_ARRAY_LAZY_CACHE_SIZE];
+  pvm_val cache_val[PVM_ARRAY_LAZY_CACHE_SIZE];
+};
+
+/* Build an array of NELEM elements of type TYPE, mapped lazily at
+   OFFSET in the IO space with identifier IOS_ID.  ENDIAN and NENC are
+   the ios_endian and ios_nenc used to read the elements.  */
+
+pvm_val pvm_make_lazy_array (pvm_val nelem, pvm_val type, pvm_val offset,
+                             int ios_id, int endian, int nenc);
+
+/* Arrays whose elements are all integers of the same type are stored
+   compactly, as a buffer of raw integers, rather than as a vector of
+   element values and element offsets.  This takes a fraction of the
+   memory, which matters for big arrays of bytes.
+
+   SIZE is the size in bits of the integers, and SIGNED_P is 1 if they
+   are signed, 0 otherwise.  Each integer occupies WIDTH bytes in
+   DATA, which is the smallest of 1, 2, 4 or 8 that can hold SIZE
+   bits.
+
+   MAPPED_P is 1 if the elements have offsets, in which case the first
+   element is at the bit offset OFFSET, and the rest follow it without
+   gaps.  */
+
+struct pvm_array_packed
+{
+  int size;
+  int signed_p;
+  int width;
+  int mapped_p;
+  uint64_t offset;
+  void *data;
+};
+
+/* Store the elements of the array ARR compactly, if they are all
+   integers of the type of the elements of the array and they are
+   contiguous.  Return 1 if the array is now stored compactly, 0
+   otherwise.  */
+
+int pvm_array_pack (pvm_val arr);
+
+/* Set the element IDX of the array ARR to VALUE.  IDX should be a
+   valid index, and ARR should not be mapped lazily.  */
+
+void pvm_array_set_elem (pvm_val arr, uint64_t idx, pvm_val value);
+
+/* Set FOUND to 1 if some element of the array ARR is equal to the
+   integer VALUE, to 0 otherwise.  The elements of ARR should be
+   integers of the same type than VALUE.  Return IOS_OK on success, or
+   the IOS error code if some element couldn't be read.  */
+
+int pvm_array_contains (pvm_val arr, pvm_val value, int *found);
+
+/* Put in VALUE the element IDX of the array ARR, reading it from IO if
+   the array is mapped lazily.  IDX should be a valid index.  Return
+   IOS_OK on success, or the IOS error code if the element couldn't be
+   read.  */
+
+int pvm_array_elem (pvm_val arr, uint64_t idx, pvm_val *value);
+
+/* Return the offset of the element IDX of the array ARR, if the
+   array is mapped, PVM_NULL otherwise.  */
+
+pvm_val pvm_array_elem_offset (pvm_val arr, uint64_t idx);
+
+/* Read all the elements of ARR from IO if it is mapped lazily, so it
+   becomes a regular array.  Return IOS_OK on success, or the IOS
+   error code if some element couldn't be read, in which case ARR is
+   left untouched.  */
+
+int pvm_array_materialize (pvm_val arr);
+
+/* Read all the elements of the arrays mapped lazily from the IO space
+   with identifier IOS_ID, because the space is about to be closed.
+   The arrays whose elements can't be read are left untouched.  */
+
+void pvm_array_materialize_ios (int ios_id);
+
 /* Struct values are boxed, and store collections of named values
    called structure "elements".  They can be mapped in IO, or
    unmapped.
 
-   OFFSET is the offset in the current IO space where the structure is
+   OFFSET is the offset in the IO space where the structure is
    mapped.  If the structure is not mapped then this is PVM_NULL.
 
+   IOS is an int<32> value with the identifier of the IO space where
+   the structure is mapped.  If the structure is not mapped then this
+   is PVM_NULL.
+
+   MAPID is an ulong<64> value identifying the structure in the update
+   index of the IO space where it is mapped.  If the structure is not
+   registered in the index then this is PVM_NULL.
+
    TYPE is the type of the struct.  This includes the types of the
    struct fields.
 
@@ -285,6 +430,8 @@ pvm_val pvm_make_array (pvm_val nelem, pvm_val type);
 
 #define PVM_VAL_SCT(V) (PVM_VAL_BOX_SCT (PVM_VAL_BOX ((V))))
 #define PVM_VAL_SCT_OFFSET(V) (PVM_VAL_SCT((V))->offset)
+#define PVM_VAL_SCT_IOS(V) (PVM_VAL_SCT((V))->ios)
+#define PVM_VAL_SCT_MAPID(V) (PVM_VAL_SCT((V))->mapid)
 #define PVM_VAL_SCT_MAPPER(V) (PVM_VAL_SCT((V))->mapper)
 #define PVM_VAL_SCT_WRITER(V) (PVM_VAL_SCT((V))->writer)
 #define PVM_VAL_SCT_TYPE(V) (PVM_VAL_SCT((V))->type)
@@ -296,6 +443,8 @@ pvm_val pvm_make_array (pvm_val nelem, pvm_val type);
 struct pvm_struct
 {
   pvm_val offset;
+  pvm_val ios;
+  pvm_val mapid;
   pvm_val mapper;
   pvm_val writer;
   pvm_val type;
@@ -554,7 +703,7 @@ pvm_val pvm_make_offset (pvm_val magnitude, pvm_val unit);
 /* The following macros allow to handle map-able PVM values (such as
    arrays and structs) polymorphically.
 
-   It is important for the PVM_VAL_SET_{OFFSET,MAPPER,WRITER} to work
+   It is important for the PVM_VAL_SET_{OFFSET,IOS,MAPPER,WRITER} to work
    for non-mappeable values, as nops, as they are used in the
    implementation of the `unmap' operator.  */
 
@@ -572,6 +721,44 @@ pvm_val pvm_make_offset (pvm_val magnitude, pvm_val unit);
         PVM_VAL_SCT_OFFSET ((V)) = (O);         \
     } while (0)
 
+#define PVM_VAL_IOS(V)                                  \
+  (PVM_IS_ARR ((V)) ? PVM_VAL_ARR_IOS ((V))             \
+   : PVM_IS_SCT ((V)) ? PVM_VAL_SCT_IOS ((V))           \
+   : PVM_NULL)
+
+/* Note that the identifier of a value in the update index of an IO
+   space is meaningless in any other space.  Hence PVM_VAL_SET_IOS
+   also unregisters the value.  */
+
+#define PVM_VAL_SET_IOS(V,I)                    \
+  do                                            \
+    {                                           \
+      if (PVM_IS_ARR ((V)))                     \
+        {                                       \
+          PVM_VAL_ARR_IOS ((V)) = (I);          \
+          PVM_VAL_ARR_MAPID ((V)) = PVM_NULL;   \
+        }                                       \
+      else if (PVM_IS_SCT ((V)))                \
+        {                                       \
+          PVM_VAL_SCT_IOS ((V)) = (I);          \
+          PVM_VAL_SCT_MAPID ((V)) = PVM_NULL;   \
+        }                                       \
+    } while (0)
+
+#define PVM_VAL_MAPID(V)                                \
+  (PVM_IS_ARR ((V)) ? PVM_VAL_ARR_MAPID ((V))           \
+   : PVM_IS_SCT ((V)) ? PVM_VAL_SCT_MAPID ((V))         \
+   : PVM_NULL)
+
+#define PVM_VAL_SET_MAPID(V,I)                  \
+  do                                            \
+    {                                           \
+      if (PVM_IS_ARR ((V)))                     \
+        PVM_VAL_ARR_MAPID ((V)) = (I);          \
+      else if (PVM_IS_SCT ((V)))                \
+        PVM_VAL_SCT_MAPID ((V)) = (I);          \
+    } while (0)
+
 #define PVM_VAL_MAPPER(V)                               \
   (PVM_IS_ARR ((V)) ? PVM_VAL_ARR_MAPPER ((V))          \
    : PVM_IS_SCT ((V)) ? PVM_VAL_SCT_MAPPER ((V))        \
@@ -636,6 +823,13 @@ pvm_val pvm_elemsof (pvm_val val);
 pvm_val pvm_val_mapper (pvm_val val);
 pvm_val pvm_val_writer (pvm_val val);
 
+/* Return a shallow copy of VAL, i.e. a new array or struct whose
+   elements or fields are the same values than the ones of VAL.
+   Changing the mapping attributes of the copy doesn't affect VAL.
+   Values other than arrays and structs are returned unchanged.  */
+
+pvm_val pvm_val_copy (pvm_val val);
+
 /* Print a pvm_val to the given file descriptor.
 
    If PVM_PRINT_F_MAPS is specified in FLAGS, then the attributes of
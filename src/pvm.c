@@ -47,6 +47,15 @@ struct pvm
   struct pvm_state pvm_state;
 };
 
+/* Arrays mapped lazily read their elements from IO, so they are read
+   into memory before the IO space is closed.  */
+
+static void
+pvm_close_ios (ios io)
+{
+  pvm_array_materialize_ios (ios_get_id (io));
+}
+
 pvm
 pvm_init (void)
 {
@@ -78,6 +87,10 @@ pvm_init (void)
      registering GC roots, since we are allocating memory.  */
   PVM_STATE_ENV (apvm) = pvm_env_new ();
 
+  /* Initialize the cache of mapped values.  */
+  pvm_cache_initialize ();
+  ios_set_close_hook (pvm_close_ios);
+
   return apvm;
 }
 
@@ -102,6 +115,11 @@ pvm_shutdown (pvm apvm)
     (apvm->pvm_state.pvm_state_backing.jitter_stack_exceptionstack_backing.memory,
      apvm->pvm_state.pvm_state_backing.jitter_stack_exceptionstack_backing.element_no);
 
+  ios_set_close_hook (NULL);
+
+  /* Finalize the cache of mapped values.  */
+  pvm_cache_finalize ();
+
   /* Finalize the VM state.  */
   pvm_state_finalize (&apvm->pvm_state);
 
@@ -26,6 +26,7 @@
 #include "pvm-val.h"
 #include "pvm-env.h"
 #include "pvm-alloc.h"
+#include "pvm-cache.h"
 
 /* The following enumeration contains every possible exit code
    resulting from the execution of a routine in the PVM.